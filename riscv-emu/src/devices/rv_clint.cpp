@@ -1 +1,105 @@
-#include "rv_clint.hpp"
\ No newline at end of file
+#include "rv_clint.hpp"
+
+constexpr uint32_t RV_CLINT_MSIP_IRQ = 3;
+constexpr uint32_t RV_CLINT_MTIP_IRQ = 7;
+
+// register offsets
+constexpr uint32_t RV_CLINT_MSIP = 0x0000;
+constexpr uint32_t RV_CLINT_MTIMECMP = 0x4000;
+constexpr uint32_t RV_CLINT_MTIME = 0xBFF8;
+
+void rv_clint::reset()
+{
+    std::lock_guard<std::mutex> lock{timer_lock_};
+    for (auto& h: harts_) {
+        h.msip = 0;
+        h.mtimecmp = RV_EVENT_NEVER;
+        h.irq(RV_CLINT_MSIP_IRQ, false);
+        update_timer(h);
+    }
+}
+
+void rv_clint::attach_hart(std::function<void(uint32_t,bool)> irq)
+{
+    const size_t index = harts_.size();
+    const auto timer = events_.add([this, index]() {
+        // mtimecmp may have been moved since the event was found due
+        std::lock_guard<std::mutex> lock{timer_lock_};
+        if (harts_[index].mtimecmp <= events_.now())
+            harts_[index].irq(RV_CLINT_MTIP_IRQ, true);
+    });
+    harts_.push_back({std::move(irq), 0, RV_EVENT_NEVER, timer});
+}
+
+void rv_clint::save(rv_snapshot_writer& out) const
+{
+    out.put((uint32_t)harts_.size());
+    for (const auto& h: harts_) {
+        out.put(h.msip);
+        out.put(h.mtimecmp);
+    }
+}
+
+bool rv_clint::restore(rv_snapshot_reader& in)
+{
+    uint32_t count;
+    if (!in.get(count) || count != harts_.size())
+        return false;
+
+    std::lock_guard<std::mutex> lock{timer_lock_};
+    for (auto& h: harts_) {
+        in.get(h.msip);
+        in.get(h.mtimecmp);
+        h.irq(RV_CLINT_MSIP_IRQ, h.msip != 0);
+        update_timer(h);
+    }
+    return in.ok();
+}
+
+void rv_clint::update_timer(hart& h)
+{
+    // the interrupt stays pending until mtimecmp moves past mtime again
+    if (h.mtimecmp <= events_.now()) {
+        events_.cancel(h.timer);
+        h.irq(RV_CLINT_MTIP_IRQ, true);
+    }
+    else {
+        h.irq(RV_CLINT_MTIP_IRQ, false);
+        events_.schedule(h.timer, h.mtimecmp);
+    }
+}
+
+bool rv_clint::read_u32(uint32_t regNo, uint32_t& value)
+{
+    value = 0;
+    if (regNo < RV_CLINT_MSIP + 4 * harts_.size()) {
+        value = harts_[(regNo - RV_CLINT_MSIP) / 4].msip;
+    }
+    else if (regNo >= RV_CLINT_MTIMECMP && regNo < RV_CLINT_MTIMECMP + 8 * harts_.size()) {
+        const auto& h = harts_[(regNo - RV_CLINT_MTIMECMP) / 8];
+        value = (uint32_t)(h.mtimecmp >> (regNo & 4 ? 32 : 0));
+    }
+    else if (regNo == RV_CLINT_MTIME || regNo == RV_CLINT_MTIME + 4) {
+        value = (uint32_t)(events_.now() >> (regNo & 4 ? 32 : 0));
+    }
+    return true;
+}
+
+bool rv_clint::write_u32(uint32_t regNo, uint32_t value)
+{
+    if (regNo < RV_CLINT_MSIP + 4 * harts_.size()) {
+        auto& h = harts_[(regNo - RV_CLINT_MSIP) / 4];
+        h.msip = value & 1;
+        h.irq(RV_CLINT_MSIP_IRQ, h.msip != 0);
+    }
+    else if (regNo >= RV_CLINT_MTIMECMP && regNo < RV_CLINT_MTIMECMP + 8 * harts_.size()) {
+        auto& h = harts_[(regNo - RV_CLINT_MTIMECMP) / 8];
+        std::lock_guard<std::mutex> lock{timer_lock_};
+        if ((regNo & 4) != 0)
+            h.mtimecmp = (h.mtimecmp & 0xFFFFFFFF) | ((uint64_t)value << 32);
+        else
+            h.mtimecmp = (h.mtimecmp & ~(uint64_t)0xFFFFFFFF) | value;
+        update_timer(h);
+    }
+    return true;
+}
\ No newline at end of file
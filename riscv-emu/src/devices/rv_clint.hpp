@@ -0,0 +1,50 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <rv_device.hpp>
+#include <rv_event_queue.hpp>
+
+// core local interruptor (SiFive layout)
+// one msip register per hart at the start of the device, its low bit drives
+// the machine software interrupt of that hart, harts use it to interrupt each other
+// mtime is the virtual time of the event queue (one tick per retired instruction, writes
+// are ignored), each hart's mtimecmp is an event raising its machine timer interrupt when due
+class rv_clint : public rv_device
+{
+public:
+    rv_clint() = delete;
+
+    rv_clint(std::string _device_name, rv_uint _base_address, rv_uint _top_address, rv_event_queue& events)
+        : rv_device(std::move(_device_name), _base_address, _top_address), events_{events}
+    {
+    }
+
+    void reset() override;
+    // harts are numbered in the order they are attached, irq is called with the interrupt number
+    void attach_hart(std::function<void(uint32_t,bool)> irq);
+
+    // the event queue must be restored first, timers are rescheduled from its time
+    void save(rv_snapshot_writer& out) const override;
+    bool restore(rv_snapshot_reader& in) override;
+
+    bool read_u32(uint32_t regNo, uint32_t& value) override;
+    bool write_u32(uint32_t regNo, uint32_t value) override;
+
+private:
+    struct hart
+    {
+        std::function<void(uint32_t,bool)> irq;
+        uint32_t msip;
+        uint64_t mtimecmp;
+        size_t timer;
+    };
+
+    void update_timer(hart& h);
+
+private:
+    rv_event_queue& events_;
+    std::vector<hart> harts_;
+    // timer events fire on the thread advancing time, outside of the device lock
+    std::mutex timer_lock_;
+};
\ No newline at end of file
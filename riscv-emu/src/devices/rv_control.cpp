@@ -0,0 +1,26 @@
+#include "rv_control.hpp"
+
+bool rv_control::read_u32(uint32_t regNo, uint32_t& value)
+{
+    value = 0;
+    return regNo == RV_CONTROL_EXIT || regNo == RV_CONTROL_FORK;
+}
+
+bool rv_control::write_u32(uint32_t regNo, uint32_t value)
+{
+    switch (regNo) {
+    case RV_CONTROL_EXIT:
+        if ((value & 0xFFFF) == RV_CONTROL_EXIT_PASS && exit_)
+            exit_(0);
+        else if ((value & 0xFFFF) == RV_CONTROL_EXIT_FAIL && exit_)
+            exit_(value >> 16);
+        break;
+    case RV_CONTROL_FORK:
+        if (fork_point_)
+            fork_point_();
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
\ No newline at end of file
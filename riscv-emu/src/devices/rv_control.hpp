@@ -0,0 +1,38 @@
+#pragma once
+#include <functional>
+#include <rv_device.hpp>
+
+// register offsets
+constexpr uint32_t RV_CONTROL_EXIT = 0x0;
+constexpr uint32_t RV_CONTROL_FORK = 0x4;
+
+// values written to RV_CONTROL_EXIT, as the SiFive test finisher
+// fail carries the exit code in the upper 16 bits
+constexpr uint32_t RV_CONTROL_EXIT_PASS = 0x5555;
+constexpr uint32_t RV_CONTROL_EXIT_FAIL = 0x3333;
+
+// emulator control, no such thing in real hardware
+// guests end the run with an exit code, and mark the point where a fork server
+// (see rv_machine::fork_server) starts forking jobs off the machine
+class rv_control : public rv_device
+{
+public:
+    rv_control() = delete;
+    rv_control(std::string _device_name, rv_uint _base_address, rv_uint _top_address)
+        : rv_device(std::move(_device_name), _base_address, _top_address)
+    {
+    }
+
+    void reset() override {}
+
+    // called by the writing hart with the device lock held
+    void set_exit(std::function<void(uint32_t)> exit) { exit_ = std::move(exit); }
+    void set_fork_point(std::function<void()> fork_point) { fork_point_ = std::move(fork_point); }
+
+    bool read_u32(uint32_t regNo, uint32_t& value) override;
+    bool write_u32(uint32_t regNo, uint32_t value) override;
+
+private:
+    std::function<void(uint32_t)> exit_;
+    std::function<void()> fork_point_;
+};
\ No newline at end of file
@@ -29,6 +29,22 @@ void rv_plic::check_interrupt()
     set_irq((pending_ & served_) != 0);
 }
 
+void rv_plic::save(rv_snapshot_writer& out) const
+{
+    out.put(pending_);
+    out.put(served_);
+    out.put(enabled_);
+}
+
+bool rv_plic::restore(rv_snapshot_reader& in)
+{
+    in.get(pending_);
+    in.get(served_);
+    in.get(enabled_);
+    check_interrupt();
+    return in.ok();
+}
+
 bool rv_plic::read_u32(uint32_t regNo, uint32_t& value)
 {
     switch (regNo) {
@@ -17,6 +17,9 @@ public:
     void attach(rv_device *dev, uint32_t int_number);
 /*    void detach(uint32_t int_number);
 */
+    void save(rv_snapshot_writer& out) const override;
+    bool restore(rv_snapshot_reader& in) override;
+
     bool read_u32(uint32_t regNo, uint32_t& value) override;
     bool write_u32(uint32_t regNo, uint32_t value) override;
 
@@ -12,29 +12,92 @@ void rv_uart::reset()
     txctrl_ = 0;
     rxctrl_ = 0;
     ie_ = 0;
-    ip_ = 0;
+    rx_enabled_ = false;
+    tx_enabled_ = false;
 }
 
-bool rv_uart::read_u32(uint32_t regNo, uint32_t& value)
+uint32_t rv_uart::ip() const
+{
+    const auto rxwm = (rxctrl_ & RV_UART_RXCTRL_RXCNT) >> RV_UART_RXCTRL_RXCNT;
+    const auto txwm = (txctrl_ & RV_UART_TXCTRL_TXCNT) >> RV_UART_TXCTRL_TXCNT;
+
+    uint32_t ip = 0;
+    if (rxfifo_.count() > rxwm)
+        ip |= RV_UART_IP_RXWM;
+    if (txfifo_.count() < txwm)
+        ip |= RV_UART_IP_TXWM;
+    return ip;
+}
+
+void rv_uart::update()
+{
+    set_irq((ie_ & ip()) != 0);
+}
+
+template<size_t N>
+static void save_fifo(rv_snapshot_writer& out, const rv_byte_ring<N>& fifo)
+{
+    std::array<uint8_t, N> data;
+    const uint32_t len = fifo.peek(data.data(), data.size());
+    out.put(len);
+    out.put_bytes(data.data(), len);
+}
+
+template<size_t N>
+static bool restore_fifo(rv_snapshot_reader& in, rv_byte_ring<N>& fifo)
+{
+    std::array<uint8_t, N> data;
+    uint32_t len;
+    if (!in.get(len) || len > N || !in.get_bytes(data.data(), len))
+        return false;
+    fifo.clear();
+    fifo.put(data.data(), len);
+    return true;
+}
+
+void rv_uart::save(rv_snapshot_writer& out) const
+{
+    out.put(txctrl_);
+    out.put(rxctrl_);
+    out.put(ie_);
+    save_fifo(out, rxfifo_);
+    save_fifo(out, txfifo_);
+}
+
+bool rv_uart::restore(rv_snapshot_reader& in)
 {
-    auto rxwm = (rxctrl_ & RV_UART_RXCTRL_RXCNT) >> RV_UART_RXCTRL_RXCNT;
+    in.get(txctrl_);
+    in.get(rxctrl_);
+    in.get(ie_);
+    if (!restore_fifo(in, rxfifo_) || !restore_fifo(in, txfifo_))
+        return false;
+    tx_enabled_.store((txctrl_ & RV_UART_TXCTRL_TXEN) != 0, std::memory_order_release);
+    rx_enabled_.store((rxctrl_ & RV_UART_RXCTRL_RXEN) != 0, std::memory_order_release);
+    update();
+    return true;
+}
 
+bool rv_uart::read_u32(uint32_t regNo, uint32_t& value)
+{
     switch((uart_reg)regNo) {
     case uart_reg::txdata:
         value = 0;
         if (txfifo_.full())
             value |= 0x80000000;
         break;
-    case uart_reg::rxdata:
-        if (rxfifo_.empty())
+    case uart_reg::rxdata: {
+        uint8_t b;
+        if (rxfifo_.get(&b, 1) == 0) {
             value = 0x80000000;
-        else
-            value = (uint32_t)rxfifo_.dequeue();
-        if (rxfifo_.count() <= rxwm) {
-            ip_ &= ~RV_UART_IP_RXWM;
-//            set_irq((ie_ & ip_) != 0);
         }
-        break;
+        else {
+            value = b;
+            // room for more input
+            notify_host();
+            update();
+        }
+    }
+    break;
     case uart_reg::rxctrl:
         value = rxctrl_;
         break;
@@ -44,7 +107,7 @@ bool rv_uart::read_u32(uint32_t regNo, uint32_t& value)
     case uart_reg::div:
         break;
     case uart_reg::ip:
-        value = ip_;
+        value = ip();
         break;
     case uart_reg::ie:
         value = ie_;
@@ -58,22 +121,33 @@ bool rv_uart::read_u32(uint32_t regNo, uint32_t& value)
 bool rv_uart::write_u32(uint32_t regNo, uint32_t value)
 {
     switch((uart_reg)regNo) {
-    case uart_reg::txdata:
-        if (!txfifo_.full())
-            txfifo_.enqueue((uint8_t)(value & 0xFF));
-        break;
+    case uart_reg::txdata: {
+        const uint8_t b = value & 0xFF;
+        if (txfifo_.put(&b, 1) != 0) {
+            notify_host();
+            update();
+        }
+    }
+    break;
     case uart_reg::rxdata:
         break;
     case uart_reg::txctrl:
         txctrl_ = value;
+        tx_enabled_.store((txctrl_ & RV_UART_TXCTRL_TXEN) != 0, std::memory_order_release);
+        notify_host();
+        update();
         break;
     case uart_reg::rxctrl:
         rxctrl_ = value;
+        rx_enabled_.store((rxctrl_ & RV_UART_RXCTRL_RXEN) != 0, std::memory_order_release);
+        notify_host();
+        update();
         break;
     case uart_reg::div:
         break;
     case uart_reg::ie:
         ie_ = (ie_ & ~3) | (value & 3);
+        update();
         break;
     case uart_reg::ip:
         break;
@@ -83,16 +157,6 @@ bool rv_uart::write_u32(uint32_t regNo, uint32_t value)
     return true;
 }
 
-void rv_uart::write_data(const uint8_t *data, size_t len)
-{
-    rxfifo_.put(data, len);
-    auto rxwm = (rxctrl_ & RV_UART_RXCTRL_RXCNT) >> RV_UART_RXCTRL_RXCNT;
-
-    if (rxfifo_.count() > rxwm) {
-        ip_ |= RV_UART_IP_RXWM;
-        set_irq((ie_ & ip_) != 0);
-    }
-}
 /*
 void rv_uart::update()
 {
@@ -3,8 +3,10 @@
 #include <functional>
 #include <string>
 #include <cassert>
+#include <atomic>
 #include <rv_bits.hpp>
 #include <rv_device.hpp>
+#include <rv_byte_ring.hpp>
 
 enum class uart_reg
 {
@@ -31,50 +33,14 @@ constexpr auto RV_UART_IE_RXWM = rv_bitfield<1,1>{};
 constexpr auto RV_UART_IP_TXWM = rv_bitfield<1,0>{};
 constexpr auto RV_UART_IP_RXWM = rv_bitfield<1,1>{};
 
-template<std::size_t l>
-class uart_fifo
-{
-public:
-    uart_fifo() = default;
-
-    bool full() const { return count_ == l; }
-    bool empty() const { return count_ == 0; }
-
-    void put(const uint8_t *data, size_t len)
-    {
-        for (size_t i = 0; i < len; ++i)
-            enqueue(*data++);
-    }
-
-    void get(uint8_t *data, size_t len)
-    {
-        for (size_t i = 0; i < len; ++i)
-            data[i] = dequeue();
-    }
-
-    void enqueue(uint8_t b)
-    {
-        buf_[tail_] = b;
-        tail_ = (tail_ + 1) % l;
-        ++count_;
-    }
-    uint8_t dequeue()
-    {
-        const auto val = buf_[head_];
-        head_ = (head_+1) % l;
-        --count_;
-        return val;
-    }
-
-    size_t count() const { return count_; }
-    size_t free_space() const { return l - count_; }
-private:
-    std::array<uint8_t, l> buf_;
-    size_t head_ = 0;
-    size_t tail_ = 0;
-    size_t count_ = 0;
-};
+// transmit and receive fifos are rings shared with the host I/O thread, deeper than the
+// 8 entries of the real thing so the guest rarely has to wait for the host
+constexpr size_t RV_UART_FIFO_SIZE = 256;
 
+// SiFive UART
+// the guest side (registers) is accessed with the device lock held, the host side is
+// lock-free and meant for a single I/O thread, which tells the machine when it moved data
+// so update() can recompute the interrupt on the guest side
 class rv_uart : public rv_device
 {
 public:
@@ -87,23 +53,38 @@ public:
 
     void reset() override;
 
-    void write_data(const uint8_t *data, size_t len);
-    bool can_write() const { return !rxfifo_.full() && (rxctrl_ & RV_UART_RXCTRL_RXEN) != 0; }
-    size_t write_len() const { return rxfifo_.free_space(); }
+    // host side: input for the guest and output from it
+    size_t host_write(const uint8_t *data, size_t len) { return rx_enabled_.load(std::memory_order_acquire) ? rxfifo_.put(data, len) : 0; }
+    size_t host_write_len() const { return rx_enabled_.load(std::memory_order_acquire) ? rxfifo_.free_space() : 0; }
+    size_t host_read(uint8_t *data, size_t len) { return tx_enabled_.load(std::memory_order_acquire) ? txfifo_.get(data, len) : 0; }
+    bool host_can_read() const { return tx_enabled_.load(std::memory_order_acquire) && !txfifo_.empty(); }
+
+    // called from the guest side when the host has something new to do: output to send,
+    // room for more input, or a fifo just enabled
+    void set_host_notify(std::function<void()> notify) { host_notify_ = std::move(notify); }
+
+    // guest side: the host moved data, update the pending interrupts
+    void update();
 
-    void read_data(uint8_t *data, size_t len) { txfifo_.get(data, len); }
-    bool can_read() const { return !txfifo_.empty() && (txctrl_ & RV_UART_TXCTRL_TXEN) != 0; }
-    size_t read_len() const { return txfifo_.count(); }
+    // fifo contents included, the host side must be idle
+    void save(rv_snapshot_writer& out) const override;
+    bool restore(rv_snapshot_reader& in) override;
 
     // read/write from the cpu (only 32bit mmio is supported for uart)
     bool read_u32(uint32_t regNo, uint32_t& value) override;
     bool write_u32(uint32_t regNo, uint32_t value) override;
 
 private:
-    uart_fifo<8> rxfifo_;
-    uart_fifo<8> txfifo_;
+    uint32_t ip() const;
+    void notify_host() { if (host_notify_) host_notify_(); }
+
+private:
+    rv_byte_ring<RV_UART_FIFO_SIZE> rxfifo_;
+    rv_byte_ring<RV_UART_FIFO_SIZE> txfifo_;
+    std::atomic<bool> rx_enabled_{false};
+    std::atomic<bool> tx_enabled_{false};
+    std::function<void()> host_notify_;
     uint32_t txctrl_ = 0;
     uint32_t rxctrl_ = 0;
-    uint32_t ip_ = 0;
     uint32_t ie_ = 0;
 };
\ No newline at end of file
@@ -1,18 +1,254 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <unistd.h>
+#include <chrono>
 #include "rv_machine.hpp"
+#include "rv_batch.hpp"
+#include "rv_code_store.hpp"
 
-int main()
+static const char *reason_name(rv_stop_reason reason)
 {
-    rv_machine m;
+    switch (reason) {
+    case rv_stop_reason::exited:
+        return "exit";
+    case rv_stop_reason::budget:
+        return "budget";
+    case rv_stop_reason::crashed:
+        return "crash";
+    default:
+        return "stopped";
+    }
+}
+
+// a hit rate for the chaining report, n/a for links that were never looked up
+static std::string hit_rate(uint64_t hits, uint64_t misses)
+{
+    const double rate = rv_chain_stats::hit_rate(hits, misses);
+    if (std::isnan(rate))
+        return "n/a";
+    char text[16];
+    snprintf(text, sizeof(text), "%.1f%%", rate);
+    return text;
+}
+
+// hit rates of the links the dispatcher followed, to stderr
+static void print_chain_stats(const rv_chain_stats& chain)
+{
+    fprintf(stderr, "chaining: static %s, inline cache %s, return stack %s, %llu native entries\n",
+            hit_rate(chain.static_hits, chain.static_misses).c_str(),
+            hit_rate(chain.ic_hits, chain.ic_misses).c_str(),
+            hit_rate(chain.ras_hits, chain.ras_misses).c_str(),
+            (unsigned long long)chain.native_entries);
+}
+
+// jobs are read from stdin, an input file and an optional instruction budget per line
+// each job's console output goes to <input>.out, stdout gets a line per job
+static int run_fork_server(rv_machine& m)
+{
+    m.set_console(-1, STDERR_FILENO);
+
+    std::string path;
+    auto next_job = [&path](rv_job& job) {
+        char line[4096];
+        char name[4096];
+        while (fgets(line, sizeof(line), stdin) != nullptr) {
+            unsigned long long budget = 0;
+            if (sscanf(line, "%4095s %llu", name, &budget) < 1)
+                continue;
+            std::ifstream input{name, std::ios::binary};
+            if (!input) {
+                fprintf(stderr, "%s: can't read\n", name);
+                continue;
+            }
+            path = name;
+            job.input.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+            job.budget = budget;
+            return true;
+        }
+        return false;
+    };
+    auto done = [&path](const rv_job&, const rv_job_result& result) {
+        std::ofstream{path + ".out", std::ios::binary} << result.output;
+        printf("%s: %s %u, %llu instructions\n", path.c_str(), reason_name(result.reason), result.exit_code,
+               (unsigned long long)result.instructions);
+        fflush(stdout);
+    };
+
+    if (!m.fork_server(next_job, done)) {
+        fprintf(stderr, "test.bin stopped before its fork point\n");
+        return 1;
+    }
+    return 0;
+}
+
+static bool read_file(const char *name, std::string& data)
+{
+    std::ifstream file{name, std::ios::binary};
+    if (!file)
+        return false;
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// jobs are read from stdin, an image, an input file, an instruction budget and the file
+// holding the expected output per line, "-" for no input and for output that isn't checked
+// they all run at once, a line per job goes to stdout as they finish, then a summary
+static int run_batch(size_t harts, size_t ram_size, bool guard_pages, const rv_tier_config& tiers)
+{
+    std::vector<rv_batch_job> jobs;
+    std::vector<std::string> names;
+    char line[4096 * 2];
+    char image[4096];
+    char input[4096];
+    char expected[4096];
+    while (fgets(line, sizeof(line), stdin) != nullptr) {
+        unsigned long long budget = 0;
+        strcpy(input, "-");
+        strcpy(expected, "-");
+        if (sscanf(line, "%4095s %4095s %llu %4095s", image, input, &budget, expected) < 1)
+            continue;
+        rv_batch_job job;
+        job.image = image;
+        job.run.budget = budget;
+        job.check = strcmp(expected, "-") != 0;
+        if ((strcmp(input, "-") != 0 && !read_file(input, job.run.input)) ||
+            (job.check && !read_file(expected, job.expected))) {
+            fprintf(stderr, "%s: can't read its input or expected output\n", image);
+            continue;
+        }
+        jobs.push_back(std::move(job));
+        names.push_back(std::string{image} + " " + input);
+    }
+
+    auto done = [&](size_t i, const rv_batch_result& result) {
+        if (!result.error.empty()) {
+            printf("%s: %s\n", names[i].c_str(), result.error.c_str());
+        }
+        else {
+            printf("%s: %s %u, %llu instructions, %.1f MIPS%s\n", names[i].c_str(), reason_name(result.run.reason),
+                   result.run.exit_code, (unsigned long long)result.run.instructions, result.mips(),
+                   !jobs[i].check ? "" : result.passed ? ", ok" : ", FAILED");
+        }
+        fflush(stdout);
+    };
+
+    rv_batch batch{harts, ram_size, guard_pages};
+    batch.set_tiers(tiers);
+    const auto start = std::chrono::steady_clock::now();
+    const auto results = batch.run(jobs, 0, done);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    size_t failed = 0;
+    uint64_t instructions = 0;
+    rv_chain_stats chain;
+    for (size_t i = 0; i < results.size(); ++i) {
+        instructions += results[i].run.instructions;
+        chain += results[i].run.chain;
+        if (!results[i].passed) {
+            ++failed;
+            fprintf(stderr, "--- %s output:\n%s\n", names[i].c_str(), results[i].run.output.c_str());
+        }
+    }
+    printf("%zu jobs, %zu failed, %llu instructions in %.3fs, %.1f MIPS\n", results.size(), failed,
+           (unsigned long long)instructions, seconds, seconds > 0 ? instructions / seconds / 1e6 : 0);
+    print_chain_stats(chain);
+    return failed != 0 ? 1 : 0;
+}
+
+// name=value arguments, value in the number base strtoull guesses
+static bool option(const char *arg, const char *name, unsigned long long& value)
+{
+    const size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+        return false;
+    value = strtoull(arg + len + 1, nullptr, 0);
+    return true;
+}
+
+// the code store file gets what this run learned, a failure only costs the next run its warm-up
+static int save_code_store(int status)
+{
+    if (!rv_code_store::shared().save())
+        fprintf(stderr, "can't write the code store\n");
+    return status;
+}
+
+static void parse_tier(const char *arg, rv_tier& tier)
+{
+    static const char *const names[] = { "interpreter", "threaded", "native", "trace" };
+    if (strncmp(arg, "tier=", 5) != 0)
+        return;
+    for (size_t i = 0; i < 4; ++i) {
+        if (strcmp(arg + 5, names[i]) == 0)
+            tier = (rv_tier)i;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    // optional number of harts and RAM size in MiB, then "guard" for guard page mode
+    // and "fork" to boot test.bin up to its fork point and fork a job off it for every input
+    // or "batch" to run a list of jobs on as many machines as there are host CPUs
+    // tier=interpreter|threaded|native|trace caps the execution tier, warm=n and hot=n set the executions
+    // before a block is translated and compiled, trace=n the runs ending at a native block before a trace
+    // is recorded from it, blocks=n the blocks kept, code=n the native code cache in KiB
+    // budget=n stops after n instructions, for profiling a fixed amount of work
+    // cache=file keeps the code pages and the blocks hot in them between runs (see rv_code_store)
+    // and "sync" compiles on the hart instead of the background compile thread
+    const size_t harts = argc > 1 ? (size_t)strtoul(argv[1], nullptr, 0) : 1;
+    const size_t ram_size = argc > 2 ? (size_t)strtoul(argv[2], nullptr, 0) * 1_MiB : 16_MiB;
+    bool guard_pages = false;
+    bool fork_server = false;
+    bool batch = false;
+    rv_tier_config tiers;
+    unsigned long long value;
+    unsigned long long budget = 0;
+    for (int i = 3; i < argc; ++i) {
+        guard_pages |= strcmp(argv[i], "guard") == 0;
+        fork_server |= strcmp(argv[i], "fork") == 0;
+        batch |= strcmp(argv[i], "batch") == 0;
+        if (strcmp(argv[i], "sync") == 0)
+            tiers.compile_thread = false;
+        parse_tier(argv[i], tiers.max_tier);
+        if (option(argv[i], "warm", value))
+            tiers.threaded_threshold = (uint32_t)value;
+        if (option(argv[i], "hot", value))
+            tiers.native_threshold = (uint32_t)value;
+        if (option(argv[i], "trace", value))
+            tiers.trace_threshold = (uint32_t)value;
+        if (option(argv[i], "blocks", value))
+            tiers.block_limit = value;
+        if (option(argv[i], "code", value))
+            tiers.code_cache_size = value * 1024;
+        option(argv[i], "budget", budget);
+        if (strncmp(argv[i], "cache=", 6) == 0)
+            rv_code_store::shared().open(argv[i] + 6);
+    }
+    if (batch)
+        return save_code_store(run_batch(harts, ram_size, guard_pages, tiers));
+
+    rv_machine m{harts, ram_size, guard_pages};
+    m.set_tiers(tiers);
     m.loadBinary("test.bin");
+    if (fork_server)
+        return save_code_store(run_fork_server(m));
+
     m.memory().write(0x2000, (int32_t)-2);
     m.memory().write(0x2004, (int32_t)-3);
 
+    m.set_budget(budget);
     m.run();
+    print_chain_stats(m.chain_stats());
 
     rv_uint addr = 0x2008;
     uint32_t res;
     m.memory().read(0x2008, res);
     printf("%d\n", res);
 
-    return 0;
+    return save_code_store(m.exit_code());
 }
\ No newline at end of file
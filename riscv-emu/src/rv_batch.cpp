@@ -0,0 +1,117 @@
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include "rv_batch.hpp"
+
+rv_batch::rv_batch(size_t hart_count, size_t ram_size, bool guard_pages)
+    : hart_count_{hart_count}, ram_size_{ram_size}, guard_pages_{guard_pages}
+{
+}
+
+std::vector<rv_batch_result> rv_batch::run(const std::vector<rv_batch_job>& jobs, size_t workers,
+                                           const std::function<void(size_t, const rv_batch_result&)>& done)
+{
+    if (workers == 0)
+        workers = std::max(std::thread::hardware_concurrency(), 1U);
+    workers = std::max<size_t>(std::min(workers, jobs.size()), 1);
+
+    std::vector<rv_batch_result> results(jobs.size());
+    jobs_ = &jobs;
+    results_ = &results;
+    done_ = &done;
+
+    workers_.clear();
+    for (size_t i = 0; i < workers; ++i) {
+        workers_.push_back(std::make_unique<worker>());
+        for (size_t job = jobs.size() * i / workers; job < jobs.size() * (i + 1) / workers; ++job)
+            workers_.back()->jobs.push_back(job);
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; ++i)
+        threads.emplace_back(&rv_batch::work, this, i);
+    work(0);
+    for (auto& thread: threads)
+        thread.join();
+
+    workers_.clear();
+    jobs_ = nullptr;
+    results_ = nullptr;
+    done_ = nullptr;
+    return results;
+}
+
+bool rv_batch::next_job(size_t id, size_t& job)
+{
+    {
+        auto& own = *workers_[id];
+        std::lock_guard<std::mutex> lock{own.lock};
+        if (!own.jobs.empty()) {
+            job = own.jobs.front();
+            own.jobs.pop_front();
+            return true;
+        }
+    }
+    // jobs are never added, once every queue was seen empty there's nothing left
+    for (size_t i = 1; i < workers_.size(); ++i) {
+        auto& victim = *workers_[(id + i) % workers_.size()];
+        std::lock_guard<std::mutex> lock{victim.lock};
+        if (!victim.jobs.empty()) {
+            job = victim.jobs.back();
+            victim.jobs.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void rv_batch::work(size_t id)
+{
+    std::unique_ptr<rv_machine> machine;
+    // image the machine holds at its baseline
+    std::string image;
+    size_t job;
+    while (next_job(id, job)) {
+        run_job(machine, image, job);
+        if (*done_) {
+            std::lock_guard<std::mutex> lock{done_lock_};
+            (*done_)(job, (*results_)[job]);
+        }
+    }
+}
+
+void rv_batch::run_job(std::unique_ptr<rv_machine>& machine, std::string& image, size_t index)
+{
+    const auto& job = (*jobs_)[index];
+    auto& result = (*results_)[index];
+    result.run.reason = rv_stop_reason::crashed;
+
+    try {
+        if (machine == nullptr || image != job.image) {
+            image.clear();
+            machine.reset();
+            machine = std::make_unique<rv_machine>(hart_count_, ram_size_, guard_pages_);
+            machine->set_ips_report(false);
+            machine->set_tiers(tiers_);
+            machine->loadBinary(job.image);
+            machine->set_baseline();
+            image = job.image;
+        }
+        else {
+            machine->reset_to_baseline();
+        }
+    }
+    catch (const std::exception& e) {
+        machine.reset();
+        image.clear();
+        result.error = job.image + ": " + e.what();
+        result.passed = false;
+        return;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    machine->run_job(job.run, result.run);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.passed = !job.check || result.run.output == job.expected;
+}
\ No newline at end of file
@@ -0,0 +1,75 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <functional>
+#include "rv_machine.hpp"
+
+struct rv_batch_job
+{
+    // binary or ELF image, as for rv_machine::loadBinary
+    std::string image;
+    rv_job run;
+    // the console output the job should produce, unless check is false
+    std::string expected;
+    bool check = false;
+};
+
+struct rv_batch_result
+{
+    rv_job_result run;
+    // wall time of the run, the image load not included
+    double seconds = 0;
+    // the output matched the expected one, true if it wasn't checked
+    bool passed = true;
+    // why the job couldn't be started, reason is rv_stop_reason::crashed then
+    std::string error;
+
+    double mips() const { return seconds > 0 ? run.instructions / seconds / 1e6 : 0; }
+};
+
+// runs jobs concurrently, a worker thread and a machine per worker
+// every worker starts with a share of the jobs (consecutive ones, jobs next to each other
+// tend to share their image) and steals from the end of the others' once its own ran out
+// a worker keeps its machine as long as its jobs use the same image and resets it to its
+// baseline (see rv_machine::set_baseline) between them instead of loading it again
+class rv_batch
+{
+public:
+    // the machine configuration every job runs with, see rv_machine
+    rv_batch(size_t hart_count, size_t ram_size, bool guard_pages);
+    // see rv_machine::set_tiers, for the machines of the next run()
+    void set_tiers(const rv_tier_config& tiers) { tiers_ = tiers; }
+
+    // workers 0 for one per host CPU, done is called as jobs finish, one at a time
+    // but on the worker threads, returns the results in the order of jobs
+    std::vector<rv_batch_result> run(const std::vector<rv_batch_job>& jobs, size_t workers,
+                                     const std::function<void(size_t, const rv_batch_result&)>& done = {});
+
+private:
+    struct worker
+    {
+        std::mutex lock;
+        // indexes into the job list
+        std::deque<size_t> jobs;
+    };
+
+    void work(size_t id);
+    // the next job of worker id, stolen from another one if it has none left
+    bool next_job(size_t id, size_t& job);
+    void run_job(std::unique_ptr<rv_machine>& machine, std::string& image, size_t job);
+
+private:
+    size_t hart_count_;
+    size_t ram_size_;
+    bool guard_pages_;
+    rv_tier_config tiers_;
+
+    // state of the current run()
+    const std::vector<rv_batch_job> *jobs_ = nullptr;
+    std::vector<rv_batch_result> *results_ = nullptr;
+    const std::function<void(size_t, const rv_batch_result&)> *done_ = nullptr;
+    std::mutex done_lock_;
+    std::vector<std::unique_ptr<worker>> workers_;
+};
\ No newline at end of file
@@ -0,0 +1,398 @@
+#include <algorithm>
+#include "rv_block_cache.hpp"
+#include "rv_jit.hpp"
+#include "rv_x64_emitter.hpp"
+#include "rv_code_store.hpp"
+
+rv_block::~rv_block()
+{
+    delete compiled.load(std::memory_order_relaxed);
+}
+
+rv_block_cache::rv_block_cache(rv_decode_cache& icache, rv_mmu& mmu)
+    : icache_{icache}, mmu_{mmu}
+{
+    fast_.fill(nullptr);
+    ras_.fill(nullptr);
+}
+
+static bool is_link_register(uint32_t r)
+{
+    return r == 1 || r == 5;
+}
+
+static void erase_one(std::vector<rv_block*>& blocks, rv_block *block)
+{
+    auto it = std::find(blocks.begin(), blocks.end(), block);
+    if (it != blocks.end())
+        blocks.erase(it);
+}
+
+rv_block *rv_block_cache::translate(rv_uint pc, rv_uint ppc, uint64_t key)
+{
+    auto it = blocks_.find(key);
+    if (it != blocks_.end()) {
+        fast_[fast_index(pc)] = it->second.get();
+        return it->second.get();
+    }
+
+    if (icache_.lookup(ppc) == nullptr)
+        return nullptr;
+    const uint8_t profile = icache_.profile(ppc);
+    if (threshold_ > 1 && profile == 0) {
+        // code running once (boot, tests) is only interpreted
+        auto count = cold_.find(key);
+        if (count == cold_.end()) {
+            cold_.emplace(key, 1);
+            return nullptr;
+        }
+        if (++count->second < threshold_)
+            return nullptr;
+        cold_.erase(count);
+    }
+
+    auto block = std::make_unique<rv_block>();
+    block->pc = pc;
+    block->ppc = ppc;
+    block->key = key;
+    block->paged = (key & 1) != 0;
+    for (rv_uint addr = ppc; ; addr += sizeof(uint32_t)) {
+        const auto& insn = icache_.fetch(addr);
+        block->insns.push_back(insn);
+
+        if ((rv_op_flags(insn.op) & RV_OPF_END) != 0 ||
+            block->insns.size() == RV_BLOCK_MAX_INSNS ||
+            ((addr + sizeof(uint32_t)) & RV_MEMORY_PAGE_MASK) == 0)
+            break;
+    }
+    block->len = block->insns.size();
+    // hot in an earlier run, compiled and traced the first time it gets there
+    if ((profile & RV_CODE_NATIVE) != 0 && native_threshold_ != 0)
+        block->hits = native_threshold_ - 1;
+    if ((profile & RV_CODE_TRACE) != 0 && trace_threshold_ != 0)
+        block->samples = trace_threshold_ - 1;
+
+    // static successors and return address stack hints (ra and t0 are link registers)
+    const auto& last = block->insns.back();
+    const rv_uint last_pc = pc + (block->len - 1) * sizeof(uint32_t);
+    block->exit_pc = { RV_BLOCK_NO_EXIT, RV_BLOCK_NO_EXIT };
+    switch (last.op) {
+    case rv_op::jal:
+        block->exit_pc[0] = last_pc + last.imm;
+        block->is_call = is_link_register(last.rd);
+        break;
+    case rv_op::jalr:
+        block->is_indirect = true;
+        block->is_call = is_link_register(last.rd);
+        block->is_return = last.rd == 0 && is_link_register(last.rs1);
+        break;
+    case rv_op::beq:
+    case rv_op::bne:
+    case rv_op::blt:
+    case rv_op::bge:
+    case rv_op::bltu:
+    case rv_op::bgeu:
+        block->exit_pc = { last_pc + last.imm, last_pc + 4 };
+        break;
+    default:
+        if ((rv_op_flags(last.op) & RV_OPF_END) == 0)
+            block->exit_pc[1] = last_pc + 4;
+        break;
+    }
+    if (block->is_call)
+        block->exit_pc[1] = last_pc + 4;
+
+    rv_decoded_insn end{};
+    end.op = rv_op::count;
+    block->insns.push_back(end);
+
+    auto result = block.get();
+    page_blocks_[ppc >> RV_MEMORY_PAGE_SHIFT].push_back(result);
+    blocks_.emplace(key, std::move(block));
+    fast_[fast_index(pc)] = result;
+    return result;
+}
+
+void rv_block_cache::invalidate(rv_uint address, size_t len)
+{
+    const rv_ulong end = (rv_ulong)address + len;
+    for (rv_ulong page = address & ~RV_MEMORY_PAGE_MASK; page < end; page += RV_MEMORY_PAGE_SIZE) {
+        auto it = page_blocks_.find(page >> RV_MEMORY_PAGE_SHIFT);
+        if (it == page_blocks_.end())
+            continue;
+
+        auto& blocks = it->second;
+        auto last = std::remove_if(blocks.begin(), blocks.end(), [&](rv_block *block) {
+            rv_ulong block_begin = block->ppc;
+            rv_ulong block_end = block->ppc + block->len * sizeof(uint32_t);
+            if (block->native_block != nullptr) {
+                block_begin = std::min<rv_ulong>(block_begin, block->trace_begin);
+                block_end = std::max<rv_ulong>(block_end, block->trace_end);
+            }
+            if (block_begin >= end || block_end <= address)
+                return false;
+
+            if (fast_[fast_index(block->pc)] == block)
+                fast_[fast_index(block->pc)] = nullptr;
+
+            unlink(*block);
+            block->dead = true;
+
+            // the block may be executing right now, free it later
+            auto node = blocks_.extract(block->key);
+            retired_.push_back(std::move(node.mapped()));
+            return true;
+        });
+        blocks.erase(last, blocks.end());
+    }
+    // the return address stack may point to the dropped blocks
+    ras_.fill(nullptr);
+}
+
+void rv_block_cache::clear()
+{
+    // nothing links into the cache from outside, no need to unlink one by one
+    fast_.fill(nullptr);
+    ras_.fill(nullptr);
+    page_blocks_.clear();
+    blocks_.clear();
+    retired_.clear();
+    cold_.clear();
+    end_trace();
+}
+
+rv_block *rv_block_cache::follow_slow(rv_block& from, rv_uint pc, bool native)
+{
+    // overwritten while running, its links are gone for good
+    if (from.dead)
+        return lookup(pc);
+
+    if (from.is_call && !native && !from.paged)
+        ras_push(&from);
+
+    for (size_t slot = 0; slot < from.exit.size(); ++slot) {
+        if (pc != from.exit_pc[slot])
+            continue;
+        if (from.exit[slot] != nullptr) {
+            ++stats_.static_hits;
+            return from.exit[slot];
+        }
+        auto to = lookup(pc);
+        if (to != nullptr && can_link(from, pc)) {
+            ++stats_.static_misses;
+            link(from, slot, *to);
+        }
+        return to;
+    }
+
+    // translation of other pages may change, paged blocks only get their static same page links
+    if (!from.is_indirect || from.paged)
+        return lookup(pc);
+
+    if (from.is_return && !native) {
+        auto caller = ras_pop();
+        if (caller != nullptr && caller->exit_pc[1] == pc) {
+            if (caller->exit[1] != nullptr) {
+                ++stats_.ras_hits;
+                return caller->exit[1];
+            }
+            auto to = lookup(pc);
+            if (to != nullptr) {
+                ++stats_.ras_misses;
+                link(*caller, 1, *to);
+            }
+            return to;
+        }
+        ++stats_.ras_misses;
+    }
+
+    if (from.ic != nullptr && from.ic->pc == pc) {
+        ++stats_.ic_hits;
+        return from.ic;
+    }
+    auto to = lookup(pc);
+    if (to != nullptr) {
+        ++stats_.ic_misses;
+        set_ic(from, *to);
+    }
+    return to;
+}
+
+void rv_block_cache::link(rv_block& from, size_t slot, rv_block& to)
+{
+    from.exit[slot] = &to;
+    to.preds.push_back(&from);
+    if (from.native_exit[slot] != nullptr && to.native != nullptr)
+        x64_patch_rel32(from.native_exit[slot], to.native);
+}
+
+void rv_block_cache::set_ic(rv_block& from, rv_block& to)
+{
+    if (from.ic != nullptr)
+        erase_one(from.ic->preds, &from);
+    from.ic = &to;
+    to.preds.push_back(&from);
+
+    if (from.native_ic != nullptr) {
+        if (to.native != nullptr) {
+            x64_patch_imm32(from.native_ic, to.pc);
+            x64_patch_rel32(from.native_ic_jump, to.native);
+        }
+        else {
+            x64_patch_imm32(from.native_ic, RV_BLOCK_NO_EXIT);
+        }
+    }
+}
+
+void rv_block_cache::link_native(rv_block& block)
+{
+    // later runs sharing a code store compile it right away
+    icache_.mark_profile(block.ppc, RV_CODE_NATIVE | (block.native_block != nullptr ? RV_CODE_TRACE : 0));
+    for (auto pred: block.preds) {
+        for (size_t slot = 0; slot < pred->exit.size(); ++slot) {
+            if (pred->exit[slot] == &block && pred->native_exit[slot] != nullptr)
+                x64_patch_rel32(pred->native_exit[slot], block.native);
+        }
+        if (pred->ic == &block && pred->native_ic != nullptr) {
+            x64_patch_imm32(pred->native_ic, block.pc);
+            x64_patch_rel32(pred->native_ic_jump, block.native);
+        }
+    }
+}
+
+void rv_block_cache::unlink(rv_block& block)
+{
+    // unlinked native exits fall through to their exit to the dispatcher
+    for (auto pred: block.preds) {
+        for (size_t slot = 0; slot < pred->exit.size(); ++slot) {
+            if (pred->exit[slot] != &block)
+                continue;
+            pred->exit[slot] = nullptr;
+            if (pred->native_exit[slot] != nullptr)
+                x64_patch_rel32(pred->native_exit[slot], pred->native_exit[slot] + 4);
+        }
+        if (pred->ic == &block) {
+            pred->ic = nullptr;
+            if (pred->native_ic != nullptr)
+                x64_patch_imm32(pred->native_ic, RV_BLOCK_NO_EXIT);
+        }
+    }
+    block.preds.clear();
+
+    for (auto& to: block.exit) {
+        if (to != nullptr) {
+            erase_one(to->preds, &block);
+            to = nullptr;
+        }
+    }
+    if (block.ic != nullptr) {
+        erase_one(block.ic->preds, &block);
+        block.ic = nullptr;
+    }
+}
+
+void rv_block_cache::drop_native()
+{
+    for (auto& it: blocks_) {
+        auto& block = *it.second;
+        block.native = nullptr;
+        block.hits = 0;
+        block.native_exit = {};
+        block.native_ic = nullptr;
+        block.native_ic_jump = nullptr;
+        block.queued = false;
+        delete block.compiled.exchange(nullptr, std::memory_order_relaxed);
+        block.samples = 0;
+        block.traced = false;
+        block.native_block = nullptr;
+    }
+    end_trace();
+}
+
+int rv_block_cache::trace_exit(const rv_block& from, rv_uint pc)
+{
+    // a call's return address isn't where it goes next
+    switch (from.insns[from.len - 1].op) {
+    case rv_op::jal:
+        return pc == from.exit_pc[0] ? 0 : -1;
+    case rv_op::beq:
+    case rv_op::bne:
+    case rv_op::blt:
+    case rv_op::bge:
+    case rv_op::bltu:
+    case rv_op::bgeu:
+        return pc == from.exit_pc[0] ? 0 : pc == from.exit_pc[1] ? 1 : -1;
+    default:
+        return pc == from.exit_pc[1] && !from.is_indirect ? 1 : -1;
+    }
+}
+
+bool rv_block_cache::can_trace(const rv_block& head, const rv_block& block) const
+{
+    // traces stay on the head's page, and fall back to the code of their blocks
+    if (block.native == nullptr || block.dead || block.paged != head.paged ||
+        ((block.pc ^ head.pc) & ~RV_MEMORY_PAGE_MASK) != 0 || ((block.ppc ^ head.ppc) & ~RV_MEMORY_PAGE_MASK) != 0)
+        return false;
+
+    // ending with a branch, a jump or nothing at all, with word aligned targets
+    const auto& last = block.insns[block.len - 1];
+    switch (last.op) {
+    case rv_op::jal:
+    case rv_op::beq:
+    case rv_op::bne:
+    case rv_op::blt:
+    case rv_op::bge:
+    case rv_op::bltu:
+    case rv_op::bgeu:
+        return (block.exit_pc[0] & 3) == 0;
+    default:
+        return (rv_op_flags(last.op) & RV_OPF_END) == 0;
+    }
+}
+
+void rv_block_cache::start_trace(rv_block& head)
+{
+    head.traced = true;
+    if (recording() || !can_trace(head, head))
+        return;
+    trace_head_ = &head;
+    trace_.clear();
+    trace_wait_ = 0;
+}
+
+bool rv_block_cache::record(rv_block& block)
+{
+    if (!trace_.empty()) {
+        const auto& last = *trace_.back();
+        if (trace_exit(last, block.pc) >= 0) {
+            if (&block == trace_head_) {
+                trace_loops_ = true;
+                return true;
+            }
+            if (can_trace(*trace_head_, block) && trace_.size() < RV_TRACE_MAX_BLOCKS &&
+                trace_insns_ + block.len <= RV_TRACE_MAX_INSNS &&
+                std::find(trace_.begin(), trace_.end(), &block) == trace_.end()) {
+                trace_.push_back(&block);
+                trace_insns_ += block.len;
+                return false;
+            }
+            // as far as it goes
+            trace_loops_ = false;
+            if (trace_.size() > 1)
+                return true;
+            end_trace();
+            return false;
+        }
+        // the path broke off (an exception, an interrupt, the end of a run), start over
+        trace_.clear();
+    }
+
+    if (&block == trace_head_) {
+        trace_.push_back(&block);
+        trace_insns_ = block.len;
+    }
+    else if (++trace_wait_ == RV_TRACE_WAIT) {
+        end_trace();
+    }
+    return false;
+}
\ No newline at end of file
@@ -0,0 +1,275 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include "rv_global.hpp"
+#include "rv_insn.hpp"
+#include "rv_decode_cache.hpp"
+#include "rv_mmu.hpp"
+
+constexpr size_t RV_BLOCK_MAX_INSNS = 64;
+// a block is translated once its start has been reached this many times, interpreted until then
+constexpr uint32_t RV_BLOCK_THRESHOLD = 2;
+// translated blocks kept before the whole cache is dropped
+constexpr size_t RV_BLOCK_LIMIT = 64 * 1024;
+constexpr size_t RV_BLOCK_FAST_ENTRIES = 4096;
+constexpr size_t RV_BLOCK_RAS_ENTRIES = 16;
+// never a valid pc, instructions are word aligned
+constexpr rv_uint RV_BLOCK_NO_EXIT = 1;
+// traces are at most this long, instructions and blocks
+constexpr size_t RV_TRACE_MAX_INSNS = 256;
+constexpr size_t RV_TRACE_MAX_BLOCKS = 16;
+// blocks run waiting for the head of a trace to come around before giving up on it
+constexpr uint32_t RV_TRACE_WAIT = 4096;
+
+struct rv_jit_code;
+
+// a guest basic block, ending at a control transfer, a system instruction or a page boundary
+// insns holds len instructions followed by a rv_op::count marker ending the block
+// native is set once the block is hot enough to be compiled
+//
+// pc is virtual, ppc the physical address it was fetched from, blocks translated with paging
+// enabled only link to blocks on the same page, whose translation can't change under them
+struct rv_block
+{
+    rv_uint pc;
+    rv_uint ppc;
+    uint64_t key;
+    bool paged = false;
+    // native code accesses the guest window directly, only valid with bare data translation
+    bool direct = false;
+    uint32_t len;
+    uint32_t hits = 0;
+    const void *native = nullptr;
+    // queued for the compile thread, which publishes its code here (see rv_jit)
+    bool queued = false;
+    std::atomic<rv_jit_code*> compiled{nullptr};
+
+    // successors with a static address, [0] jump/branch target, [1] fall through or return address
+    // they are linked the first time they are taken, exit_pc is RV_BLOCK_NO_EXIT if there's no such exit
+    std::array<rv_uint, 2> exit_pc{};
+    std::array<rv_block*, 2> exit{};
+    // last target of an indirect jump
+    rv_block *ic = nullptr;
+    bool is_indirect = false;
+    bool is_call = false;      // links ra or t0, pushes on the return address stack
+    bool is_return = false;    // jumps through ra or t0 without linking, pops from it
+    bool dead = false;
+
+    // patch points in native code: rel32 of the static exits, immediate and rel32 of the inline cache
+    std::array<uint8_t*, 2> native_exit{};
+    uint8_t *native_ic = nullptr;
+    uint8_t *native_ic_jump = nullptr;
+
+    // trace tier (see rv_jit): runs that ended at the block, and whether it's part of a trace already
+    uint32_t samples = 0;
+    bool traced = false;
+    // once a trace starts here native points to it and native_block to the block's own code,
+    // the trace covers physical [trace_begin, trace_end), all of it on the block's page
+    const void *native_block = nullptr;
+    rv_uint trace_begin = 0;
+    rv_uint trace_end = 0;
+
+    // blocks linking to this one, once per link
+    std::vector<rv_block*> preds;
+    std::vector<rv_decoded_insn> insns;
+
+    ~rv_block();
+};
+
+// chaining counters, transfers chained inside native code never reach the dispatcher
+// and are not counted, compare native_entries with the retired instructions for those
+struct rv_chain_stats
+{
+    uint64_t static_hits = 0;
+    uint64_t static_misses = 0;
+    uint64_t ic_hits = 0;
+    uint64_t ic_misses = 0;
+    uint64_t ras_hits = 0;
+    uint64_t ras_misses = 0;
+    uint64_t native_entries = 0;
+
+    // summed over harts, or the counts of a single run as a difference
+    rv_chain_stats& operator+=(const rv_chain_stats& other)
+    {
+        static_hits += other.static_hits;
+        static_misses += other.static_misses;
+        ic_hits += other.ic_hits;
+        ic_misses += other.ic_misses;
+        ras_hits += other.ras_hits;
+        ras_misses += other.ras_misses;
+        native_entries += other.native_entries;
+        return *this;
+    }
+    rv_chain_stats& operator-=(const rv_chain_stats& other)
+    {
+        static_hits -= other.static_hits;
+        static_misses -= other.static_misses;
+        ic_hits -= other.ic_hits;
+        ic_misses -= other.ic_misses;
+        ras_hits -= other.ras_hits;
+        ras_misses -= other.ras_misses;
+        native_entries -= other.native_entries;
+        return *this;
+    }
+    // percentage of hits, NaN if there was no lookup at all
+    static double hit_rate(uint64_t hits, uint64_t misses)
+    {
+        return hits + misses != 0 ? hits * 100.0 / (hits + misses) : std::numeric_limits<double>::quiet_NaN();
+    }
+};
+
+// translation cache, blocks are indexed by virtual and physical address
+class rv_block_cache
+{
+public:
+    rv_block_cache() = delete;
+    rv_block_cache(rv_decode_cache& icache, rv_mmu& mmu);
+
+    // returns nullptr if pc can't be fetched from RAM (or translated), or if it isn't warm yet
+    rv_block *lookup(rv_uint pc)
+    {
+        rv_uint ppc;
+        if (unlikely(!mmu_.translate_fetch(pc, ppc)))
+            return nullptr;
+        const auto key = block_key(pc, ppc, mmu_.paged_fetch());
+        auto block = fast_[fast_index(pc)];
+        if (likely(block != nullptr && block->key == key))
+            return block;
+        return translate(pc, ppc, key);
+    }
+
+    // next block after from left it at pc, following (and creating) links
+    // native tells that from ran as native code, which already did the return address stack work
+    rv_block *follow(rv_block& from, rv_uint pc, bool native)
+    {
+        rv_block *next = nullptr;
+        if (pc == from.exit_pc[0])
+            next = from.exit[0];
+        else if (pc == from.exit_pc[1])
+            next = from.exit[1];
+        if (likely(next != nullptr && !from.is_call)) {
+            ++stats_.static_hits;
+            return next;
+        }
+        return follow_slow(from, pc, native);
+    }
+
+    // block has just been compiled, let native code linking to it jump there directly
+    void link_native(rv_block& block);
+
+    // from may jump straight to pc without going through translation
+    static bool can_link(const rv_block& from, rv_uint pc)
+    {
+        return !from.paged || ((from.pc ^ pc) & ~RV_MEMORY_PAGE_MASK) == 0;
+    }
+
+    // drop every block (or trace) overlapping physical [address, address + len)
+    void invalidate(rv_uint address, size_t len);
+
+    // drop every block at once, must not be called while executing a block
+    // nor while the compile thread may be compiling them (see rv_jit::drain)
+    void clear();
+
+    // forget every native translation, the code cache is being flushed
+    // along with the code the compile thread finished but the hart didn't install yet
+    void drop_native();
+
+    // free invalidated blocks, must not be called while executing a block
+    // nor while the compile thread may be compiling them (see rv_jit::drain)
+    void reclaim() { end_trace(); retired_.clear(); }
+    bool has_retired() const { return !retired_.empty(); }
+
+    // times a block start is looked up before it's translated, 1 translates right away
+    void set_threshold(uint32_t threshold) { threshold_ = std::max<uint32_t>(threshold, 1); cold_.clear(); }
+    // hits before the cpu compiles a block, 0 never, blocks compiled by earlier runs
+    // (rv_code_store) are translated right away and start one short of it
+    void set_native_threshold(uint32_t threshold) { native_threshold_ = threshold; }
+    // blocks and cold block starts held
+    size_t size() const { return blocks_.size() + cold_.size(); }
+
+    const rv_chain_stats& stats() const { return stats_; }
+    void count_native_entry() { ++stats_.native_entries; }
+
+    // trace recording: a native block where threshold runs ended (0 never) becomes the head of a trace,
+    // the next time it's reached the blocks running from it are recorded, threaded, until the path
+    // gets back to it or can't be traced any further, each block heads one attempt at most
+    void set_trace_threshold(uint32_t threshold) { trace_threshold_ = threshold; end_trace(); }
+    void sample(rv_block& block)
+    {
+        if (trace_threshold_ != 0 && block.native != nullptr && !block.traced && ++block.samples >= trace_threshold_)
+            start_trace(block);
+    }
+    bool recording() const { return trace_head_ != nullptr; }
+    // block runs next, returns true once the trace is complete
+    bool record(rv_block& block);
+    // the blocks recorded, starting with the head, and whether the last one jumps back to it
+    const std::vector<rv_block*>& trace() const { return trace_; }
+    bool trace_loops() const { return trace_loops_; }
+    void end_trace() { trace_head_ = nullptr; trace_.clear(); }
+    // exit slot of from a trace takes to go on at pc, -1 if it doesn't go there
+    static int trace_exit(const rv_block& from, rv_uint pc);
+
+private:
+    friend class rv_jit;
+
+    static size_t fast_index(rv_uint pc) { return (pc >> 2) & (RV_BLOCK_FAST_ENTRIES - 1); }
+    // pc is word aligned, bit 0 tells paged blocks apart from identity mapped ones
+    static uint64_t block_key(rv_uint pc, rv_uint ppc, bool paged) { return (uint64_t)ppc << 32 | pc | (paged ? 1 : 0); }
+    rv_block *translate(rv_uint pc, rv_uint ppc, uint64_t key);
+    rv_block *follow_slow(rv_block& from, rv_uint pc, bool native);
+
+    void start_trace(rv_block& head);
+    bool can_trace(const rv_block& head, const rv_block& block) const;
+
+    void link(rv_block& from, size_t slot, rv_block& to);
+    void set_ic(rv_block& from, rv_block& to);
+    void unlink(rv_block& block);
+
+    void ras_push(rv_block *caller)
+    {
+        ras_top_ = (ras_top_ + 1) & (RV_BLOCK_RAS_ENTRIES - 1);
+        ras_[ras_top_] = caller;
+    }
+
+    rv_block *ras_pop()
+    {
+        auto caller = ras_[ras_top_];
+        ras_top_ = (ras_top_ - 1) & (RV_BLOCK_RAS_ENTRIES - 1);
+        return caller;
+    }
+
+private:
+    rv_decode_cache& icache_;
+    rv_mmu& mmu_;
+
+    // direct mapped front-end of blocks_
+    std::array<rv_block*, RV_BLOCK_FAST_ENTRIES> fast_;
+    std::unordered_map<uint64_t, std::unique_ptr<rv_block>> blocks_;
+    // blocks never cross a page, so every block is listed in exactly one physical page
+    std::unordered_map<rv_uint, std::vector<rv_block*>> page_blocks_;
+    std::vector<std::unique_ptr<rv_block>> retired_;
+    // lookups of block starts not translated yet
+    std::unordered_map<uint64_t, uint32_t> cold_;
+    uint32_t threshold_ = RV_BLOCK_THRESHOLD;
+    uint32_t native_threshold_ = 0;
+
+    // return address stack, holding the blocks ending with a call (identity mapped ones only)
+    // the predicted return target is the caller's fall through exit
+    std::array<rv_block*, RV_BLOCK_RAS_ENTRIES> ras_;
+    uint32_t ras_top_ = 0;
+
+    // the trace being recorded, blocks are only recorded once the head is reached
+    uint32_t trace_threshold_ = 0;
+    rv_block *trace_head_ = nullptr;
+    std::vector<rv_block*> trace_;
+    size_t trace_insns_ = 0;
+    bool trace_loops_ = false;
+    uint32_t trace_wait_ = 0;
+
+    rv_chain_stats stats_;
+};
\ No newline at end of file
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <algorithm>
+
+// lock-free ring of bytes between one producer and one consumer thread
+// head and tail run freely and are masked on access, N must be a power of two
+template<size_t N>
+class rv_byte_ring
+{
+    static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+public:
+    rv_byte_ring() = default;
+
+    rv_byte_ring(const rv_byte_ring&) = delete;
+    rv_byte_ring& operator=(const rv_byte_ring&) = delete;
+
+    // exact for the calling side, the other one can only make it better
+    size_t count() const { return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire); }
+    bool empty() const { return count() == 0; }
+    bool full() const { return count() == N; }
+    size_t free_space() const { return N - count(); }
+
+    // producer side, returns the number of bytes stored
+    size_t put(const uint8_t *data, size_t len)
+    {
+        const auto tail = tail_.load(std::memory_order_relaxed);
+        len = std::min(len, N - (tail - head_.load(std::memory_order_acquire)));
+        for (size_t i = 0; i < len; ++i)
+            buf_[(tail + i) & (N - 1)] = data[i];
+        tail_.store(tail + len, std::memory_order_release);
+        return len;
+    }
+
+    // consumer side, returns the number of bytes taken
+    size_t get(uint8_t *data, size_t len)
+    {
+        const auto head = head_.load(std::memory_order_relaxed);
+        len = std::min(len, tail_.load(std::memory_order_acquire) - head);
+        for (size_t i = 0; i < len; ++i)
+            data[i] = buf_[(head + i) & (N - 1)];
+        head_.store(head + len, std::memory_order_release);
+        return len;
+    }
+
+    // copy of the contents without taking them, neither side may be running
+    size_t peek(uint8_t *data, size_t len) const
+    {
+        const auto head = head_.load(std::memory_order_relaxed);
+        len = std::min(len, tail_.load(std::memory_order_relaxed) - head);
+        for (size_t i = 0; i < len; ++i)
+            data[i] = buf_[(head + i) & (N - 1)];
+        return len;
+    }
+
+    // neither side may be running
+    void clear()
+    {
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    std::array<uint8_t, N> buf_;
+    // each index is written by one side only, keep them on their own cache lines
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
\ No newline at end of file
@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rv_code_store.hpp"
+#include "rv_insn_ops.hpp"
+
+#define RV_INSN_OP_HANDLER(name, handler, flags) &handler,
+static const rv_insn_handler rv_insn_handlers[] = { RV_INSN_OPS(RV_INSN_OP_HANDLER) };
+#undef RV_INSN_OP_HANDLER
+
+rv_code_store& rv_code_store::shared()
+{
+    static rv_code_store store;
+    return store;
+}
+
+rv_code_store::~rv_code_store()
+{
+    if (mapped_ != nullptr)
+        munmap(mapped_, mapped_size_);
+}
+
+bool rv_code_store::open(const std::string& path)
+{
+    path_ = path;
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    rv_code_store_header header;
+    struct stat st;
+    const bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) && fstat(fd, &st) == 0 &&
+                       memcmp(header.magic, RV_CODE_STORE_MAGIC, sizeof(header.magic)) == 0 &&
+                       header.version == RV_CODE_STORE_VERSION &&
+                       header.ops == rv_code_store_ops_hash() &&
+                       header.pages != 0 && header.pages <= RV_CODE_STORE_PAGES &&
+                       sizeof(header) + header.pages * (sizeof(uint64_t) + sizeof(rv_code_record)) <= (uint64_t)st.st_size;
+    void *mapped = valid ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return false;
+
+    mapped_ = mapped;
+    mapped_size_ = st.st_size;
+    pages_ = header.pages;
+    hashes_ = (const uint64_t *)((const uint8_t *)mapped + sizeof(header));
+    records_ = (const rv_code_record *)(hashes_ + pages_);
+    return true;
+}
+
+const rv_code_record *rv_code_store::find(size_t hash, const uint32_t *raw) const
+{
+    for (auto it = std::lower_bound(hashes_, hashes_ + pages_, hash); it != hashes_ + pages_ && *it == hash; ++it) {
+        const auto& record = records_[it - hashes_];
+        if (memcmp(record.raw.data(), raw, RV_MEMORY_PAGE_SIZE) == 0)
+            return &record;
+    }
+    return nullptr;
+}
+
+bool rv_code_store::load(rv_shared_page& page) const
+{
+    const auto record = find(page.hash, page.raw.data());
+    if (record == nullptr)
+        return false;
+    for (size_t i = 0; i < RV_DECODED_PAGE_INSNS; ++i) {
+        const auto& stored = record->insns[i];
+        // the file may be damaged, the caller decodes the page itself then, registers index rv_cpu::regs_
+        if (stored.op >= rv_op::count || stored.rd >= 32 || stored.rs1 >= 32 || stored.rs2 >= 32)
+            return false;
+        auto& insn = page.decoded.insns[i];
+        insn.handler = rv_insn_handlers[(size_t)stored.op];
+        insn.op = stored.op;
+        insn.rd = stored.rd;
+        insn.rs1 = stored.rs1;
+        insn.rs2 = stored.rs2;
+        insn.imm = stored.imm;
+    }
+    page.profile = record->profile;
+    return true;
+}
+
+void rv_code_store::mark(const rv_shared_page& page, uint32_t index, uint8_t mark)
+{
+    std::lock_guard<std::mutex> lock{lock_};
+    rv_code_record *record = nullptr;
+    auto range = marked_.equal_range(page.hash);
+    for (auto it = range.first; it != range.second && record == nullptr; ++it) {
+        if (it->second->raw == page.raw)
+            record = it->second.get();
+    }
+    if (record == nullptr) {
+        // zeroed, padding included, so the file only depends on the pages
+        auto copy = std::make_unique<rv_code_record>();
+        copy->raw = page.raw;
+        for (size_t i = 0; i < RV_DECODED_PAGE_INSNS; ++i) {
+            const auto& insn = page.decoded.insns[i];
+            copy->insns[i] = { insn.op, insn.rd, insn.rs1, insn.rs2, insn.imm };
+        }
+        copy->profile = page.profile;
+        record = marked_.emplace(page.hash, std::move(copy))->second.get();
+    }
+    record->profile[index] |= mark;
+}
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+    for (size_t done = 0; done < len; ) {
+        const ssize_t n = write(fd, (const uint8_t *)data + done, len - done);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+bool rv_code_store::save()
+{
+    std::lock_guard<std::mutex> lock{lock_};
+    // nothing new, the file is as good as it gets
+    if (!is_open() || marked_.empty())
+        return true;
+
+    // the pages marked by this process first, then the ones of the file it didn't get to
+    std::vector<std::pair<uint64_t, const rv_code_record*>> pages;
+    for (const auto& page: marked_) {
+        if (pages.size() < RV_CODE_STORE_PAGES)
+            pages.emplace_back(page.first, page.second.get());
+    }
+    for (size_t i = 0; i < pages_ && pages.size() < RV_CODE_STORE_PAGES; ++i) {
+        bool marked = false;
+        auto range = marked_.equal_range(hashes_[i]);
+        for (auto it = range.first; it != range.second && !marked; ++it)
+            marked = it->second->raw == records_[i].raw;
+        if (!marked)
+            pages.emplace_back(hashes_[i], &records_[i]);
+    }
+    std::sort(pages.begin(), pages.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    rv_code_store_header header{};
+    memcpy(header.magic, RV_CODE_STORE_MAGIC, sizeof(header.magic));
+    header.version = RV_CODE_STORE_VERSION;
+    header.ops = rv_code_store_ops_hash();
+    header.pages = pages.size();
+    std::vector<uint64_t> hashes;
+    for (const auto& page: pages)
+        hashes.push_back(page.first);
+
+    // written next to the old one and renamed over it, the mapping keeps the old one alive
+    // runs saving at the same time each write their own, the last one renamed wins
+    const auto tmp_path = path_ + ".tmp" + std::to_string(getpid());
+    const int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    bool written = write_all(fd, &header, sizeof(header)) &&
+                   write_all(fd, hashes.data(), hashes.size() * sizeof(uint64_t));
+    for (size_t i = 0; i < pages.size() && written; ++i)
+        written = write_all(fd, pages[i].second, sizeof(rv_code_record));
+    if (close(fd) != 0 || !written || rename(tmp_path.c_str(), path_.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
\ No newline at end of file
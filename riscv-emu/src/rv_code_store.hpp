@@ -0,0 +1,104 @@
+#pragma once
+#include <array>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "rv_global.hpp"
+#include "rv_decode_cache.hpp"
+
+// what the block starting at a code word reached in an earlier run
+constexpr uint8_t RV_CODE_NATIVE = 1;
+constexpr uint8_t RV_CODE_TRACE = 2;
+// pages kept in the file, the ones marked by the last run first
+constexpr size_t RV_CODE_STORE_PAGES = 4096;
+
+// code store file layout: rv_code_store_header, the content hashes of the pages sorted,
+// then an rv_code_record per page in the same order
+constexpr char RV_CODE_STORE_MAGIC[8] = { 'R', 'V', 'C', 'O', 'D', 'E', 0, 0 };
+constexpr uint32_t RV_CODE_STORE_VERSION = 2;
+
+// FNV-1a of the rv_op names in order, files of builds numbering them differently don't load
+constexpr uint32_t rv_code_store_ops_hash()
+{
+#define RV_INSN_OP_NAME(name, handler, flags) #name ","
+    constexpr const char names[] = RV_INSN_OPS(RV_INSN_OP_NAME);
+#undef RV_INSN_OP_NAME
+    uint32_t hash = 2166136261u;
+    for (char c: names)
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    return hash;
+}
+
+struct rv_code_store_header
+{
+    char magic[8];
+    uint32_t version;
+    // rv_code_store_ops_hash() of the build that wrote it
+    uint32_t ops;
+    uint64_t pages;
+};
+
+// rv_decoded_insn without the handler, which moves from run to run
+struct rv_code_insn
+{
+    rv_op op;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    rv_int imm;
+};
+
+struct rv_code_record
+{
+    std::array<uint32_t, RV_DECODED_PAGE_INSNS> raw;
+    std::array<rv_code_insn, RV_DECODED_PAGE_INSNS> insns;
+    std::array<uint8_t, RV_DECODED_PAGE_INSNS> profile;
+};
+
+// code pages of earlier runs, for runs of the same images to skip decoding and warming up:
+// pages are looked up by a hash of their contents and compared word by word, a page found
+// isn't decoded again and the blocks marked on it are translated and compiled (or traced)
+// the first time they run instead of after their thresholds
+// the file is mapped read-only by open() and rewritten by save() with the pages marked since,
+// native code isn't kept, it calls into the emulator at addresses that change from run to run
+class rv_code_store
+{
+public:
+    // the store of the process, closed until open()
+    static rv_code_store& shared();
+
+    ~rv_code_store();
+
+    // open path before any machine runs, a missing or unusable file gives an empty store
+    // returns whether pages were loaded from it
+    bool open(const std::string& path);
+    bool is_open() const { return !path_.empty(); }
+    // write the loaded pages and the marked ones back, the process may keep running
+    // returns false if the file couldn't be written
+    bool save();
+
+    // decoded instructions and profile of page from the store, raw and hash already set
+    // returns false if the store doesn't have it
+    bool load(rv_shared_page& page) const;
+    // the block starting at word index of page reached mark, from any thread
+    void mark(const rv_shared_page& page, uint32_t index, uint8_t mark);
+
+private:
+    rv_code_store() = default;
+
+    // record of the file holding raw, nullptr if there's none
+    const rv_code_record *find(size_t hash, const uint32_t *raw) const;
+
+private:
+    std::string path_;
+    void *mapped_ = nullptr;
+    size_t mapped_size_ = 0;
+    const uint64_t *hashes_ = nullptr;
+    const rv_code_record *records_ = nullptr;
+    size_t pages_ = 0;
+
+    // pages marked by this process, with the marks they were loaded with
+    std::mutex lock_;
+    std::unordered_multimap<size_t, std::unique_ptr<rv_code_record>> marked_;
+};
\ No newline at end of file
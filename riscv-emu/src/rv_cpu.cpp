@@ -4,8 +4,8 @@
 #include "rv_exceptions.hpp"
 #include "rv_memory.hpp"
 #include "rv_bits.hpp"
-
-constexpr uint32_t kRiscvOpcodeMask = 0x7F;
+#include "rv_insn.hpp"
+#include "rv_insn_ops.hpp"
 
 #define RV_MSTATUS_UIE_SHIFT 0
 #define RV_MSTATUS_SIE_SHIFT 1
@@ -15,6 +15,12 @@ constexpr uint32_t kRiscvOpcodeMask = 0x7F;
 #define RV_MSTATUS_MPIE_SHIFT 7
 #define RV_MSTATUS_SPP_SHIFT 8
 #define RV_MSTATUS_MPP_SHIFT 11
+#define RV_MSTATUS_MPRV_SHIFT 17
+#define RV_MSTATUS_SUM_SHIFT 18
+#define RV_MSTATUS_MXR_SHIFT 19
+#define RV_MSTATUS_TVM_SHIFT 20
+#define RV_MSTATUS_TW_SHIFT 21
+#define RV_MSTATUS_TSR_SHIFT 22
 
 #define RV_MSTATUS_UIE  (1 << RV_MSTATUS_UIE_SHIFT)
 #define RV_MSTATUS_SIE  (1 << RV_MSTATUS_SIE_SHIFT)
@@ -24,6 +30,18 @@ constexpr uint32_t kRiscvOpcodeMask = 0x7F;
 #define RV_MSTATUS_MPIE (1 << RV_MSTATUS_MPIE_SHIFT)
 #define RV_MSTATUS_SPP  (1 << RV_MSTATUS_SPP_SHIFT)
 #define RV_MSTATUS_MPP  (3 << RV_MSTATUS_MPP_SHIFT)
+#define RV_MSTATUS_MPRV (1 << RV_MSTATUS_MPRV_SHIFT)
+#define RV_MSTATUS_SUM  (1 << RV_MSTATUS_SUM_SHIFT)
+#define RV_MSTATUS_MXR  (1 << RV_MSTATUS_MXR_SHIFT)
+#define RV_MSTATUS_TVM  (1 << RV_MSTATUS_TVM_SHIFT)
+#define RV_MSTATUS_TW   (1 << RV_MSTATUS_TW_SHIFT)
+#define RV_MSTATUS_TSR  (1 << RV_MSTATUS_TSR_SHIFT)
+
+// writable bits, no floating point unit and no user mode interrupts
+#define RV_MSTATUS_MASK (RV_MSTATUS_SIE | RV_MSTATUS_MIE | RV_MSTATUS_SPIE | RV_MSTATUS_MPIE | \
+                         RV_MSTATUS_SPP | RV_MSTATUS_MPP | RV_MSTATUS_MPRV | RV_MSTATUS_SUM | \
+                         RV_MSTATUS_MXR | RV_MSTATUS_TVM | RV_MSTATUS_TW | RV_MSTATUS_TSR)
+#define RV_SSTATUS_MASK (RV_MSTATUS_SIE | RV_MSTATUS_SPIE | RV_MSTATUS_SPP | RV_MSTATUS_SUM | RV_MSTATUS_MXR)
 
 constexpr auto RV_MIP_USIP = rv_bitfield<1,0>{};
 constexpr auto RV_MIP_SSIP = rv_bitfield<1,1>{};
@@ -49,21 +67,11 @@ constexpr auto RV_MCOUNTEREN_CY = rv_bitfield<1,0>{};
 constexpr auto RV_MCOUNTEREN_TM = rv_bitfield<1,1>{};
 constexpr auto RV_MCOUNTEREN_IR = rv_bitfield<1,2>{};
 
-enum class rv_opcode: uint32_t
-{
-    lui = 0b01101,
-    auipc = 0b00101,
-    jal = 0b11011,
-    jalr = 0b11001,
-    branch = 0b11000,
-    load = 0b00000,
-    store = 0b01000,
-    imm = 0b00100,
-    op = 0b01100,
-    misc_mem = 0b00011,
-    system  = 0b11100,
-    amo = 0b01011
-};
+// misa: RV32 with the A, I, M extensions, supervisor and user modes
+constexpr rv_uint RV_MISA = (1U << 30) | (1U << 0) | (1U << 8) | (1U << 12) | (1U << 18) | (1U << 20);
+
+// exceptions supervisor mode can handle, everything but ecall from machine mode
+constexpr rv_uint RV_MEDELEG_MASK = 0xB3FF;
 
 enum class rv_csr: uint32_t
 {
@@ -79,8 +87,23 @@ enum class rv_csr: uint32_t
     mimpid = 0xF13,
     mhartid = 0xF14,
 
+    sstatus = 0x100,
+    sie = 0x104,
+    stvec = 0x105,
+    scounteren = 0x106,
+
+    sscratch = 0x140,
+    sepc = 0x141,
+    scause = 0x142,
+    stval = 0x143,
+    sip = 0x144,
+
+    satp = 0x180,
+
     mstatus = 0x300,
     misa = 0x301,
+    medeleg = 0x302,
+    mideleg = 0x303,
     mie = 0x304,
     mtvec = 0x305,
     mcounteren = 0x306,
@@ -108,10 +131,17 @@ inline const char *const g_regNames[] = {
     "t3", "t4", "t5", "t6"
 };
 
-rv_cpu::rv_cpu(rv_memory& memory)
-        : memory_{memory}
-{
+// hart whose run() the current thread is inside of
+static thread_local rv_cpu *t_running_hart = nullptr;
 
+rv_cpu::rv_cpu(rv_memory& memory, rv_event_queue& events, rv_uint hartid)
+        : hartid_{hartid}, memory_{memory}, events_{events}, mmu_{memory}, icache_{memory}, blocks_{icache_, mmu_}, jit_{*this},
+          exit_request_{false}, remote_requests_{0}
+{
+    set_tiers(tiers_);
+    events_.add_reschedule_handler(std::bind(&rv_cpu::request_exit, this));
+    memory_.add_code_write_handler(std::bind(&rv_cpu::code_written, this, std::placeholders::_1, std::placeholders::_2));
+    memory_.add_code_page_handler(std::bind(&rv_cpu::code_page_protected, this, std::placeholders::_1));
 }
 
 void rv_cpu::reset()
@@ -126,6 +156,17 @@ void rv_cpu::reset()
     mtvec_ = 0x0000;
     mcause_ = 0;
     mvtval_ = 0;
+    mstatus_ = 0;
+    misa_ = RV_MISA;
+    medeleg_ = 0;
+    mideleg_ = 0;
+    mcounteren_ = 0;
+
+    stvec_ = 0;
+    scounteren_ = 0;
+    sepc_ = 0;
+    scause_ = 0;
+    stval_ = 0;
 
     regs_.fill(0x66666666);
     regs_[0] = 0;
@@ -137,607 +178,230 @@ void rv_cpu::reset()
     mie_ = 0;
 
     exception_raised_ = false;
-}
-
-void rv_cpu::run(size_t nCycles)
-{
-    auto c = nCycles;
-
-    const auto pending_irqs = mie_ & mip_;
-    if (pending_irqs != 0) {
-        const auto irq_num = __builtin_ctz(pending_irqs);
-        exception_code_ = (rv_exception)(0x80000000 | irq_num);
-        exception_raised_ = true;
-    }
-
-    c += 1;
-    while(likely(!exception_raised_)) {
-        if (unlikely(!--c))
-            break;
-
-        uint32_t insn;
-        if (unlikely(!memory_.read(pc_, insn))) {
-            raise_memory_exception();
-            break;
-        }
-
-        // add support for compressed instructions!
-        const auto opcode = (rv_opcode) ((insn & kRiscvOpcodeMask) >> 2);
-        switch (opcode) {
-        case rv_opcode::load:
-            execute_load(insn);
-            break;
-        case rv_opcode::misc_mem:
-            execute_misc_mem(insn);
-            break;
-        case rv_opcode::imm:
-            execute_imm(insn);
-            break;
-        case rv_opcode::auipc:
-            execute_auipc(insn);
-            break;
-        case rv_opcode::store:
-            execute_store(insn);
-            break;
-        case rv_opcode::amo:
-            execute_amo(insn);
-            break;
-        case rv_opcode::op:
-            execute_op(insn);
-            break;
-        case rv_opcode::lui:
-            execute_lui(insn);
-            break;
-        case rv_opcode::branch:
-            execute_branch(insn);
-            break;
-        case rv_opcode::jalr:
-            execute_jalr(insn);
-            break;
-        case rv_opcode::jal:
-            execute_jal(insn);
-            break;
-        case rv_opcode::system:
-            execute_system(insn);
-            break;
-        default:
-            raise_illegal_instruction();
-            break;
-        }
-    }
-    if (unlikely(exception_raised_)) {
-        mcause_ = (uint32_t) exception_code_;
-        switch (exception_code_) {
-        case rv_exception::illegal_instruction:
-            if (!memory_.read(pc_, mvtval_)) {
-                mvtval_ = std::numeric_limits<decltype(mvtval_)>::max();
-            }
-            break;
-        case rv_exception::store_access_fault:
-        case rv_exception::load_access_fault:
-        case rv_exception::instruction_access_fault:
-            mvtval_ = memory_.faultAddress();
-            break;
-        default:
-            mvtval_ = 0;
-            break;
-        }
-
-        mepc_ = pc_ + 4;
-        // save previous interrupt enable flag
-        mstatus_ = (mstatus_ & ~RV_MSTATUS_MPIE) |
-                   (((mstatus_ >> priv_) & 1) << RV_MSTATUS_MPIE_SHIFT);
-
-        // save previous privilege level
-        mstatus_ = (mstatus_ & ~RV_MSTATUS_MPP) |
-                   (priv_ << RV_MSTATUS_MPP_SHIFT);
+    exception_tval_ = 0;
+    amo_reserved_ = false;
+    waiting_ = false;
 
-        // exception are always taken with interrupts disabled
-        mstatus_ &= ~RV_MSTATUS_MIE;
+    // no translation, machine mode
+    mmu_.reset();
 
-        // switch privilege level to machine mode
-        // we don't support delegated exceptions and/or interrupts
-        // exceptions are always taken at Machine Level
-        priv_ = RV_PRIV_M;
-
-        // transfer execution to machine mode exception handler
-        pc_ = mtvec_;
-    }
-    cycle_ += nCycles - c;
+    fetch_page_ = nullptr;
+    fetch_page_number_ = std::numeric_limits<rv_uint>::max();
 }
 
-void rv_cpu::execute_lui(uint32_t insn)
+void rv_cpu::save(rv_snapshot_writer& out) const
 {
-    const auto rd = decode_rd(insn);
-    regs_[rd] = insn & 0xFFFFF000;
-    next_insn();
+    out.put(hartid_);
+    out.put(pc_);
+    out.put(regs_);
+    out.put(priv_);
+    out.put(waiting_);
+    out.put(amo_reserved_);
+    out.put(amo_res_);
+    out.put(amo_res_value_);
+    out.put(cycle_);
+    out.put(instret_);
+
+    out.put(mstatus_);
+    out.put(misa_);
+    out.put(mie_);
+    out.put(mtvec_);
+    out.put(mcounteren_);
+    out.put(medeleg_);
+    out.put(mideleg_);
+    out.put(mscratch_);
+    out.put(mepc_);
+    out.put(mcause_);
+    out.put(mvtval_);
+    out.put(mip_.load());
+
+    out.put(stvec_);
+    out.put(scounteren_);
+    out.put(sscratch_);
+    out.put(sepc_);
+    out.put(scause_);
+    out.put(stval_);
+    out.put(mmu_.satp());
 }
 
-void rv_cpu::execute_auipc(uint32_t insn)
+bool rv_cpu::restore(rv_snapshot_reader& in)
 {
-    const auto rd = decode_rd(insn);
-    regs_[rd] = pc_ + (int32_t)(insn & 0xFFFFF000);
-    next_insn();
+    rv_uint hartid;
+    if (!in.get(hartid) || hartid != hartid_)
+        return false;
+
+    in.get(pc_);
+    in.get(regs_);
+    in.get(priv_);
+    in.get(waiting_);
+    in.get(amo_reserved_);
+    in.get(amo_res_);
+    in.get(amo_res_value_);
+    in.get(cycle_);
+    in.get(instret_);
+
+    in.get(mstatus_);
+    in.get(misa_);
+    in.get(mie_);
+    in.get(mtvec_);
+    in.get(mcounteren_);
+    in.get(medeleg_);
+    in.get(mideleg_);
+    in.get(mscratch_);
+    in.get(mepc_);
+    in.get(mcause_);
+    in.get(mvtval_);
+    rv_uint mip;
+    in.get(mip);
+    mip_.store(mip);
+
+    in.get(stvec_);
+    in.get(scounteren_);
+    in.get(sscratch_);
+    in.get(sepc_);
+    in.get(scause_);
+    in.get(stval_);
+    rv_uint satp;
+    in.get(satp);
+
+    exception_raised_ = false;
+    mmu_.reset();
+    mmu_.set_satp(satp);
+    update_mmu_context();
+    return in.ok();
 }
 
-void rv_cpu::execute_jal(uint32_t insn)
+void rv_cpu::set_tiers(const rv_tier_config& tiers)
 {
-    const auto rd = decode_rd(insn);
-    rv_int imm = (bits(insn, 21, 30) << 1) |
-                 (bit(insn, 20) << 11) |
-                 (bits(insn, 12, 19) << 12) |
-                 (bit(insn, 31) << 20);
-    imm = (imm << 11) >> 11;
-    if (rd != 0) {
-        regs_[rd] = pc_ + 4;
+    tiers_ = tiers;
+    blocks_.set_threshold(tiers.threaded_threshold);
+    jit_.set_code_cache_size(tiers.max_tier >= rv_tier::native ? tiers.code_cache_size : 0);
+    jit_.set_compile_thread(tiers.compile_thread);
+    jit_threshold_ = tiers.max_tier >= rv_tier::native ? std::max<uint32_t>(tiers.native_threshold, 1)
+                                                       : std::numeric_limits<uint32_t>::max();
+    blocks_.set_native_threshold(tiers.max_tier >= rv_tier::native ? jit_threshold_ : 0);
+    blocks_.set_trace_threshold(tiers.max_tier == rv_tier::trace ? std::max<uint32_t>(tiers.trace_threshold, 1) : 0);
+    // traces already compiled go too
+    if (tiers.max_tier < rv_tier::trace)
+        jit_.flush();
+    if (tiers.max_tier == rv_tier::interpreter) {
+        blocks_.clear();
     }
-    jump_insn(pc_ + imm);
 }
 
-void rv_cpu::execute_jalr(uint32_t insn)
+void rv_cpu::run(size_t nCycles)
 {
-    const rv_int imm = (rv_int)insn >> 20;
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
-
-    if (rd != 0) {
-        regs_[rd] = pc_ + 4;
+    // any interrupt pending ends wfi, even a disabled one
+    if (unlikely(waiting_)) {
+        if (idle())
+            return;
+        waiting_ = false;
     }
-    jump_insn((regs_[rs1] + imm) & 0xFFFFFFFE);
-}
 
-void rv_cpu::execute_branch(uint32_t insn)
-{
-    const auto rs1 = decode_rs1(insn);
-    const auto rs2 = decode_rs2(insn);
-    const auto funct3 = decode_funct3(insn);
+    t_running_hart = this;
+    if (unlikely(remote_requests_.load(std::memory_order_acquire) != 0))
+        process_remote_requests();
 
-    const rv_uint val1 = regs_[rs1];
-    const rv_uint val2 = regs_[rs2];
-    int cond = 0;
-    switch (funct3 >> 1) {
-        case 0b00:  // beq | bne
-            cond = val1 == val2;
-            break;
-        case 0b10:  // blt | bge
-            cond = (rv_int)val1 < (rv_int)val2;
-            break;
-        case 0b11:  // bltu | bgeu
-            cond = val1 < val2;
-            break;
-    }
-    cond ^= (funct3 & 1);
-    if (cond != 0) {
-        rv_int imm = (bits(insn, 8, 11) << 1) |
-                     (bits(insn, 25, 30) << 5) |
-                     (bit(insn, 7) << 11) |
-                     (bit(insn, 31) << 12);
-        imm = (imm << 19) >> 19;
-        jump_insn((pc_ + imm) & 0xFFFFFFFE);
+    // cleared before looking at the interrupts and the deadline, an interrupt raised
+    // or a closer deadline scheduled from now on sets it again
+    exit_request_.store(false, std::memory_order_relaxed);
+    raise_interrupt();
+
+    // blocks invalidated during the previous run can be freed now, all of them past the limit
+    if (blocks_.has_retired()) {
+        jit_.drain(false);
+        blocks_.reclaim();
     }
-    else {
-        next_insn();
+    if (unlikely(blocks_.size() > tiers_.block_limit)) {
+        jit_.flush();
+        blocks_.clear();
     }
-}
+    jit_.install_traces();
 
-void rv_cpu::execute_load(uint32_t insn)
-{
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
-    const auto funct3 = decode_funct3(insn);
+    nCycles = events_.until_next(nCycles);
+    auto c = nCycles;
+    while (likely(!exception_raised_) && c != 0) {
+        if (likely(tiers_.max_tier != rv_tier::interpreter)) {
+            c -= execute_blocks(c);
+            if (exception_raised_ || c == 0 || exit_request_.load(std::memory_order_relaxed))
+                break;
+        }
 
-    const rv_int imm = (rv_int)insn >> 20;
-    const rv_uint addr = regs_[rs1] + imm;
-    rv_uint val;
-    switch (funct3) {
-        case 0b000:  // lb
-            int8_t i8;
-            if (!memory_.read(addr, i8)) {
-                raise_memory_exception();
-                return;
-            }
-            val = i8;
-            break;
-        case 0b001:  // lh
-            int16_t i16;
-            if (!memory_.read(addr, i16)) {
-                raise_memory_exception();
-                return;
-            }
-            val = i16;
-            break;
-        case 0b010:  // lw
-            int32_t i32;
-            if (!memory_.read(addr, i32)) {
-                raise_memory_exception();
-                return;
-            }
-            val = i32;
-            break;
-        case 0b100:  // lbu
-            uint8_t u8;
-            if (!memory_.read(addr, u8)) {
-                raise_memory_exception();
-                return;
-            }
-            val = u8;
+        // pc not backed by RAM or not warm yet, or fewer cycles left than the next block needs
+        c -= interpret(c);
+        if (exit_request_.load(std::memory_order_relaxed))
             break;
-        case 0b101:  //lhu
-            uint16_t u16;
-            if (!memory_.read(addr, u16)) {
-                raise_memory_exception();
-                return;
-            }
-            val = u16;
-            break;
-        default:
-            raise_illegal_instruction();
-            return;
     }
-    if (likely(rd != 0))
-        regs_[rd] = val;
-    next_insn();
+    if (unlikely(exception_raised_))
+        enter_trap();
+    cycle_ += nCycles - c;
+    events_.advance(nCycles - c);
+    t_running_hart = nullptr;
 }
 
-void rv_cpu::execute_store(uint32_t insn)
+static rv_uint trap_vector(rv_uint tvec, rv_uint cause)
 {
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
-    const auto rs2 = decode_rs2(insn);
-    const auto funct3 = decode_funct3(insn);
-
-    const rv_int imm = (rv_int)((insn & 0xFE000000) | (rd << 20)) >> 20;
-    const rv_uint addr = regs_[rs1] + imm;
-    const rv_uint val = regs_[rs2];
-    switch (funct3) {
-        case 0b000:  // sb
-            if (!memory_.write(addr, (uint8_t)(val & 0xFF))) {
-                raise_memory_exception();
-            }
-            break;
-        case 0b001:  // sh
-            if (!memory_.write(addr, (uint16_t)(val & 0xFFFF))) {
-                raise_memory_exception();
-                return;
-            }
-            break;
-        case 0b010:  // sw
-            if (!memory_.write(addr, val)) {
-                raise_memory_exception();
-                return;
-            }
-            break;
-        default:
-            raise_illegal_instruction();
-            return;
-    }
-    next_insn();
+    // vectored mode only applies to interrupts
+    const rv_uint base = tvec & ~3U;
+    if ((tvec & 3) == 1 && (cause & 0x80000000) != 0)
+        return base + (cause & 0x7FFFFFFF) * 4;
+    return base;
 }
 
-void rv_cpu::execute_imm(uint32_t insn)
+void rv_cpu::enter_trap()
 {
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
-    const auto funct3 = decode_funct3(insn);
-
-    const rv_int imm = (rv_int)insn >> 20;
-    rv_uint res = 0;
-    const rv_uint val = regs_[rs1];
-    switch (funct3) {
-        case 0b000:  // addi
-            res = val + imm;
-            break;
-        case 0b001:  // slli
-/*            if ((imm & 0x5F) != 0) {
-                raise_illegal_instruction();
-                return;
-            }*/
-            res  = val << (imm & 0x1F);
-            break;
-        case 0b010:  // slti
-            res = (rv_int)val < imm ? 1 : 0;
-            break;
-        case 0b011:  // sltiu
-            res = val < imm ? 1 : 0;
-            break;
-        case 0b100:
-            res = val ^ imm;
-            break;
-        case 0b101:  // srai | srli
-        {
-            if ((imm & 0xFFFFFBE0) != 0) {
-                raise_illegal_instruction();
-                return;
-            }
-            if ((imm & 0x400) != 0)
-                res = (rv_int)val >> (imm & 0x1F);
-            else
-                res = val >> (imm & 0x1F);
-            break;
-        }
-        case 0b110:  // ori
-            res = val | imm;
-            break;
-        case 0b111:  // andi
-            res = val & imm;
-            break;
+    const auto cause = (rv_uint)exception_code_;
+    const bool interrupt = (cause & 0x80000000) != 0;
+
+    // traps break lr/sc sequences
+    amo_reserved_ = false;
+
+    auto tval = exception_tval_;
+    if (exception_code_ == rv_exception::illegal_instruction) {
+        // the faulting instruction itself
+        rv_uint paddr;
+        if (!mmu_.translate_fetch(pc_, paddr) || !memory_.read(paddr, tval))
+            tval = 0;
     }
-    if (likely(rd != 0))
-        regs_[rd] = res;
-    next_insn();
-}
 
-void rv_cpu::execute_op(uint32_t insn)
-{
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
-    const auto rs2 = decode_rs2(insn);
-    const auto funct3 = decode_funct3(insn);
-
-    const rv_uint imm = insn >> 25;
-    const rv_uint val1 = regs_[rs1];
-    const rv_uint val2 = regs_[rs2];
-    rv_uint res = 0;
-    if (imm == 1) {
-        const auto sval1 = (rv_int)val1;
-        const auto sval2 = (rv_int)val2;
-        switch (funct3) {
-        case 0b000:  // mul
-            res = (rv_uint)((rv_long)sval1 * (rv_long)sval2);
-            break;
-        case 0b001:  // mulh
-            res = (rv_uint)(((rv_long)sval1 * (rv_long)sval2) >> 32);
-            break;
-        case 0b010:  // mulhsu
-            res = (rv_uint)(((rv_long)sval1 * (rv_long)val2) >> 32);
-            break;
-        case 0b011:  // mulhu
-            res = (rv_uint)(((rv_long)val1 * (rv_long)val2) >> 32);
-            break;
-        case 0b100:  // div
-        {
-            if (val2 == 0)
-                res = (rv_uint)-1;
-            else if (val1 == 0x80000000 && val2 == (rv_int)-1)
-                res = val1;
-            else
-                res = sval1 / sval2;
-        }
-        break;
-
-        case 0b101:  // divu
-            if (val2 == 0)
-                res = (rv_uint)-1;
-            else
-                res = val1 / val2;
-            break;
-        case 0b110:  // rem
-        {
-            if (val2 == 0)
-                res = val1;
-            else if (val1 == 0x80000000 && val2 == (rv_int)-1)
-                res = 0;
-            else
-                res = (rv_uint)(sval1 % sval2);
-        }
-        break;
-        case 0b111:  // remu
-            if (val2 == 0)
-                res = val1;
-            else
-                res = val1 % val2;
-            break;
-        }
+    // epc always points to the instruction that didn't complete (or the one to resume with)
+    const auto deleg = interrupt ? mideleg_ : medeleg_;
+    if (priv_ <= RV_PRIV_S && ((deleg >> (cause & 0x1F)) & 1) != 0) {
+        scause_ = cause;
+        sepc_ = pc_;
+        stval_ = tval;
+
+        // save previous interrupt enable flag and privilege level, interrupts get disabled
+        mstatus_ = (mstatus_ & ~(RV_MSTATUS_SPIE | RV_MSTATUS_SPP | RV_MSTATUS_SIE)) |
+                   (((mstatus_ >> RV_MSTATUS_SIE_SHIFT) & 1) << RV_MSTATUS_SPIE_SHIFT) |
+                   (priv_ << RV_MSTATUS_SPP_SHIFT);
+        priv_ = RV_PRIV_S;
+        pc_ = trap_vector(stvec_, cause);
     }
     else {
-        switch (funct3) {
-        case 0b000:  // add | sub
-        {
-            if (unlikely((imm & 0x5F) != 0)) {
-                raise_illegal_instruction();
-                return;
-            }
-            if ((imm & 0x20) != 0)  // sub
-                res = val1 - val2;
-            else  // add
-                res = val1 + val2;
-        }
-        break;
-        case 0b001:  // sll
-            res = val1 << val2;
-            break;
-        case 0b010:  // slt
-            res = (rv_int)val1 < (rv_int)val2 ? 1 : 0;
-            break;
-        case 0b011:  // sltu
-            res = val1 < val2 ? 1 : 0;
-            break;
-        case 0b100:  // xor
-            res = val1 ^ val2;
-            break;
-        case 0b101:  // srl | sra
-        {
-            if ((imm & 0x5F) != 0) {
-                raise_illegal_instruction();
-                return;
-            }
-            if ((imm & 0x20) != 0)  // sra
-                res = (rv_uint)((rv_int)val1 >> val2);
-            else  // srl
-                res = val1 >> val2;
-        }
-        break;
-        case 0b110:  // or
-            res = val1 | val2;
-            break;
-        case 0b111:  // and
-            res = val1 & val2;
-            break;
-        }
-    }
-    if (likely(rd != 0)) {
-        regs_[rd] = res;
-    }
-    next_insn();
-}
-
-void rv_cpu::execute_amo(uint32_t insn)
-{
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
-    const auto rs2 = decode_rs2(insn);
-    const auto funct5 = insn >> 27;
+        mcause_ = cause;
+        mepc_ = pc_;
+        mvtval_ = tval;
 
-    const auto addr = regs_[rs1];
-    rv_uint val;
-    switch (funct5) {
-    case 0b00010:  // lr.w
-        if (rs2 != 0) {
-            raise_illegal_instruction();
-            return;
-        }
-        int32_t i32;
-        if (!memory_.read(addr, i32)) {
-            raise_memory_exception();
-            return;
-        }
-        val = i32;
-        amo_res_ = addr;
-        break;
-
-    case 0b00011:  // sc.w
-        if (amo_res_ == addr) {
-            if (!memory_.write(addr, regs_[rs1])) {
-                raise_memory_exception();
-                return;
-            }
-            val = 0;
-        }
-        else {
-            val = 1;
-        }
-        break;
-    case 0b00001:  // amoswap.w
-    case 0b00000:  // amoadd.w
-    case 0b00100:  // amoxor.w
-    case 0b01100:  // amoand.w
-    case 0b01000:  // amoor.w
-    case 0b10000:  // amomin.w
-    case 0b10100:  // amomax.w
-    case 0b11000:  // amominu.w
-    case 0b11100:  // amomaxu.w
-    {
-        if (memory_.read(addr, (int32_t&)val)) {
-            raise_memory_exception();
-            return;
-        }
-        auto val2 = regs_[rs2];
-        switch (funct5) {
-        case 0b00001:  // amoswap.w
-            break;
-        case 0b00000:  // amoadd.w
-            val2 = (int32_t)(val + val2);
-            break;
-        case 0b00100:  // amoxor.w
-            val2 = (int32_t)(val ^ val2);
-            break;
-        case 0b01100:  // amoand.w
-            val2 = (int32_t)(val & val2);
-            break;
-        case 0b01000:  // amoor.w
-            val2 = (int32_t)(val | val2);
-            break;
-        case 0b10000:  // amomin.w
-            if ((int32_t)val < (int32_t)val2)
-                val2 = (int32_t)val;
-            break;
-        case 0b10100:  // amomax.w
-            if ((int32_t)val > (int32_t)val2)
-                val2 = (int32_t)val;
-            break;
-        case 0b11000:  // amominu.w
-            if ((uint32_t)val < (uint32_t)val2)
-                val2 = (int32_t)val;
-            break;
-        case 0b11100:  // amomaxu.w
-            if ((uint32_t)val > (uint32_t)val2)
-                val2 = (int32_t)val;
-            break;
-
-        }
-        if (!memory_.write(addr, val2)) {
-            raise_memory_exception();
-            return;
-        }
-        if (rd != 0) {
-            regs_[rd] = val;
-        }
-    }
-    break;
-    default:
-        raise_illegal_instruction();
-        return;
+        mstatus_ = (mstatus_ & ~(RV_MSTATUS_MPIE | RV_MSTATUS_MPP | RV_MSTATUS_MIE)) |
+                   (((mstatus_ >> RV_MSTATUS_MIE_SHIFT) & 1) << RV_MSTATUS_MPIE_SHIFT) |
+                   (priv_ << RV_MSTATUS_MPP_SHIFT);
+        priv_ = RV_PRIV_M;
+        pc_ = trap_vector(mtvec_, cause);
     }
-    next_insn();
-}
-void rv_cpu::execute_misc_mem(uint32_t insn)
-{
-    // fence and fence.i are nops
-    next_insn();
+    exception_raised_ = false;
+    update_mmu_context();
 }
 
-void rv_cpu::execute_system(uint32_t insn)
+bool rv_cpu::counter_enabled(uint32_t csr) const
 {
-    const auto rd = decode_rd(insn);
-    const auto rs1 = decode_rs1(insn);
-    const auto funct3 = decode_funct3(insn);
-    const uint32_t imm = insn >> 20;
-
-    switch (funct3) {
-    case 0:  // ecall | ebreak | mret
-        switch (imm) {
-        case 0:  // ecall
-            if ((insn & 0x000FFF80) != 0)
-                raise_illegal_instruction();
-            raise_exception(static_cast<rv_exception>(
-                                static_cast<uint32_t>(rv_exception::ecall_from_umode) +
-                                static_cast<uint32_t>(priv_))
-            );
-            return;
-        case 1:  // ebreak
-            if ((insn & 0x000FFF80) != 0)
-                raise_illegal_instruction();
-            raise_exception(rv_exception::breakpoint);
-            return;
-        case 0x302:  // mret
-            if ((insn & 0x000FFF80) != 0 || priv_ < RV_PRIV_M)
-                raise_illegal_instruction();
-            execute_mret();
-            return;
-        default:
-            raise_illegal_instruction();
-            return;
-        }
-        break;
-
-    case 1:  // csrrw
-    case 2:  // csrrs
-    case 3:  // csrrc
-        if (!csr_rw(imm, rd, regs_[rs1], funct3))
-            return;
-        break;
-    case 5:  // csrrwi
-    case 6:  // csrrsi
-    case 7:  // csrrci
-        if (!csr_rw(imm, rd, (rv_uint)(rs1 & 0b11111), funct3 - 4))
-            return;
-        break;
-    default:
-        raise_illegal_instruction();
-        return;
-    }
-
-    next_insn();
+    // cycle, time and instret (and their high halves) map to bits 0..2 of the enable registers
+    const rv_uint bit = 1U << (csr & 0x1F);
+    if (priv_ < RV_PRIV_M && (mcounteren_ & bit) == 0)
+        return false;
+    if (priv_ < RV_PRIV_S && (scounteren_ & bit) == 0)
+        return false;
+    return true;
 }
 
 bool rv_cpu::csr_read(uint32_t csr, rv_uint &csr_value, bool write_back)
@@ -757,35 +421,81 @@ bool rv_cpu::csr_read(uint32_t csr, rv_uint &csr_value, bool write_back)
     switch ((rv_csr)csr) {
     case rv_csr::cycle:
     case rv_csr::instret:
-        if (priv_ < RV_PRIV_M) {
-            if ((mcounteren_ & RV_MCOUNTEREN_CY) == 0) {
-                raise_illegal_instruction();
-                return false;
-            }
+        if (!counter_enabled(csr)) {
+            raise_illegal_instruction();
+            return false;
         }
         csr_value = (rv_uint)(cycle_ & 0xFFFFFFFF);
         break;
     case rv_csr::cycleh:
     case rv_csr::instreth:
-        if (priv_ < RV_PRIV_M) {
-            if ((mcounteren_ & RV_MCOUNTEREN_IR) == 0) {
-                raise_illegal_instruction();
-                return false;
-            }
+        if (!counter_enabled(csr)) {
+            raise_illegal_instruction();
+            return false;
         }
         csr_value = (rv_uint)(cycle_ >> 32);
         break;
+    case rv_csr::time:
+    case rv_csr::timeh:
+        // the same clock as the CLINT's mtime
+        if (!counter_enabled(csr)) {
+            raise_illegal_instruction();
+            return false;
+        }
+        csr_value = (rv_uint)(events_.now() >> (csr == (uint32_t)rv_csr::timeh ? 32 : 0));
+        break;
+    case rv_csr::sstatus:
+        csr_value = mstatus_ & RV_SSTATUS_MASK;
+        break;
+    case rv_csr::sie:
+        csr_value = mie_ & mideleg_;
+        break;
+    case rv_csr::sip:
+        csr_value = mip_.load(std::memory_order_relaxed) & mideleg_;
+        break;
+    case rv_csr::stvec:
+        csr_value = stvec_;
+        break;
+    case rv_csr::scounteren:
+        csr_value = scounteren_;
+        break;
+    case rv_csr::sscratch:
+        csr_value = sscratch_;
+        break;
+    case rv_csr::sepc:
+        csr_value = sepc_;
+        break;
+    case rv_csr::scause:
+        csr_value = scause_;
+        break;
+    case rv_csr::stval:
+        csr_value = stval_;
+        break;
+    case rv_csr::satp:
+        // trapped to machine mode with mstatus.TVM
+        if (priv_ == RV_PRIV_S && (mstatus_ & RV_MSTATUS_TVM) != 0) {
+            raise_illegal_instruction();
+            return false;
+        }
+        csr_value = mmu_.satp();
+        break;
     case rv_csr::mstatus:
         csr_value = mstatus_;
         break;
     case rv_csr::misa:
         csr_value = misa_;
         break;
+    case rv_csr::medeleg:
+        csr_value = medeleg_;
+        break;
+    case rv_csr::mideleg:
+        csr_value = mideleg_;
+        break;
     case rv_csr::mie:
         csr_value = mie_;
         break;
     case rv_csr::mip:
-        csr_value = mip_;
+        csr_value = mip_.load(std::memory_order_relaxed);
         break;
     case rv_csr::mtvec:
         csr_value = mtvec_;
@@ -807,9 +517,11 @@ bool rv_cpu::csr_read(uint32_t csr, rv_uint &csr_value, bool write_back)
         break;
     case rv_csr::mvendorid:
     case rv_csr::mimpid:
-    case rv_csr::mhartid:
         csr_value = 0;
         break;
+    case rv_csr::mhartid:
+        csr_value = hartid_;
+        break;
     default:
         raise_illegal_instruction();
         return false;
@@ -821,25 +533,81 @@ bool rv_cpu::csr_write(uint32_t csr, rv_uint csr_value)
 {
     uint32_t mask;
     switch ((rv_csr)csr) {
+    case rv_csr::sstatus:
+        mstatus_ = (mstatus_ & ~RV_SSTATUS_MASK) | (csr_value & RV_SSTATUS_MASK);
+        update_mmu_context();
+        check_interrupts();
+        break;
+    case rv_csr::sie:
+        mask = mideleg_;
+        mie_ = (mie_ & ~mask) | (csr_value & mask);
+        check_interrupts();
+        break;
+    case rv_csr::sip:
+        // only the software interrupt can be set from here
+        mask = mideleg_ & RV_MIP_SSIP;
+        mip_.fetch_or(csr_value & mask);
+        mip_.fetch_and(csr_value | ~mask);
+        check_interrupts();
+        break;
+    case rv_csr::stvec:
+        // direct and vectored modes only
+        stvec_ = csr_value & ~2U;
+        break;
+    case rv_csr::scounteren:
+        mask = RV_MCOUNTEREN_CY | RV_MCOUNTEREN_TM | RV_MCOUNTEREN_IR;
+        scounteren_ = csr_value & mask;
+        break;
+    case rv_csr::sscratch:
+        sscratch_ = csr_value;
+        break;
+    case rv_csr::sepc:
+        sepc_ = csr_value & ~3U;
+        break;
+    case rv_csr::scause:
+        scause_ = csr_value;
+        break;
+    case rv_csr::stval:
+        stval_ = csr_value;
+        break;
+    case rv_csr::satp:
+        mmu_.set_satp(csr_value);
+        break;
     case rv_csr::mstatus:
-        // no support for TLB flush
         // no support for SXL/UXL (RV32 mode only)
         // no support for floating point unit
-        mstatus_ = csr_value;
+        // MPP can't hold the reserved mode 2, keep the previous value then
+        mask = RV_MSTATUS_MASK;
+        if (((csr_value & RV_MSTATUS_MPP) >> RV_MSTATUS_MPP_SHIFT) == 2)
+            mask &= ~RV_MSTATUS_MPP;
+        mstatus_ = (mstatus_ & ~mask) | (csr_value & mask);
+        update_mmu_context();
+        check_interrupts();
         break;
     case rv_csr::misa:
         return false;
+    case rv_csr::medeleg:
+        medeleg_ = csr_value & RV_MEDELEG_MASK;
+        break;
+    case rv_csr::mideleg:
+        mask = RV_MIP_SSIP | RV_MIP_STIP | RV_MIP_SEIP;
+        mideleg_ = csr_value & mask;
+        check_interrupts();
+        break;
     case rv_csr::mie:
-        // we can only set Machine Mode interrupts
-        mask = RV_MIE_MSIE | RV_MIE_MTIE | RV_MIE_MEIE;
+        mask = RV_MIE_MSIE | RV_MIE_MTIE | RV_MIE_MEIE | RV_MIE_SSIE | RV_MIE_STIE | RV_MIE_SEIE;
         mie_ = (mie_ & ~mask) | (csr_value & mask);
+        check_interrupts();
         break;
     case rv_csr::mip:
-        // we don't support supervisor mode or user mode interrupts
-        // so do nothing here
+        // machine mode interrupts are driven by the devices, supervisor ones can be raised by software
+        mask = RV_MIP_SSIP | RV_MIP_STIP | RV_MIP_SEIP;
+        mip_.fetch_or(csr_value & mask);
+        mip_.fetch_and(csr_value | ~mask);
+        check_interrupts();
         break;
     case rv_csr::mtvec:
-        mtvec_ = csr_value;
+        mtvec_ = csr_value & ~2U;
         break;
     case rv_csr::mcounteren:
         mask = RV_MCOUNTEREN_CY | RV_MCOUNTEREN_TM | RV_MCOUNTEREN_IR;
@@ -849,7 +617,7 @@ bool rv_cpu::csr_write(uint32_t csr, rv_uint csr_value)
         mscratch_ = csr_value;
         break;
     case rv_csr::mepc:
-        mepc_ = csr_value & (~1);
+        mepc_ = csr_value & ~3U;
         break;
     case rv_csr::mcause:
         mcause_ = csr_value;
@@ -881,7 +649,7 @@ bool rv_cpu::csr_rw(uint32_t csr, uint32_t rd, rv_uint new_value, uint32_t csrop
             return false;
         }
         if (new_value != 0) {
-            if(!csr_write(csr, csrvalue & ~new_value)) {
+            if (!csr_write(csr, csrvalue | new_value)) {
                 return false;
             }
         }
@@ -891,7 +659,7 @@ bool rv_cpu::csr_rw(uint32_t csr, uint32_t rd, rv_uint new_value, uint32_t csrop
             return false;
         }
         if (new_value != 0) {
-            if (!csr_write(csr, csrvalue | new_value)) {
+            if(!csr_write(csr, csrvalue & ~new_value)) {
                 return false;
             }
         }
@@ -907,38 +675,334 @@ bool rv_cpu::csr_rw(uint32_t csr, uint32_t rd, rv_uint new_value, uint32_t csrop
 
 void rv_cpu::execute_mret()
 {
-    uint32_t mpp = (mstatus_ >> RV_MSTATUS_MPP_SHIFT) & 3;
-    uint32_t mpie = (mstatus_ >> RV_MSTATUS_MPIE_SHIFT) & 1;
-    mstatus_ = (mstatus_ & ~(1 << mpp)) |
-        (mpie << mpp);
+    const uint32_t mpp = (mstatus_ >> RV_MSTATUS_MPP_SHIFT) & 3;
+    const uint32_t mpie = (mstatus_ >> RV_MSTATUS_MPIE_SHIFT) & 1;
+    mstatus_ = (mstatus_ & ~RV_MSTATUS_MIE) | (mpie << RV_MSTATUS_MIE_SHIFT);
 
     mstatus_ |= RV_MSTATUS_MPIE;
     mstatus_ &= ~RV_MSTATUS_MPP;
+    // leaving machine mode, loads and stores aren't redirected anymore
+    if (mpp != RV_PRIV_M)
+        mstatus_ &= ~RV_MSTATUS_MPRV;
     priv_ = mpp;
     pc_ = mepc_;
+    update_mmu_context();
+    check_interrupts();
+}
+
+bool rv_cpu::execute_sret()
+{
+    // trapped to machine mode with mstatus.TSR
+    if (priv_ < RV_PRIV_S || (priv_ == RV_PRIV_S && (mstatus_ & RV_MSTATUS_TSR) != 0)) {
+        raise_illegal_instruction();
+        return false;
+    }
+
+    const uint32_t spp = (mstatus_ >> RV_MSTATUS_SPP_SHIFT) & 1;
+    const uint32_t spie = (mstatus_ >> RV_MSTATUS_SPIE_SHIFT) & 1;
+    mstatus_ = (mstatus_ & ~RV_MSTATUS_SIE) | (spie << RV_MSTATUS_SIE_SHIFT);
+
+    mstatus_ |= RV_MSTATUS_SPIE;
+    mstatus_ &= ~(RV_MSTATUS_SPP | RV_MSTATUS_MPRV);
+    priv_ = spp;
+    pc_ = sepc_;
+    update_mmu_context();
+    check_interrupts();
+    return true;
+}
+
+bool rv_cpu::execute_wfi()
+{
+    // trapped to machine mode with mstatus.TW, never allowed in user mode
+    if (priv_ == RV_PRIV_U || (priv_ == RV_PRIV_S && (mstatus_ & RV_MSTATUS_TW) != 0)) {
+        raise_illegal_instruction();
+        return false;
+    }
+
+    // resumes after the wfi, an interrupt taken while waiting returns there as well
+    next_insn();
+    waiting_ = true;
+    request_exit();
+    return true;
+}
+
+bool rv_cpu::execute_sfence_vma(uint32_t rs1)
+{
+    if (priv_ < RV_PRIV_S || (priv_ == RV_PRIV_S && (mstatus_ & RV_MSTATUS_TVM) != 0)) {
+        raise_illegal_instruction();
+        return false;
+    }
+
+    // blocks are keyed by virtual and physical pc, only the TLBs hold stale translations
+    // address space identifiers are ignored, everything is flushed
+    if (rs1 == 0)
+        mmu_.flush();
+    else
+        mmu_.flush(regs_[rs1]);
+    return true;
+}
+
+void rv_cpu::update_mmu_context()
+{
+    // mstatus.MPRV makes machine mode loads and stores use the privilege in mstatus.MPP
+    uint32_t data_priv = priv_;
+    if (priv_ == RV_PRIV_M && (mstatus_ & RV_MSTATUS_MPRV) != 0)
+        data_priv = (mstatus_ >> RV_MSTATUS_MPP_SHIFT) & 3;
+    mmu_.set_context(priv_, data_priv, (mstatus_ & RV_MSTATUS_SUM) != 0, (mstatus_ & RV_MSTATUS_MXR) != 0);
+}
+
+size_t rv_cpu::execute_blocks(size_t budget)
+{
+#define RV_INSN_OP_LABEL(name, handler, flags) &&op_##name,
+    static const void *const dispatch[] = { RV_INSN_OPS(RV_INSN_OP_LABEL) &&block_end };
+#undef RV_INSN_OP_LABEL
+
+    size_t retired = 0;
+    rv_block *block = blocks_.lookup(pc_);
+    const rv_decoded_insn *insn;
+
+next_block:
+    if (unlikely(block == nullptr || block->len > budget - retired || exit_request_.load(std::memory_order_relaxed))) {
+        // where runs end is where the time goes
+        if (block != nullptr)
+            blocks_.sample(*block);
+        return retired;
+    }
+
+    // blocks run threaded while a trace is recorded
+    if (unlikely(blocks_.recording())) {
+        if (!blocks_.record(*block))
+            goto threaded;
+        jit_.compile_trace(blocks_.trace(), blocks_.trace_loops());
+        blocks_.end_trace();
+    }
+    if (block->native != nullptr && (!block->direct || mmu_.bare_data())) {
+        jit_budget_ = budget - retired;
+        jit_exit_block_ = nullptr;
+        blocks_.count_native_entry();
+        jit_.enter(block->native);
+        retired = budget - jit_budget_;
+        if (unlikely(exception_raised_))
+            return retired;
+        block = jit_exit_block_ != nullptr ? blocks_.follow(*jit_exit_block_, pc_, true) : blocks_.lookup(pc_);
+        goto next_block;
+    }
+    // hot blocks keep asking until the compile thread is done with them, direct ones
+    // already compiled run threaded while data translation isn't bare
+    if (unlikely(++block->hits >= jit_threshold_) && block->native == nullptr && jit_.compile(*block))
+        goto next_block;
+
+threaded:
+    insn = block->insns.data();
+    goto *dispatch[(size_t)insn->op];
+
+    // every operation gets its own indirect jump to the next one
+#define RV_INSN_OP_BODY(name, handler, flags) \
+op_##name: \
+    handler(*this, *insn); \
+    if (((flags) & RV_OPF_TRAP) != 0 && unlikely(exception_raised_)) \
+        return retired + (insn - block->insns.data()); \
+    ++insn; \
+    goto *dispatch[(size_t)insn->op];
+
+    RV_INSN_OPS(RV_INSN_OP_BODY)
+#undef RV_INSN_OP_BODY
+
+block_end:
+    retired += block->len;
+    block = blocks_.follow(*block, pc_, false);
+    goto next_block;
+}
+
+size_t rv_cpu::interpret(size_t budget)
+{
+    size_t retired = 0;
+    do {
+        const auto pc = pc_;
+        step();
+        if (unlikely(exception_raised_))
+            break;
+        ++retired;
+        if (pc_ != pc + 4)
+            break;
+    } while (retired < budget && !exit_request_.load(std::memory_order_relaxed));
+    return retired;
+}
+
+void rv_cpu::step()
+{
+    if (unlikely(!mmu_.translate_fetch(pc_, fetch_address_))) {
+        raise_memory_exception();
+        return;
+    }
+
+    // the decode cache is indexed by physical address
+    const auto page_number = fetch_address_ >> RV_MEMORY_PAGE_SHIFT;
+    if (unlikely(page_number != fetch_page_number_)) {
+        fetch_page_ = icache_.lookup(fetch_address_);
+        fetch_page_number_ = page_number;
+    }
+
+    if (likely(fetch_page_ != nullptr)) {
+        const auto& insn = fetch_page_->insns[(fetch_address_ & RV_MEMORY_PAGE_MASK) >> 2];
+        if (likely(memory_.is_code_word(fetch_address_)))
+            insn.handler(*this, insn);
+        else
+            decode_insn();
+    }
+    else {
+        execute_uncached();
+    }
+}
+
+void rv_cpu::decode_insn()
+{
+    // the page may have turned private
+    const auto& insn = icache_.fetch(fetch_address_);
+    fetch_page_number_ = std::numeric_limits<rv_uint>::max();
+    insn.handler(*this, insn);
+}
+
+void rv_cpu::execute_uncached()
+{
+    uint32_t raw;
+    if (unlikely(!memory_.read(fetch_address_, raw))) {
+        raise_exception(rv_exception::instruction_access_fault, pc_);
+        return;
+    }
+
+    const auto insn = rv_decode(raw);
+    insn.handler(*this, insn);
+}
+
+void rv_cpu::invalidate_code(rv_uint address, size_t len)
+{
+    icache_.invalidate(address, len);
+    blocks_.invalidate(address, len);
+    // a shared page may have been replaced by a private copy
+    fetch_page_number_ = std::numeric_limits<rv_uint>::max();
+}
+
+void rv_cpu::flush_code()
+{
+    // code written by other harts is covered too
+    {
+        std::lock_guard<std::mutex> lock{remote_lock_};
+        remote_code_.clear();
+        remote_requests_.store(0);
+    }
+    mmu_.protect_page(0);
+    icache_.clear();
+    jit_.flush();
+    blocks_.clear();
+    fetch_page_ = nullptr;
+    fetch_page_number_ = std::numeric_limits<rv_uint>::max();
+}
+
+void rv_cpu::code_written(rv_uint address, size_t len)
+{
+    // a store of this hart must not run into stale code, even within the current run
+    if (t_running_hart == this) {
+        invalidate_code(address, len);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock{remote_lock_};
+    remote_code_.emplace_back(address, len);
+    remote_requests_.fetch_or(RV_REMOTE_CODE, std::memory_order_release);
+}
+
+void rv_cpu::code_page_protected(rv_uint address)
+{
+    if (t_running_hart == this) {
+        mmu_.protect_page(address);
+    }
+    else {
+        // its TLB may still let it store to the page without the store being reported,
+        // the current block is the longest that may go on
+        remote_requests_.fetch_or(RV_REMOTE_PROTECT, std::memory_order_release);
+        request_exit();
+    }
 }
 
-void rv_cpu::raise_exception(rv_exception code)
+void rv_cpu::process_remote_requests()
+{
+    const auto requests = remote_requests_.exchange(0, std::memory_order_acquire);
+    if ((requests & RV_REMOTE_PROTECT) != 0)
+        mmu_.protect_page(0);
+    if ((requests & RV_REMOTE_CODE) != 0) {
+        std::vector<std::pair<rv_uint, size_t>> ranges;
+        {
+            std::lock_guard<std::mutex> lock{remote_lock_};
+            ranges.swap(remote_code_);
+        }
+        for (const auto& range: ranges)
+            invalidate_code(range.first, range.second);
+    }
+}
+
+void rv_cpu::execute_fence_i()
+{
+    // makes code stored by other harts visible to this one
+    if (remote_requests_.load(std::memory_order_acquire) != 0)
+        process_remote_requests();
+}
+
+void rv_cpu::raise_exception(rv_exception code, rv_uint tval)
 {
     exception_code_ = code;
+    exception_tval_ = tval;
     exception_raised_ = true;
 }
 
+uint32_t rv_cpu::enabled_interrupts() const
+{
+    const uint32_t pending = mie_ & mip_.load(std::memory_order_relaxed);
+    if (pending == 0)
+        return 0;
+
+    // interrupts for a higher privilege level are always enabled, for the current one
+    // only with its global enable bit, delegated ones belong to supervisor mode
+    const bool m_enabled = priv_ < RV_PRIV_M || (mstatus_ & RV_MSTATUS_MIE) != 0;
+    const bool s_enabled = priv_ < RV_PRIV_S || (priv_ == RV_PRIV_S && (mstatus_ & RV_MSTATUS_SIE) != 0);
+    const uint32_t irqs = m_enabled ? pending & ~mideleg_ : 0;
+    if (irqs != 0)
+        return irqs;
+    return s_enabled ? pending & mideleg_ : 0;
+}
+
+void rv_cpu::check_interrupts()
+{
+    if (enabled_interrupts() != 0)
+        request_exit();
+}
+
 void rv_cpu::raise_interrupt()
 {
-    // raise interrupt if interrupts are enabled globally (mstatus.MIE)
-    // and according to interrupt pending/enable mask
-    const uint32_t mask = mie_ & mip_;
-    if (mask == 0 || (mstatus_ & RV_MSTATUS_MIE) == 0)
+    const uint32_t irqs = enabled_interrupts();
+    if (irqs == 0)
         return;
 
-    raise_exception(static_cast<rv_exception>((1U << 31) | __builtin_ctz(mask)));
+    // external, software, timer, then the local interrupts
+    static const uint32_t priority[] = { 11, 3, 7, 9, 1, 5 };
+    uint32_t irq = __builtin_ctz(irqs);
+    for (auto i: priority) {
+        if ((irqs & (1U << i)) != 0) {
+            irq = i;
+            break;
+        }
+    }
+    raise_exception(static_cast<rv_exception>((1U << 31) | irq));
 }
 
 void rv_cpu::update_mip(uint32_t irq_num, bool state)
 {
-    if (state)
-        mip_ |= (1U << irq_num);
-    else
-        mip_ &= ~(1U << irq_num);
+    if (state) {
+        mip_.fetch_or(1U << irq_num);
+        // enable bits belong to the running thread, let run() sort it out at the next block
+        request_exit();
+    }
+    else {
+        mip_.fetch_and(~(1U << irq_num));
+    }
 }
\ No newline at end of file
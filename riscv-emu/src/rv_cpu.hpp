@@ -4,12 +4,17 @@
 #include <type_traits>
 #include <limits>
 #include <array>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <utility>
 #include "rv_global.hpp"
 #include "rv_memory.hpp"
-
-constexpr uint32_t RV_PRIV_U = 0;
-constexpr uint32_t RV_PRIV_S = 1;
-constexpr uint32_t RV_PRIV_M = 3;
+#include "rv_mmu.hpp"
+#include "rv_event_queue.hpp"
+#include "rv_decode_cache.hpp"
+#include "rv_block_cache.hpp"
+#include "rv_jit.hpp"
 
 enum class riscv_register
 {
@@ -28,72 +33,173 @@ enum class riscv_register
     t3, t4, t5, t6
 };
 
+// execution tiers, code moves up as it gets hot
+enum class rv_tier
+{
+    // instruction by instruction through the decode cache
+    interpreter,
+    // translated blocks with threaded dispatch
+    threaded,
+    // blocks compiled to host code
+    native,
+    // hot paths through several blocks compiled and optimized as a whole
+    trace
+};
+
+struct rv_tier_config
+{
+    // highest tier code is promoted to
+    rv_tier max_tier = rv_tier::trace;
+    // executions of a block start before it's translated, of a block before it's compiled
+    uint32_t threaded_threshold = RV_BLOCK_THRESHOLD;
+    uint32_t native_threshold = RV_JIT_THRESHOLD;
+    // runs ending at a native block before a trace is recorded from it
+    uint32_t trace_threshold = RV_JIT_TRACE_SAMPLES;
+    // translated blocks kept before all of them are dropped, native code cache size
+    size_t block_limit = RV_BLOCK_LIMIT;
+    size_t code_cache_size = RV_JIT_CODE_CACHE_SIZE;
+    // compile on the compile thread shared by all harts (see rv_jit) instead of stalling the hart
+    bool compile_thread = true;
+};
+
+// requests queued by other harts
+constexpr uint32_t RV_REMOTE_CODE = 1;
+constexpr uint32_t RV_REMOTE_PROTECT = 2;
+
 class rv_cpu
 {
 public:
     rv_cpu() = delete;
-    explicit rv_cpu(rv_memory& memory);
+    rv_cpu(rv_memory& memory, rv_event_queue& events, rv_uint hartid = 0);
+
+    rv_cpu(const rv_cpu&) = delete;
+    rv_cpu& operator=(const rv_cpu&) = delete;
 
     void reset();
+    // where execution starts after reset, 0x1000 unless an image says otherwise
+    void set_pc(rv_uint pc) { pc_ = pc; }
+    // architectural state for rv_machine::snapshot(), with the hart stopped
+    void save(rv_snapshot_writer& out) const;
+    bool restore(rv_snapshot_reader& in);
+    // forget all decoded and translated code, with the hart stopped, for when RAM
+    // is replaced without the code write handlers hearing about it
+    void flush_code();
+    // with the hart stopped, code already translated beyond the new max_tier is dropped
+    void set_tiers(const rv_tier_config& tiers);
+    // run at most nCycles instructions, stopping at the next event deadline
     void run(size_t nCycles);
+    // can be called from any thread, the current run ends at the next block boundary
+    void request_exit() { exit_request_.store(true, std::memory_order_relaxed); }
+    // stopped in wfi with no interrupt pending, run() does nothing until one shows up
+    bool idle() const { return waiting_ && (mie_ & mip_.load()) == 0; }
 
+    rv_uint hartid() const { return hartid_; }
     uint64_t cycle_count() const { return cycle_; }
+    const rv_chain_stats& chain_stats() const { return blocks_.stats(); }
+    // can be called from any thread, an interrupt enabled is taken at the next block boundary
     void update_mip(uint32_t irq_num, bool state);
 
 private:
-    uint32_t decode_rd(uint32_t insn) { return (insn >> 7) & 0x1F; }
-    uint32_t decode_rs1(uint32_t insn) { return (insn >> 15) & 0x1F; }
-    uint32_t decode_rs2(uint32_t insn) { return (insn >> 20) & 0x1F; }
-    uint32_t decode_funct3(uint32_t insn) { return (insn >> 12) & 0b111; }
-
-    // extract [low, high] bits from a 32bit value
-    uint32_t bits(uint32_t val, uint32_t low, uint32_t high) { return (val >> low) & ((1 << (high - low + 1)) - 1); }
-
-    // extract a single bit from a 32bit value
-    uint32_t bit(uint32_t val, uint32_t bit) { return (val >> bit) & 1; }
+    friend struct rv_insn_ops;
+    friend class rv_jit;
 
     void next_insn(rv_uint cnt = 4) { pc_ += cnt; }
-    void jump_insn(rv_uint newpc) { pc_ = newpc; }
-
-    void raise_exception(rv_exception code);
+    void jump_insn(rv_uint newpc)
+    {
+        if (unlikely((newpc & 3) != 0)) {
+            raise_exception(rv_exception::instruction_address_misaligned, newpc);
+            return;
+        }
+        pc_ = newpc;
+    }
+
+    void raise_exception(rv_exception code, rv_uint tval = 0);
     void raise_interrupt();
+    // pending interrupts the current privilege level and enable bits allow
+    uint32_t enabled_interrupts() const;
+    // after the enable bits changed, ends the block to take a pending interrupt
+    void check_interrupts();
 
     void raise_illegal_instruction() { raise_exception(rv_exception::illegal_instruction); }
-    void raise_memory_exception() { raise_exception(memory_.lastException()); }
-
-    inline void execute_lui(uint32_t insn);
-    inline void execute_auipc(uint32_t insn);
-    inline void execute_jal(uint32_t insn);
-    inline void execute_jalr(uint32_t insn);
-    inline void execute_branch(uint32_t insn);
-    inline void execute_load(uint32_t insn);
-    inline void execute_store(uint32_t insn);
-    inline void execute_amo(uint32_t insn);
-    inline void execute_imm(uint32_t insn);
-    inline void execute_op(uint32_t insn);
-    inline void execute_misc_mem(uint32_t insn);
-    inline void execute_system(uint32_t insn);
+    void raise_memory_exception() { raise_exception(mmu_.fault(), mmu_.fault_address()); }
+
+    // take the raised exception or interrupt, in machine mode or delegated to supervisor mode
+    void enter_trap();
+
+    // execute whole blocks with threaded dispatch until the budget can't fit the next one
+    // returns the number of retired instructions
+    size_t execute_blocks(size_t budget);
+    // execute instructions one at a time up to the next taken jump, where blocks start
+    // returns the number of retired instructions
+    size_t interpret(size_t budget);
+    // execute a single instruction through the decode cache
+    void step();
+    // decode the instruction at pc into the decode cache, then execute it
+    void decode_insn();
+    // fetch, decode and execute without going through the decode cache
+    void execute_uncached();
+    void invalidate_code(rv_uint address, size_t len);
+
+    // memory handlers, changes made by other harts are queued until this one picks them up
+    // at the start of a run or on fence.i, its caches are only ever touched by its own thread
+    void code_written(rv_uint address, size_t len);
+    void code_page_protected(rv_uint address);
+    void process_remote_requests();
+    void execute_fence_i();
 
     bool csr_read(uint32_t csr, rv_uint& csr_value, bool write_back = false);
     bool csr_write(uint32_t csr, rv_uint csr_value);
 
     bool csr_rw(uint32_t csr, uint32_t rd, rv_uint new_value, uint32_t csrop);
+    bool counter_enabled(uint32_t csr) const;
     void execute_mret();
+    bool execute_sret();
+    bool execute_wfi();
+    bool execute_sfence_vma(uint32_t rs1);
+    // privilege or mstatus changed, translation may have to change too
+    void update_mmu_context();
 
 private:
     rv_uint pc_;
     std::array<rv_uint, 32> regs_;
+    rv_uint hartid_;
+
+    // lr.w reservation, sc.w succeeds if the word still holds the value lr.w loaded
+    bool amo_reserved_;
     rv_uint amo_res_;
+    rv_uint amo_res_value_;
+
     rv_memory& memory_;
+    rv_event_queue& events_;
+    rv_mmu mmu_;
+
+    rv_decode_cache icache_;
+    rv_block_cache blocks_;
+    rv_decoded_page *fetch_page_;
+    rv_uint fetch_page_number_;
+    // physical address of the instruction being stepped
+    rv_uint fetch_address_;
+    rv_jit jit_;
+    rv_tier_config tiers_;
+    // block hits compiling it, not reached without the native tier
+    uint32_t jit_threshold_;
+    // instructions native code may still retire before returning to the dispatcher
+    int64_t jit_budget_;
+    // block native code last exited from, nullptr if it can't be linked
+    rv_block *jit_exit_block_;
+    // checked before every block, by the dispatcher and by native code
+    std::atomic<bool> exit_request_;
 
     bool exception_raised_;
     rv_exception exception_code_;
+    rv_uint exception_tval_;
 
     // privilege mode is encoded in a secret, not accessible, register
     uint32_t priv_;
+    // waiting for an interrupt after wfi
+    bool waiting_;
 
-    // Counter/Timers
-    uint64_t time_;
+    // Counter/Timers, time is read from the event queue
     uint64_t cycle_;
     uint64_t instret_;
 
@@ -103,11 +209,28 @@ private:
     rv_uint mie_;
     rv_uint mtvec_;
     rv_uint mcounteren_;
+    rv_uint medeleg_;
+    rv_uint mideleg_;
 
     // Machine Trap Handling
     rv_uint mscratch_;
     rv_uint mepc_;
     rv_uint mcause_;
     rv_uint mvtval_;
-    rv_uint mip_;
+    // set by devices and other harts
+    std::atomic<rv_uint> mip_;
+
+    // Supervisor Trap Setup/Handling, sstatus/sie/sip are views of the machine registers
+    // and satp lives in the mmu
+    rv_uint stvec_;
+    rv_uint scounteren_;
+    rv_uint sscratch_;
+    rv_uint sepc_;
+    rv_uint scause_;
+    rv_uint stval_;
+
+    // RV_REMOTE_* bits, code ranges written by other harts
+    std::atomic<uint32_t> remote_requests_;
+    std::mutex remote_lock_;
+    std::vector<std::pair<rv_uint, size_t>> remote_code_;
 };
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include <cstring>
+#include <string_view>
+#include "rv_decode_cache.hpp"
+#include "rv_insn_ops.hpp"
+#include "rv_code_store.hpp"
+
+std::mutex rv_decode_cache::shared_lock_;
+std::unordered_multimap<size_t, std::weak_ptr<rv_shared_page>> rv_decode_cache::shared_;
+size_t rv_decode_cache::shared_sweep_ = 64;
+
+rv_decode_cache::rv_decode_cache(rv_memory& memory)
+    : memory_{memory}
+{
+
+}
+
+rv_decoded_page *rv_decode_cache::lookup(rv_uint address)
+{
+    const auto page_number = address >> RV_MEMORY_PAGE_SHIFT;
+    auto it = pages_.find(page_number);
+    if (it != pages_.end())
+        return it->second.page;
+
+    // marked first, a write from now on invalidates what is about to be decoded
+    if (!memory_.mark_code_page(address))
+        return nullptr;
+    const auto raw = (const uint32_t *)memory_.host_page(address, RV_PAGE_R);
+    if (raw == nullptr)
+        return nullptr;
+
+    entry e;
+    e.shared = share(raw);
+    e.page = &e.shared->decoded;
+    return pages_.emplace(page_number, std::move(e)).first->second.page;
+}
+
+std::shared_ptr<rv_shared_page> rv_decode_cache::share(const uint32_t *raw)
+{
+    const size_t hash = std::hash<std::string_view>{}(std::string_view{(const char *)raw, RV_MEMORY_PAGE_SIZE});
+    {
+        std::lock_guard<std::mutex> lock{shared_lock_};
+        auto range = shared_.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            auto page = it->second.lock();
+            if (page != nullptr && memcmp(page->raw.data(), raw, RV_MEMORY_PAGE_SIZE) == 0)
+                return page;
+        }
+    }
+
+    // decoded outside the lock, two caches may decode the same page, the first one is kept
+    auto page = std::make_shared<rv_shared_page>();
+    memcpy(page->raw.data(), raw, RV_MEMORY_PAGE_SIZE);
+    page->hash = hash;
+    if (!rv_code_store::shared().load(*page)) {
+        for (size_t i = 0; i < RV_DECODED_PAGE_INSNS; ++i)
+            page->decoded.insns[i] = rv_decode(page->raw[i]);
+    }
+
+    std::lock_guard<std::mutex> lock{shared_lock_};
+    auto range = shared_.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        auto other = it->second.lock();
+        if (other != nullptr && memcmp(other->raw.data(), page->raw.data(), RV_MEMORY_PAGE_SIZE) == 0)
+            return other;
+    }
+    shared_.emplace(hash, page);
+    if (shared_.size() >= shared_sweep_) {
+        for (auto it = shared_.begin(); it != shared_.end(); )
+            it = it->second.expired() ? shared_.erase(it) : std::next(it);
+        shared_sweep_ = std::max<size_t>(shared_.size() * 2, 64);
+    }
+    return page;
+}
+
+const rv_decoded_insn& rv_decode_cache::fetch(rv_uint address)
+{
+    auto& e = pages_.find(address >> RV_MEMORY_PAGE_SHIFT)->second;
+    const auto& insn = e.page->insns[(address & RV_MEMORY_PAGE_MASK) >> 2];
+    if (likely(insn.op != rv_op::decode && memory_.is_code_word(address)))
+        return insn;
+    return decode(e, address);
+}
+
+const rv_decoded_insn& rv_decode_cache::decode(entry& e, rv_uint address)
+{
+    // marked before it's read, a write from now on gets reported
+    memory_.mark_code_words(address, sizeof(uint32_t));
+    // the page is backed by RAM, this read can't fail
+    uint32_t raw = 0;
+    memory_.read(address, raw);
+
+    const size_t index = (address & RV_MEMORY_PAGE_MASK) >> 2;
+    if (e.own == nullptr) {
+        // written since the page was decoded, for the shared one too
+        if (raw == e.shared->raw[index])
+            return e.page->insns[index];
+        make_private(e);
+    }
+    e.page->insns[index] = rv_decode(raw);
+    return e.page->insns[index];
+}
+
+void rv_decode_cache::make_private(entry& e)
+{
+    e.own = std::make_unique<rv_decoded_page>(*e.page);
+    e.page = e.own.get();
+}
+
+uint8_t rv_decode_cache::profile(rv_uint address) const
+{
+    const auto& e = pages_.find(address >> RV_MEMORY_PAGE_SHIFT)->second;
+    return e.own == nullptr ? e.shared->profile[(address & RV_MEMORY_PAGE_MASK) >> 2] : 0;
+}
+
+void rv_decode_cache::mark_profile(rv_uint address, uint8_t mark)
+{
+    auto& store = rv_code_store::shared();
+    auto it = pages_.find(address >> RV_MEMORY_PAGE_SHIFT);
+    if (!store.is_open() || it == pages_.end() || it->second.own != nullptr)
+        return;
+    const uint32_t index = (address & RV_MEMORY_PAGE_MASK) >> 2;
+    if ((it->second.shared->profile[index] & mark) != mark)
+        store.mark(*it->second.shared, index, mark);
+}
+
+void rv_decode_cache::invalidate(rv_uint address, size_t len)
+{
+    // pages are never freed here, the cpu may be executing from the page being written
+    for (rv_uint addr = address & ~3U; addr < address + len; addr += sizeof(uint32_t)) {
+        auto it = pages_.find(addr >> RV_MEMORY_PAGE_SHIFT);
+        if (it == pages_.end())
+            continue;
+        auto& e = it->second;
+        if (e.own == nullptr)
+            make_private(e);
+        e.page->insns[(addr & RV_MEMORY_PAGE_MASK) >> 2] = decode_stub();
+    }
+}
+
+rv_decoded_insn rv_decode_cache::decode_stub()
+{
+    rv_decoded_insn insn{};
+    insn.handler = &rv_insn_ops::decode;
+    insn.op = rv_op::decode;
+    return insn;
+}
\ No newline at end of file
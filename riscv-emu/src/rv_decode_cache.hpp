@@ -0,0 +1,82 @@
+#pragma once
+#include <array>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "rv_global.hpp"
+#include "rv_insn.hpp"
+#include "rv_memory.hpp"
+
+constexpr size_t RV_DECODED_PAGE_INSNS = RV_MEMORY_PAGE_SIZE / sizeof(uint32_t);
+
+struct rv_decoded_page
+{
+    std::array<rv_decoded_insn, RV_DECODED_PAGE_INSNS> insns;
+};
+
+// a RAM page decoded as a whole, shared by every decode cache (of any machine in the process)
+// looking up a page with the same contents, never written once published
+struct rv_shared_page
+{
+    std::array<uint32_t, RV_DECODED_PAGE_INSNS> raw;
+    size_t hash;
+    rv_decoded_page decoded;
+    // RV_CODE_* marks of the blocks starting on the page, from earlier runs (see rv_code_store)
+    std::array<uint8_t, RV_DECODED_PAGE_INSNS> profile{};
+};
+
+// per-page cache of decoded instructions
+// pages start out shared with every other cache that holds the same code, machines running
+// the same image decode it once, a write to a shared page gives the cache a private copy
+// entries of private pages invalidated by a write point to rv_insn_ops::decode and are
+// decoded again the next time they are executed
+// a page is decoded as a whole but only words marked as code (rv_memory::mark_code_words)
+// have their writes reported, fetch() marks a word and checks it the first time it's used
+class rv_decode_cache
+{
+public:
+    rv_decode_cache() = delete;
+    explicit rv_decode_cache(rv_memory& memory);
+
+    // returns nullptr if address is not backed by RAM
+    // entries of words not marked as code may be stale, use fetch() for those
+    rv_decoded_page *lookup(rv_uint address);
+    // decoded instruction at address on a page lookup() returned, decoding it if needed
+    // the page may turn private, pointers lookup() returned for it before are stale
+    const rv_decoded_insn& fetch(rv_uint address);
+
+    // rv_code_store marks of the block starting at address on a page lookup() returned,
+    // 0 once the page turned private
+    uint8_t profile(rv_uint address) const;
+    // tell rv_code_store the block starting at address reached mark, unless the page turned private
+    void mark_profile(rv_uint address, uint8_t mark);
+
+    void invalidate(rv_uint address, size_t len);
+    // free every page, nothing may be executing from them
+    void clear() { pages_.clear(); }
+
+private:
+    struct entry
+    {
+        rv_decoded_page *page;
+        // kept after the page turned private, the cpu may still be executing from it
+        std::shared_ptr<rv_shared_page> shared;
+        std::unique_ptr<rv_decoded_page> own;
+    };
+
+    const rv_decoded_insn& decode(entry& e, rv_uint address);
+    static void make_private(entry& e);
+    static rv_decoded_insn decode_stub();
+    // the shared page holding raw, decoding it if no cache has it
+    static std::shared_ptr<rv_shared_page> share(const uint32_t *raw);
+
+private:
+    rv_memory& memory_;
+    std::unordered_map<rv_uint, entry> pages_;
+
+    // pages in use by some cache, by the hash of their contents, expired ones are swept
+    // out whenever the table doubled in size
+    static std::mutex shared_lock_;
+    static std::unordered_multimap<size_t, std::weak_ptr<rv_shared_page>> shared_;
+    static size_t shared_sweep_;
+};
\ No newline at end of file
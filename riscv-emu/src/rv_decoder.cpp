@@ -0,0 +1,260 @@
+#include "rv_insn.hpp"
+#include "rv_insn_ops.hpp"
+
+constexpr uint32_t kRiscvOpcodeMask = 0x7F;
+
+enum class rv_opcode: uint32_t
+{
+    lui = 0b01101,
+    auipc = 0b00101,
+    jal = 0b11011,
+    jalr = 0b11001,
+    branch = 0b11000,
+    load = 0b00000,
+    store = 0b01000,
+    imm = 0b00100,
+    op = 0b01100,
+    misc_mem = 0b00011,
+    system  = 0b11100,
+    amo = 0b01011
+};
+
+#define RV_INSN_OP_HANDLER(name, handler, flags) &handler,
+static const rv_insn_handler rv_insn_handlers[] = { RV_INSN_OPS(RV_INSN_OP_HANDLER) };
+#undef RV_INSN_OP_HANDLER
+
+static rv_op decode_branch(uint32_t funct3)
+{
+    switch (funct3) {
+    case 0b000: return rv_op::beq;
+    case 0b001: return rv_op::bne;
+    case 0b100: return rv_op::blt;
+    case 0b101: return rv_op::bge;
+    case 0b110: return rv_op::bltu;
+    case 0b111: return rv_op::bgeu;
+    default: return rv_op::illegal;
+    }
+}
+
+static rv_op decode_load(uint32_t funct3)
+{
+    switch (funct3) {
+    case 0b000: return rv_op::lb;
+    case 0b001: return rv_op::lh;
+    case 0b010: return rv_op::lw;
+    case 0b100: return rv_op::lbu;
+    case 0b101: return rv_op::lhu;
+    default: return rv_op::illegal;
+    }
+}
+
+static rv_op decode_store(uint32_t funct3)
+{
+    switch (funct3) {
+    case 0b000: return rv_op::sb;
+    case 0b001: return rv_op::sh;
+    case 0b010: return rv_op::sw;
+    default: return rv_op::illegal;
+    }
+}
+
+static rv_op decode_imm(uint32_t funct3, rv_decoded_insn& d)
+{
+    switch (funct3) {
+    case 0b000: return rv_op::addi;
+    case 0b010: return rv_op::slti;
+    case 0b011: return rv_op::sltiu;
+    case 0b100: return rv_op::xori;
+    case 0b110: return rv_op::ori;
+    case 0b111: return rv_op::andi;
+    case 0b001:  // slli
+        if ((d.imm & ~0x1F) != 0)
+            return rv_op::illegal;
+        return rv_op::slli;
+    case 0b101:  // srli | srai
+        if ((d.imm & 0xFFFFFBE0) != 0)
+            return rv_op::illegal;
+        if ((d.imm & 0x400) != 0) {
+            d.imm &= 0x1F;
+            return rv_op::srai;
+        }
+        return rv_op::srli;
+    }
+    return rv_op::illegal;
+}
+
+static rv_op decode_op(uint32_t funct3, uint32_t funct7)
+{
+    if (funct7 == 1) {
+        switch (funct3) {
+        case 0b000: return rv_op::mul;
+        case 0b001: return rv_op::mulh;
+        case 0b010: return rv_op::mulhsu;
+        case 0b011: return rv_op::mulhu;
+        case 0b100: return rv_op::div;
+        case 0b101: return rv_op::divu;
+        case 0b110: return rv_op::rem;
+        case 0b111: return rv_op::remu;
+        }
+    }
+    else if (funct7 == 0x20) {
+        switch (funct3) {
+        case 0b000: return rv_op::sub;
+        case 0b101: return rv_op::sra;
+        }
+    }
+    else if (funct7 == 0) {
+        switch (funct3) {
+        case 0b000: return rv_op::add;
+        case 0b001: return rv_op::sll;
+        case 0b010: return rv_op::slt;
+        case 0b011: return rv_op::sltu;
+        case 0b100: return rv_op::xor_;
+        case 0b101: return rv_op::srl;
+        case 0b110: return rv_op::or_;
+        case 0b111: return rv_op::and_;
+        }
+    }
+    return rv_op::illegal;
+}
+
+static rv_op decode_amo(uint32_t funct3, uint32_t funct5, uint32_t rs2)
+{
+    if (funct3 != 0b010)
+        return rv_op::illegal;
+
+    switch (funct5) {
+    case 0b00010:  // lr.w
+        if (rs2 != 0)
+            return rv_op::illegal;
+        return rv_op::lr_w;
+    case 0b00011: return rv_op::sc_w;
+    case 0b00001: return rv_op::amoswap_w;
+    case 0b00000: return rv_op::amoadd_w;
+    case 0b00100: return rv_op::amoxor_w;
+    case 0b01100: return rv_op::amoand_w;
+    case 0b01000: return rv_op::amoor_w;
+    case 0b10000: return rv_op::amomin_w;
+    case 0b10100: return rv_op::amomax_w;
+    case 0b11000: return rv_op::amominu_w;
+    case 0b11100: return rv_op::amomaxu_w;
+    default: return rv_op::illegal;
+    }
+}
+
+static rv_op decode_system(uint32_t insn, uint32_t funct3, rv_decoded_insn& d)
+{
+    // csr number is unsigned
+    d.imm = insn >> 20;
+
+    switch (funct3) {
+    case 0:  // ecall | ebreak | sret | mret | wfi | sfence.vma
+        if ((insn >> 25) == 0x09 && d.rd == 0)
+            return rv_op::sfence_vma;
+        if ((insn & 0x000FFF80) != 0)
+            return rv_op::illegal;
+        switch (d.imm) {
+        case 0: return rv_op::ecall;
+        case 1: return rv_op::ebreak;
+        case 0x102: return rv_op::sret;
+        case 0x105: return rv_op::wfi;
+        case 0x302: return rv_op::mret;
+        default: return rv_op::illegal;
+        }
+    case 1: return rv_op::csrrw;
+    case 2: return rv_op::csrrs;
+    case 3: return rv_op::csrrc;
+    case 5: return rv_op::csrrwi;
+    case 6: return rv_op::csrrsi;
+    case 7: return rv_op::csrrci;
+    default: return rv_op::illegal;
+    }
+}
+
+rv_decoded_insn rv_decode(uint32_t insn)
+{
+    rv_decoded_insn d{};
+    d.op = rv_op::illegal;
+    d.rd = (insn >> 7) & 0x1F;
+    d.rs1 = (insn >> 15) & 0x1F;
+    d.rs2 = (insn >> 20) & 0x1F;
+    const uint32_t funct3 = (insn >> 12) & 0b111;
+
+    // add support for compressed instructions!
+    if ((insn & 0b11) != 0b11) {
+        d.handler = &rv_insn_ops::illegal;
+        return d;
+    }
+
+    // alu instructions writing to x0 are nops, everything else has side effects
+    bool writes_rd = false;
+    const auto opcode = (rv_opcode)((insn & kRiscvOpcodeMask) >> 2);
+    switch (opcode) {
+    case rv_opcode::lui:
+        d.imm = (rv_int)(insn & 0xFFFFF000);
+        d.op = rv_op::lui;
+        writes_rd = true;
+        break;
+    case rv_opcode::auipc:
+        d.imm = (rv_int)(insn & 0xFFFFF000);
+        d.op = rv_op::auipc;
+        writes_rd = true;
+        break;
+    case rv_opcode::jal:
+        d.imm = (rv_int)(((insn >> 21) & 0x3FF) << 1 |
+                         ((insn >> 20) & 1) << 11 |
+                         ((insn >> 12) & 0xFF) << 12 |
+                         (insn >> 31) << 20);
+        d.imm = (d.imm << 11) >> 11;
+        d.op = rv_op::jal;
+        break;
+    case rv_opcode::jalr:
+        d.imm = (rv_int)insn >> 20;
+        d.op = funct3 == 0 ? rv_op::jalr : rv_op::illegal;
+        break;
+    case rv_opcode::branch:
+        d.imm = (rv_int)(((insn >> 8) & 0xF) << 1 |
+                         ((insn >> 25) & 0x3F) << 5 |
+                         ((insn >> 7) & 1) << 11 |
+                         (insn >> 31) << 12);
+        d.imm = (d.imm << 19) >> 19;
+        d.op = decode_branch(funct3);
+        break;
+    case rv_opcode::load:
+        d.imm = (rv_int)insn >> 20;
+        d.op = decode_load(funct3);
+        break;
+    case rv_opcode::store:
+        d.imm = (rv_int)((insn & 0xFE000000) | (d.rd << 20)) >> 20;
+        d.op = decode_store(funct3);
+        break;
+    case rv_opcode::imm:
+        d.imm = (rv_int)insn >> 20;
+        d.op = decode_imm(funct3, d);
+        writes_rd = true;
+        break;
+    case rv_opcode::op:
+        d.op = decode_op(funct3, insn >> 25);
+        writes_rd = true;
+        break;
+    case rv_opcode::amo:
+        d.op = decode_amo(funct3, insn >> 27, d.rs2);
+        break;
+    case rv_opcode::misc_mem:
+        // fence keeps its predecessor/successor sets in imm
+        d.imm = (insn >> 20) & 0xFF;
+        d.op = funct3 == 0 ? rv_op::fence : funct3 == 1 ? rv_op::fence_i : rv_op::illegal;
+        break;
+    case rv_opcode::system:
+        d.op = decode_system(insn, funct3, d);
+        break;
+    default:
+        break;
+    }
+
+    if (writes_rd && d.rd == 0 && d.op != rv_op::illegal)
+        d.op = rv_op::nop;
+
+    d.handler = rv_insn_handlers[(size_t)d.op];
+    return d;
+}
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <string>
 #include <functional>
 #include "rv_global.hpp"
+#include "rv_snapshot.hpp"
 
 class rv_device
 {
@@ -26,6 +27,11 @@ public:
 
     virtual void reset() = 0;
 
+    // state for rv_machine::snapshot(), with the machine stopped
+    // restore returns false if the data doesn't fit the device
+    virtual void save(rv_snapshot_writer& out) const { (void)out; }
+    virtual bool restore(rv_snapshot_reader& in) { (void)in; return true; }
+
     // memory-mapped io functions (always unsigned)
     // returns false by default, triggering a memory exception
     virtual bool read_u8(uint32_t regNo, uint8_t& value) { (void)value; return false; }
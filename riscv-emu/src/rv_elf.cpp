@@ -0,0 +1,142 @@
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include "rv_elf.hpp"
+
+rv_elf::rv_elf(const std::string& filename)
+{
+    fd_ = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0)
+        throw std::runtime_error("file not found");
+
+    struct stat st;
+    if (fstat(fd_, &st) < 0 || (size_t)st.st_size < sizeof(Elf32_Ehdr)) {
+        close(fd_);
+        throw std::runtime_error("not an ELF file");
+    }
+    size_ = st.st_size;
+    void *image = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (image == MAP_FAILED) {
+        close(fd_);
+        throw std::runtime_error("mmap failed");
+    }
+    image_ = (const uint8_t *)image;
+
+    const auto& ehdr = *(const Elf32_Ehdr *)image_;
+    const bool valid = memcmp(ehdr.e_ident, ELFMAG, SELFMAG) == 0 &&
+                       ehdr.e_ident[EI_CLASS] == ELFCLASS32 && ehdr.e_ident[EI_DATA] == ELFDATA2LSB &&
+                       ehdr.e_type == ET_EXEC && ehdr.e_machine == EM_RISCV &&
+                       ehdr.e_phentsize == sizeof(Elf32_Phdr) &&
+                       at(ehdr.e_phoff, (uint64_t)ehdr.e_phnum * sizeof(Elf32_Phdr)) != nullptr;
+    if (!valid) {
+        munmap((void *)image_, size_);
+        close(fd_);
+        throw std::runtime_error("not a RV32 ELF executable");
+    }
+    entry_ = ehdr.e_entry;
+    read_symbols();
+}
+
+rv_elf::~rv_elf()
+{
+    munmap((void *)image_, size_);
+    close(fd_);
+}
+
+bool rv_elf::is_elf(const std::string& filename)
+{
+    const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    char magic[SELFMAG];
+    const bool elf = read(fd, magic, SELFMAG) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0;
+    close(fd);
+    return elf;
+}
+
+const uint8_t *rv_elf::at(uint64_t offset, uint64_t len) const
+{
+    if (offset > size_ || len > size_ - offset)
+        return nullptr;
+    return image_ + offset;
+}
+
+bool rv_elf::load(rv_memory& memory) const
+{
+    const auto& ehdr = *(const Elf32_Ehdr *)image_;
+    const auto phdrs = (const Elf32_Phdr *)(image_ + ehdr.e_phoff);
+    for (size_t i = 0; i < ehdr.e_phnum; ++i) {
+        const auto& phdr = phdrs[i];
+        if (phdr.p_type != PT_LOAD || phdr.p_memsz == 0)
+            continue;
+        if (phdr.p_filesz > phdr.p_memsz || at(phdr.p_offset, phdr.p_filesz) == nullptr)
+            return false;
+
+        // bss is left to fresh zero pages, only the partial ones are cleared now
+        if (!memory.load_file(phdr.p_paddr, fd_, phdr.p_offset, phdr.p_filesz) ||
+            !memory.clear(phdr.p_paddr + phdr.p_filesz, phdr.p_memsz - phdr.p_filesz))
+            return false;
+    }
+    return true;
+}
+
+void rv_elf::read_symbols()
+{
+    const auto& ehdr = *(const Elf32_Ehdr *)image_;
+    if (ehdr.e_shentsize != sizeof(Elf32_Shdr))
+        return;
+    const auto shdrs = (const Elf32_Shdr *)at(ehdr.e_shoff, (uint64_t)ehdr.e_shnum * sizeof(Elf32_Shdr));
+    if (shdrs == nullptr)
+        return;
+
+    for (size_t i = 0; i < ehdr.e_shnum; ++i) {
+        const auto& symtab = shdrs[i];
+        if (symtab.sh_type != SHT_SYMTAB || symtab.sh_link >= ehdr.e_shnum)
+            continue;
+        const auto& strtab = shdrs[symtab.sh_link];
+        const auto syms = (const Elf32_Sym *)at(symtab.sh_offset, symtab.sh_size);
+        const auto strs = (const char *)at(strtab.sh_offset, strtab.sh_size);
+        if (syms == nullptr || strs == nullptr)
+            continue;
+
+        for (size_t j = 0; j < symtab.sh_size / sizeof(Elf32_Sym); ++j) {
+            const auto& sym = syms[j];
+            const auto type = ELF32_ST_TYPE(sym.st_info);
+            if ((type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE) ||
+                sym.st_shndx == SHN_UNDEF || sym.st_name >= strtab.sh_size)
+                continue;
+            const auto name = strs + sym.st_name;
+            if (*name == '\0')
+                continue;
+            symbols_.push_back({ std::string(name, strnlen(name, strtab.sh_size - sym.st_name)),
+                                 sym.st_value, sym.st_size, (uint8_t)type });
+        }
+    }
+    std::sort(symbols_.begin(), symbols_.end(), [](const auto& a, const auto& b) { return a.value < b.value; });
+}
+
+const rv_elf_symbol *rv_elf::find_symbol(const std::string& name) const
+{
+    for (const auto& sym: symbols_) {
+        if (sym.name == name)
+            return &sym;
+    }
+    return nullptr;
+}
+
+const rv_elf_symbol *rv_elf::symbol_at(rv_uint address) const
+{
+    auto it = std::upper_bound(symbols_.begin(), symbols_.end(), address,
+                               [](rv_uint address, const auto& sym) { return address < sym.value; });
+    if (it == symbols_.begin())
+        return nullptr;
+    --it;
+    if (address - it->value >= std::max<rv_uint>(it->size, 1))
+        return nullptr;
+    return &*it;
+}
\ No newline at end of file
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "rv_global.hpp"
+#include "rv_memory.hpp"
+
+struct rv_elf_symbol
+{
+    std::string name;
+    rv_uint value;
+    rv_uint size;
+    // STT_* from the symbol's st_info
+    uint8_t type;
+};
+
+// RV32 little endian ELF executable
+// the file is mapped read only, headers and symbols are read from there, segments are mapped
+// copy-on-write into RAM where possible so even large images load without copying
+// constructor throws std::runtime_error if the file can't be opened or isn't one of ours
+class rv_elf
+{
+public:
+    rv_elf() = delete;
+    explicit rv_elf(const std::string& filename);
+    ~rv_elf();
+
+    rv_elf(const rv_elf&) = delete;
+    rv_elf& operator=(const rv_elf&) = delete;
+
+    // true if filename starts with the ELF magic
+    static bool is_elf(const std::string& filename);
+
+    rv_uint entry() const { return entry_; }
+
+    // PT_LOAD segments at their physical addresses, memory beyond the file size is zeroed
+    // false if a segment doesn't fit in RAM
+    bool load(rv_memory& memory) const;
+
+    // function and object symbols of the symbol table, sorted by address
+    const std::vector<rv_elf_symbol>& symbols() const { return symbols_; }
+    const rv_elf_symbol *find_symbol(const std::string& name) const;
+    // symbol covering address, nullptr if there's none
+    const rv_elf_symbol *symbol_at(rv_uint address) const;
+
+private:
+    void read_symbols();
+    // pointer to len bytes at offset in the file, nullptr if they are out of it
+    const uint8_t *at(uint64_t offset, uint64_t len) const;
+
+private:
+    int fd_;
+    const uint8_t *image_ = nullptr;
+    size_t size_ = 0;
+    rv_uint entry_ = 0;
+    std::vector<rv_elf_symbol> symbols_;
+};
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include "rv_event_queue.hpp"
+
+size_t rv_event_queue::add(std::function<void()> callback)
+{
+    std::lock_guard<std::mutex> lock{lock_};
+    events_.push_back({RV_EVENT_NEVER, std::move(callback)});
+    return events_.size() - 1;
+}
+
+void rv_event_queue::add_reschedule_handler(std::function<void()> handler)
+{
+    std::lock_guard<std::mutex> lock{lock_};
+    reschedule_handlers_.push_back(std::move(handler));
+}
+
+void rv_event_queue::schedule(size_t event, uint64_t when)
+{
+    std::lock_guard<std::mutex> lock{lock_};
+    const auto prev = next_.load(std::memory_order_relaxed);
+    events_[event].when = when;
+    update_next();
+    if (next_.load(std::memory_order_relaxed) < prev) {
+        for (auto& handler: reschedule_handlers_)
+            handler();
+    }
+}
+
+void rv_event_queue::save(rv_snapshot_writer& out)
+{
+    std::lock_guard<std::mutex> lock{lock_};
+    out.put(now_.load(std::memory_order_relaxed));
+    out.put((uint32_t)events_.size());
+    for (const auto& e: events_)
+        out.put(e.when);
+}
+
+bool rv_event_queue::restore(rv_snapshot_reader& in)
+{
+    std::lock_guard<std::mutex> lock{lock_};
+    uint64_t now;
+    uint32_t count;
+    if (!in.get(now) || !in.get(count) || count != events_.size())
+        return false;
+    for (auto& e: events_)
+        in.get(e.when);
+    now_.store(now, std::memory_order_relaxed);
+    update_next();
+    return in.ok();
+}
+
+void rv_event_queue::update_next()
+{
+    uint64_t next = RV_EVENT_NEVER;
+    for (const auto& e: events_)
+        next = std::min(next, e.when);
+    next_.store(next, std::memory_order_release);
+}
+
+void rv_event_queue::fire(uint64_t now)
+{
+    // a handful of events (one timer per hart), no need for a heap
+    std::vector<std::function<void()>*> due;
+    {
+        std::lock_guard<std::mutex> lock{lock_};
+        for (auto& e: events_) {
+            if (e.when <= now) {
+                e.when = RV_EVENT_NEVER;
+                due.push_back(&e.callback);
+            }
+        }
+        update_next();
+    }
+    for (auto callback: due)
+        (*callback)();
+}
\ No newline at end of file
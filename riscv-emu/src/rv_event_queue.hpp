@@ -0,0 +1,92 @@
+#pragma once
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <limits>
+#include <functional>
+#include <algorithm>
+#include "rv_global.hpp"
+#include "rv_snapshot.hpp"
+
+constexpr uint64_t RV_EVENT_NEVER = std::numeric_limits<uint64_t>::max();
+
+// virtual time of the machine and the device events scheduled on it
+// time is counted in retired instructions, every hart advances it by what it ran, so the
+// harts run in slices ending at the next deadline and events fire exactly when they are due
+// (with several harts the others advance it too, a deadline can be overrun by their progress)
+//
+// events are registered once by the devices and then (re)scheduled at an absolute time,
+// their callbacks run on the thread whose advance made them due, without the queue locked
+// a deadline brought forward is reported to the reschedule handlers, running harts have
+// to end their slice early to meet it
+class rv_event_queue
+{
+public:
+    rv_event_queue() = default;
+
+    rv_event_queue(const rv_event_queue&) = delete;
+    rv_event_queue& operator=(const rv_event_queue&) = delete;
+
+    // returns the event number, the event starts unscheduled
+    size_t add(std::function<void()> callback);
+    void schedule(size_t event, uint64_t when);
+    void cancel(size_t event) { schedule(event, RV_EVENT_NEVER); }
+
+    // every hart registers one, called when the next deadline moves closer
+    void add_reschedule_handler(std::function<void()> handler);
+
+    uint64_t now() const { return now_.load(std::memory_order_relaxed); }
+    // RV_EVENT_NEVER if nothing is scheduled
+    uint64_t next_deadline() const { return next_.load(std::memory_order_acquire); }
+
+    // time and schedule, with nothing running, the events must have been added the same way
+    void save(rv_snapshot_writer& out);
+    bool restore(rv_snapshot_reader& in);
+
+    // instructions that can run before the next deadline, at least 1 and at most limit
+    uint64_t until_next(uint64_t limit) const
+    {
+        const auto now = now_.load(std::memory_order_relaxed);
+        const auto next = next_.load(std::memory_order_acquire);
+        return next <= now ? 1 : std::min(limit, next - now);
+    }
+
+    void advance(uint64_t n)
+    {
+        const auto now = now_.fetch_add(n, std::memory_order_relaxed) + n;
+        if (unlikely(now >= next_.load(std::memory_order_acquire)))
+            fire(now);
+    }
+
+    // nothing is running, jump straight to the next deadline
+    // returns false if there is none
+    bool skip_to_next()
+    {
+        const auto next = next_.load(std::memory_order_acquire);
+        if (next == RV_EVENT_NEVER)
+            return false;
+        const auto now = now_.load(std::memory_order_relaxed);
+        advance(next > now ? next - now : 0);
+        return true;
+    }
+
+private:
+    struct event
+    {
+        uint64_t when;
+        std::function<void()> callback;
+    };
+
+    void fire(uint64_t now);
+    // with lock_ held
+    void update_next();
+
+private:
+    std::atomic<uint64_t> now_{0};
+    std::atomic<uint64_t> next_{RV_EVENT_NEVER};
+
+    std::mutex lock_;
+    std::vector<event> events_;
+    std::vector<std::function<void()>> reschedule_handlers_;
+};
\ No newline at end of file
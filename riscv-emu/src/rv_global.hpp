@@ -14,7 +14,17 @@ using rv_int = int32_t;
 using rv_ulong = uint64_t;
 using rv_long = int64_t;
 
+// privilege levels
+constexpr uint32_t RV_PRIV_U = 0;
+constexpr uint32_t RV_PRIV_S = 1;
+constexpr uint32_t RV_PRIV_M = 3;
+
 constexpr unsigned long long operator ""_MiB(unsigned long long v)
 {
     return v*1024*1024;
+}
+
+constexpr unsigned long long operator ""_GiB(unsigned long long v)
+{
+    return v*1024*1024*1024;
 }
\ No newline at end of file
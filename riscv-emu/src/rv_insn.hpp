@@ -0,0 +1,121 @@
+#pragma once
+#include <cstddef>
+#include "rv_global.hpp"
+
+class rv_cpu;
+struct rv_decoded_insn;
+
+using rv_insn_handler = void (*)(rv_cpu& cpu, const rv_decoded_insn& insn);
+
+// operation flags
+// TRAP: the instruction can raise an exception
+// END: the instruction ends a basic block (control transfer or system instruction)
+constexpr uint32_t RV_OPF_TRAP = 1;
+constexpr uint32_t RV_OPF_END = 2;
+
+// X(name, handler, flags)
+#define RV_INSN_OPS(X) \
+    X(decode, rv_insn_ops::decode, RV_OPF_TRAP | RV_OPF_END) \
+    X(illegal, rv_insn_ops::illegal, RV_OPF_TRAP | RV_OPF_END) \
+    X(nop, rv_insn_ops::nop, 0) \
+    X(lui, rv_insn_ops::lui, 0) \
+    X(auipc, rv_insn_ops::auipc, 0) \
+    X(jal, rv_insn_ops::jal, RV_OPF_TRAP | RV_OPF_END) \
+    X(jalr, rv_insn_ops::jalr, RV_OPF_TRAP | RV_OPF_END) \
+    X(beq, rv_insn_ops::branch<rv_cond_eq>, RV_OPF_TRAP | RV_OPF_END) \
+    X(bne, rv_insn_ops::branch<rv_cond_ne>, RV_OPF_TRAP | RV_OPF_END) \
+    X(blt, rv_insn_ops::branch<rv_cond_lt>, RV_OPF_TRAP | RV_OPF_END) \
+    X(bge, rv_insn_ops::branch<rv_cond_ge>, RV_OPF_TRAP | RV_OPF_END) \
+    X(bltu, rv_insn_ops::branch<rv_cond_ltu>, RV_OPF_TRAP | RV_OPF_END) \
+    X(bgeu, rv_insn_ops::branch<rv_cond_geu>, RV_OPF_TRAP | RV_OPF_END) \
+    X(lb, rv_insn_ops::load<int8_t>, RV_OPF_TRAP) \
+    X(lh, rv_insn_ops::load<int16_t>, RV_OPF_TRAP) \
+    X(lw, rv_insn_ops::load<int32_t>, RV_OPF_TRAP) \
+    X(lbu, rv_insn_ops::load<uint8_t>, RV_OPF_TRAP) \
+    X(lhu, rv_insn_ops::load<uint16_t>, RV_OPF_TRAP) \
+    X(sb, rv_insn_ops::store<uint8_t>, RV_OPF_TRAP) \
+    X(sh, rv_insn_ops::store<uint16_t>, RV_OPF_TRAP) \
+    X(sw, rv_insn_ops::store<uint32_t>, RV_OPF_TRAP) \
+    X(addi, rv_insn_ops::imm<rv_alu_add>, 0) \
+    X(slti, rv_insn_ops::imm<rv_alu_slt>, 0) \
+    X(sltiu, rv_insn_ops::imm<rv_alu_sltu>, 0) \
+    X(xori, rv_insn_ops::imm<rv_alu_xor>, 0) \
+    X(ori, rv_insn_ops::imm<rv_alu_or>, 0) \
+    X(andi, rv_insn_ops::imm<rv_alu_and>, 0) \
+    X(slli, rv_insn_ops::imm<rv_alu_sll>, 0) \
+    X(srli, rv_insn_ops::imm<rv_alu_srl>, 0) \
+    X(srai, rv_insn_ops::imm<rv_alu_sra>, 0) \
+    X(add, rv_insn_ops::op<rv_alu_add>, 0) \
+    X(sub, rv_insn_ops::op<rv_alu_sub>, 0) \
+    X(sll, rv_insn_ops::op<rv_alu_sll>, 0) \
+    X(slt, rv_insn_ops::op<rv_alu_slt>, 0) \
+    X(sltu, rv_insn_ops::op<rv_alu_sltu>, 0) \
+    X(xor_, rv_insn_ops::op<rv_alu_xor>, 0) \
+    X(srl, rv_insn_ops::op<rv_alu_srl>, 0) \
+    X(sra, rv_insn_ops::op<rv_alu_sra>, 0) \
+    X(or_, rv_insn_ops::op<rv_alu_or>, 0) \
+    X(and_, rv_insn_ops::op<rv_alu_and>, 0) \
+    X(mul, rv_insn_ops::op<rv_alu_mul>, 0) \
+    X(mulh, rv_insn_ops::op<rv_alu_mulh>, 0) \
+    X(mulhsu, rv_insn_ops::op<rv_alu_mulhsu>, 0) \
+    X(mulhu, rv_insn_ops::op<rv_alu_mulhu>, 0) \
+    X(div, rv_insn_ops::op<rv_alu_div>, 0) \
+    X(divu, rv_insn_ops::op<rv_alu_divu>, 0) \
+    X(rem, rv_insn_ops::op<rv_alu_rem>, 0) \
+    X(remu, rv_insn_ops::op<rv_alu_remu>, 0) \
+    X(lr_w, rv_insn_ops::lr_w, RV_OPF_TRAP) \
+    X(sc_w, rv_insn_ops::sc_w, RV_OPF_TRAP) \
+    X(amoswap_w, rv_insn_ops::amo<rv_alu_swap>, RV_OPF_TRAP) \
+    X(amoadd_w, rv_insn_ops::amo<rv_alu_add>, RV_OPF_TRAP) \
+    X(amoxor_w, rv_insn_ops::amo<rv_alu_xor>, RV_OPF_TRAP) \
+    X(amoand_w, rv_insn_ops::amo<rv_alu_and>, RV_OPF_TRAP) \
+    X(amoor_w, rv_insn_ops::amo<rv_alu_or>, RV_OPF_TRAP) \
+    X(amomin_w, rv_insn_ops::amo<rv_alu_min>, RV_OPF_TRAP) \
+    X(amomax_w, rv_insn_ops::amo<rv_alu_max>, RV_OPF_TRAP) \
+    X(amominu_w, rv_insn_ops::amo<rv_alu_minu>, RV_OPF_TRAP) \
+    X(amomaxu_w, rv_insn_ops::amo<rv_alu_maxu>, RV_OPF_TRAP) \
+    X(fence, rv_insn_ops::fence, 0) \
+    X(fence_i, rv_insn_ops::fence_i, RV_OPF_END) \
+    X(ecall, rv_insn_ops::ecall, RV_OPF_TRAP | RV_OPF_END) \
+    X(ebreak, rv_insn_ops::ebreak, RV_OPF_TRAP | RV_OPF_END) \
+    X(mret, rv_insn_ops::mret, RV_OPF_TRAP | RV_OPF_END) \
+    X(sret, rv_insn_ops::sret, RV_OPF_TRAP | RV_OPF_END) \
+    X(wfi, rv_insn_ops::wfi, RV_OPF_TRAP | RV_OPF_END) \
+    X(sfence_vma, rv_insn_ops::sfence_vma, RV_OPF_TRAP | RV_OPF_END) \
+    X(csrrw, rv_insn_ops::csrrw, RV_OPF_TRAP | RV_OPF_END) \
+    X(csrrs, rv_insn_ops::csrrs, RV_OPF_TRAP | RV_OPF_END) \
+    X(csrrc, rv_insn_ops::csrrc, RV_OPF_TRAP | RV_OPF_END) \
+    X(csrrwi, rv_insn_ops::csrrwi, RV_OPF_TRAP | RV_OPF_END) \
+    X(csrrsi, rv_insn_ops::csrrsi, RV_OPF_TRAP | RV_OPF_END) \
+    X(csrrci, rv_insn_ops::csrrci, RV_OPF_TRAP | RV_OPF_END)
+
+enum class rv_op: uint8_t
+{
+#define RV_INSN_OP_ENUM(name, handler, flags) name,
+    RV_INSN_OPS(RV_INSN_OP_ENUM)
+#undef RV_INSN_OP_ENUM
+    count
+};
+
+// an instruction decoded once and executed many times
+// register indices are already extracted and immediates are sign-extended,
+// for csr instructions imm holds the csr number
+struct rv_decoded_insn
+{
+    rv_insn_handler handler;
+    rv_op op;
+    uint8_t rd;
+    uint8_t rs1;
+    uint8_t rs2;
+    rv_int imm;
+};
+
+inline uint32_t rv_op_flags(rv_op op)
+{
+#define RV_INSN_OP_FLAGS(name, handler, flags) flags,
+    static constexpr uint32_t op_flags[] = { RV_INSN_OPS(RV_INSN_OP_FLAGS) };
+#undef RV_INSN_OP_FLAGS
+    return op_flags[(size_t)op];
+}
+
+rv_decoded_insn rv_decode(uint32_t insn);
\ No newline at end of file
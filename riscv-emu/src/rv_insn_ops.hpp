@@ -0,0 +1,364 @@
+#pragma once
+#include <atomic>
+#include <type_traits>
+#include "rv_cpu.hpp"
+#include "rv_insn.hpp"
+
+// alu operations, shared by register-register, register-immediate and atomic instructions
+struct rv_alu_add { rv_uint operator()(rv_uint a, rv_uint b) const { return a + b; } };
+struct rv_alu_sub { rv_uint operator()(rv_uint a, rv_uint b) const { return a - b; } };
+struct rv_alu_sll { rv_uint operator()(rv_uint a, rv_uint b) const { return a << (b & 0x1F); } };
+struct rv_alu_srl { rv_uint operator()(rv_uint a, rv_uint b) const { return a >> (b & 0x1F); } };
+struct rv_alu_sra { rv_uint operator()(rv_uint a, rv_uint b) const { return (rv_uint)((rv_int)a >> (b & 0x1F)); } };
+struct rv_alu_slt { rv_uint operator()(rv_uint a, rv_uint b) const { return (rv_int)a < (rv_int)b ? 1 : 0; } };
+struct rv_alu_sltu { rv_uint operator()(rv_uint a, rv_uint b) const { return a < b ? 1 : 0; } };
+struct rv_alu_xor { rv_uint operator()(rv_uint a, rv_uint b) const { return a ^ b; } };
+struct rv_alu_or { rv_uint operator()(rv_uint a, rv_uint b) const { return a | b; } };
+struct rv_alu_and { rv_uint operator()(rv_uint a, rv_uint b) const { return a & b; } };
+
+struct rv_alu_mul { rv_uint operator()(rv_uint a, rv_uint b) const { return (rv_uint)((rv_long)(rv_int)a * (rv_long)(rv_int)b); } };
+struct rv_alu_mulh { rv_uint operator()(rv_uint a, rv_uint b) const { return (rv_uint)(((rv_long)(rv_int)a * (rv_long)(rv_int)b) >> 32); } };
+struct rv_alu_mulhsu { rv_uint operator()(rv_uint a, rv_uint b) const { return (rv_uint)(((rv_long)(rv_int)a * (rv_long)b) >> 32); } };
+struct rv_alu_mulhu { rv_uint operator()(rv_uint a, rv_uint b) const { return (rv_uint)(((rv_ulong)a * (rv_ulong)b) >> 32); } };
+
+struct rv_alu_div
+{
+    rv_uint operator()(rv_uint a, rv_uint b) const
+    {
+        if (b == 0)
+            return (rv_uint)-1;
+        if (a == 0x80000000 && b == (rv_uint)-1)
+            return a;
+        return (rv_uint)((rv_int)a / (rv_int)b);
+    }
+};
+
+struct rv_alu_divu
+{
+    rv_uint operator()(rv_uint a, rv_uint b) const { return b == 0 ? (rv_uint)-1 : a / b; }
+};
+
+struct rv_alu_rem
+{
+    rv_uint operator()(rv_uint a, rv_uint b) const
+    {
+        if (b == 0)
+            return a;
+        if (a == 0x80000000 && b == (rv_uint)-1)
+            return 0;
+        return (rv_uint)((rv_int)a % (rv_int)b);
+    }
+};
+
+struct rv_alu_remu
+{
+    rv_uint operator()(rv_uint a, rv_uint b) const { return b == 0 ? a : a % b; }
+};
+
+struct rv_alu_swap { rv_uint operator()(rv_uint a, rv_uint b) const { return b; } };
+struct rv_alu_min { rv_uint operator()(rv_uint a, rv_uint b) const { return (rv_int)a < (rv_int)b ? a : b; } };
+struct rv_alu_max { rv_uint operator()(rv_uint a, rv_uint b) const { return (rv_int)a > (rv_int)b ? a : b; } };
+struct rv_alu_minu { rv_uint operator()(rv_uint a, rv_uint b) const { return a < b ? a : b; } };
+struct rv_alu_maxu { rv_uint operator()(rv_uint a, rv_uint b) const { return a > b ? a : b; } };
+
+// branch conditions
+struct rv_cond_eq { bool operator()(rv_uint a, rv_uint b) const { return a == b; } };
+struct rv_cond_ne { bool operator()(rv_uint a, rv_uint b) const { return a != b; } };
+struct rv_cond_lt { bool operator()(rv_uint a, rv_uint b) const { return (rv_int)a < (rv_int)b; } };
+struct rv_cond_ge { bool operator()(rv_uint a, rv_uint b) const { return (rv_int)a >= (rv_int)b; } };
+struct rv_cond_ltu { bool operator()(rv_uint a, rv_uint b) const { return a < b; } };
+struct rv_cond_geu { bool operator()(rv_uint a, rv_uint b) const { return a >= b; } };
+
+// instruction semantics, operating on already decoded instructions
+// every handler is responsible for updating pc (or raising an exception)
+struct rv_insn_ops
+{
+    static void decode(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        cpu.decode_insn();
+    }
+
+    static void illegal(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        cpu.raise_illegal_instruction();
+    }
+
+    static void nop(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        cpu.next_insn();
+    }
+
+    static void lui(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        cpu.regs_[insn.rd] = insn.imm;
+        cpu.next_insn();
+    }
+
+    static void auipc(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        cpu.regs_[insn.rd] = cpu.pc_ + insn.imm;
+        cpu.next_insn();
+    }
+
+    static void jal(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        const rv_uint target = cpu.pc_ + insn.imm;
+        if (insn.rd != 0)
+            cpu.regs_[insn.rd] = cpu.pc_ + 4;
+        cpu.jump_insn(target);
+    }
+
+    static void jalr(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        // target must be computed before writing rd, rd and rs1 may be the same register
+        const rv_uint target = (cpu.regs_[insn.rs1] + insn.imm) & 0xFFFFFFFE;
+        if (insn.rd != 0)
+            cpu.regs_[insn.rd] = cpu.pc_ + 4;
+        cpu.jump_insn(target);
+    }
+
+    template<typename Cond>
+    static void branch(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        if (Cond{}(cpu.regs_[insn.rs1], cpu.regs_[insn.rs2]))
+            cpu.jump_insn(cpu.pc_ + insn.imm);
+        else
+            cpu.next_insn();
+    }
+
+    template<typename T>
+    static void load(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        const auto rd = insn.rd;
+        T val;
+        if (!cpu.mmu_.read(cpu.regs_[insn.rs1] + insn.imm, val)) {
+            cpu.raise_memory_exception();
+            return;
+        }
+        // signed types are sign-extended by the conversion
+        if (likely(rd != 0))
+            cpu.regs_[rd] = static_cast<rv_uint>(val);
+        cpu.next_insn();
+    }
+
+    template<typename T>
+    static void store(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        if (!cpu.mmu_.write(cpu.regs_[insn.rs1] + insn.imm, static_cast<T>(cpu.regs_[insn.rs2]))) {
+            cpu.raise_memory_exception();
+            return;
+        }
+        cpu.next_insn();
+    }
+
+    // register-immediate and register-register operations
+    // rd is never x0 here, writes to x0 are decoded as nops
+    template<typename Op>
+    static void imm(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        cpu.regs_[insn.rd] = Op{}(cpu.regs_[insn.rs1], (rv_uint)insn.imm);
+        cpu.next_insn();
+    }
+
+    template<typename Op>
+    static void op(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        cpu.regs_[insn.rd] = Op{}(cpu.regs_[insn.rs1], cpu.regs_[insn.rs2]);
+        cpu.next_insn();
+    }
+
+    // atomics are word aligned, the host performs them on RAM, devices and code pages
+    // (where the write must be seen by the decode caches) are accessed in two steps
+    static bool atomic_address(rv_cpu& cpu, rv_uint addr, rv_uint*& host)
+    {
+        if (unlikely((addr & 3) != 0)) {
+            cpu.raise_exception(rv_exception::store_address_misaligned, addr);
+            return false;
+        }
+        if (unlikely(!cpu.mmu_.atomic_address(addr, host))) {
+            cpu.raise_memory_exception();
+            return false;
+        }
+        return true;
+    }
+
+    static void lr_w(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        const auto rd = insn.rd;
+        const auto addr = cpu.regs_[insn.rs1];
+        rv_uint val;
+        if (unlikely((addr & 3) != 0)) {
+            cpu.raise_exception(rv_exception::load_address_misaligned, addr);
+            return;
+        }
+        if (!cpu.mmu_.read(addr, val)) {
+            cpu.raise_memory_exception();
+            return;
+        }
+        cpu.amo_reserved_ = true;
+        cpu.amo_res_ = addr;
+        cpu.amo_res_value_ = val;
+        if (rd != 0)
+            cpu.regs_[rd] = val;
+        cpu.next_insn();
+    }
+
+    static void sc_w(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        const auto rd = insn.rd;
+        const auto addr = cpu.regs_[insn.rs1];
+        rv_uint res = 1;
+        if (cpu.amo_reserved_ && cpu.amo_res_ == addr) {
+            rv_uint *host;
+            if (!atomic_address(cpu, addr, host))
+                return;
+
+            // other harts may have stored in between, but only a changed value is noticed
+            rv_uint expected = cpu.amo_res_value_;
+            if (likely(host != nullptr)) {
+                if (__atomic_compare_exchange_n(host, &expected, cpu.regs_[insn.rs2], false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+                    res = 0;
+            }
+            else {
+                rv_uint val;
+                if (!cpu.mmu_.read(addr, val)) {
+                    cpu.raise_memory_exception();
+                    return;
+                }
+                if (val == expected) {
+                    if (!cpu.mmu_.write(addr, cpu.regs_[insn.rs2])) {
+                        cpu.raise_memory_exception();
+                        return;
+                    }
+                    res = 0;
+                }
+            }
+        }
+        cpu.amo_reserved_ = false;
+        if (rd != 0)
+            cpu.regs_[rd] = res;
+        cpu.next_insn();
+    }
+
+    // returns the previous value of *host
+    template<typename Op>
+    static rv_uint atomic_op(rv_uint *host, rv_uint val)
+    {
+        if constexpr (std::is_same_v<Op, rv_alu_swap>)
+            return __atomic_exchange_n(host, val, __ATOMIC_SEQ_CST);
+        if constexpr (std::is_same_v<Op, rv_alu_add>)
+            return __atomic_fetch_add(host, val, __ATOMIC_SEQ_CST);
+        if constexpr (std::is_same_v<Op, rv_alu_xor>)
+            return __atomic_fetch_xor(host, val, __ATOMIC_SEQ_CST);
+        if constexpr (std::is_same_v<Op, rv_alu_and>)
+            return __atomic_fetch_and(host, val, __ATOMIC_SEQ_CST);
+        if constexpr (std::is_same_v<Op, rv_alu_or>)
+            return __atomic_fetch_or(host, val, __ATOMIC_SEQ_CST);
+
+        // min/max
+        rv_uint old = __atomic_load_n(host, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(host, &old, Op{}(old, val), false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            ;
+        return old;
+    }
+
+    template<typename Op>
+    static void amo(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        const auto rd = insn.rd;
+        const auto addr = cpu.regs_[insn.rs1];
+        rv_uint *host;
+        if (!atomic_address(cpu, addr, host))
+            return;
+
+        rv_uint val;
+        if (likely(host != nullptr)) {
+            val = atomic_op<Op>(host, cpu.regs_[insn.rs2]);
+        }
+        else {
+            if (!cpu.mmu_.read(addr, val)) {
+                cpu.raise_memory_exception();
+                return;
+            }
+            if (!cpu.mmu_.write(addr, Op{}(val, cpu.regs_[insn.rs2]))) {
+                cpu.raise_memory_exception();
+                return;
+            }
+        }
+        if (rd != 0)
+            cpu.regs_[rd] = val;
+        cpu.next_insn();
+    }
+
+    // only a store followed by a load can be reordered by the host, other orderings come for free
+    static void fence(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        constexpr rv_int pred_writes = 0x50;  // PO | PW
+        constexpr rv_int succ_reads = 0x0A;   // SI | SR
+        if ((insn.imm & pred_writes) != 0 && (insn.imm & succ_reads) != 0)
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        cpu.next_insn();
+    }
+
+    static void fence_i(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        cpu.execute_fence_i();
+        cpu.next_insn();
+    }
+
+    static void ecall(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        cpu.raise_exception(static_cast<rv_exception>(
+                                static_cast<uint32_t>(rv_exception::ecall_from_umode) +
+                                static_cast<uint32_t>(cpu.priv_))
+        );
+    }
+
+    static void ebreak(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        cpu.raise_exception(rv_exception::breakpoint, cpu.pc_);
+    }
+
+    static void mret(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        if (cpu.priv_ < RV_PRIV_M) {
+            cpu.raise_illegal_instruction();
+            return;
+        }
+        cpu.execute_mret();
+    }
+
+    static void sret(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        cpu.execute_sret();
+    }
+
+    static void wfi(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        cpu.execute_wfi();
+    }
+
+    static void sfence_vma(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        if (!cpu.execute_sfence_vma(insn.rs1))
+            return;
+        cpu.next_insn();
+    }
+
+    // csrrw/csrrs/csrrc, the immediate forms pass rs1 as the value
+    template<uint32_t csrop, bool immediate>
+    static void csr(rv_cpu& cpu, const rv_decoded_insn& insn)
+    {
+        const rv_uint val = immediate ? insn.rs1 : cpu.regs_[insn.rs1];
+        if (!cpu.csr_rw(insn.imm, insn.rd, val, csrop))
+            return;
+        cpu.next_insn();
+    }
+
+    static void csrrw(rv_cpu& cpu, const rv_decoded_insn& insn) { csr<1, false>(cpu, insn); }
+    static void csrrs(rv_cpu& cpu, const rv_decoded_insn& insn) { csr<2, false>(cpu, insn); }
+    static void csrrc(rv_cpu& cpu, const rv_decoded_insn& insn) { csr<3, false>(cpu, insn); }
+    static void csrrwi(rv_cpu& cpu, const rv_decoded_insn& insn) { csr<1, true>(cpu, insn); }
+    static void csrrsi(rv_cpu& cpu, const rv_decoded_insn& insn) { csr<2, true>(cpu, insn); }
+    static void csrrci(rv_cpu& cpu, const rv_decoded_insn& insn) { csr<3, true>(cpu, insn); }
+};
\ No newline at end of file
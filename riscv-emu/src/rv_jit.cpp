@@ -0,0 +1,954 @@
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <cstddef>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <memory>
+#include <condition_variable>
+#include <pthread.h>
+#include "rv_jit.hpp"
+#include "rv_cpu.hpp"
+#include "rv_x64_emitter.hpp"
+
+constexpr uint64_t RV_JIT_FAULT = 1ULL << 63;
+
+thread_local rv_jit *rv_jit::t_entered = nullptr;
+
+template<typename T>
+uint64_t rv_jit::load(rv_cpu *cpu, rv_uint address)
+{
+    T val;
+    if (unlikely(!cpu->mmu_.read(address, val))) {
+        cpu->raise_memory_exception();
+        return RV_JIT_FAULT;
+    }
+    // signed types are sign-extended by the conversion
+    return static_cast<rv_uint>(val);
+}
+
+template<typename T>
+bool rv_jit::store(rv_cpu *cpu, rv_uint address, rv_uint value)
+{
+    if (unlikely(!cpu->mmu_.write(address, static_cast<T>(value)))) {
+        cpu->raise_memory_exception();
+        return false;
+    }
+    return true;
+}
+
+// traces call them too
+template uint64_t rv_jit::load<int8_t>(rv_cpu *cpu, rv_uint address);
+template uint64_t rv_jit::load<int16_t>(rv_cpu *cpu, rv_uint address);
+template uint64_t rv_jit::load<int32_t>(rv_cpu *cpu, rv_uint address);
+template uint64_t rv_jit::load<uint8_t>(rv_cpu *cpu, rv_uint address);
+template uint64_t rv_jit::load<uint16_t>(rv_cpu *cpu, rv_uint address);
+template bool rv_jit::store<uint8_t>(rv_cpu *cpu, rv_uint address, rv_uint value);
+template bool rv_jit::store<uint16_t>(rv_cpu *cpu, rv_uint address, rv_uint value);
+template bool rv_jit::store<uint32_t>(rv_cpu *cpu, rv_uint address, rv_uint value);
+
+static int32_t member_offset(const rv_cpu& cpu, const void *member)
+{
+    return (int32_t)((const uint8_t *)member - (const uint8_t *)&cpu);
+}
+
+rv_jit::rv_jit(rv_cpu& cpu)
+    : cpu_{cpu}, guest_base_{cpu.memory_.guest_base()}
+{
+    regs_offset_ = member_offset(cpu, &cpu.regs_[0]);
+    pc_offset_ = member_offset(cpu, &cpu.pc_);
+    budget_offset_ = member_offset(cpu, &cpu.jit_budget_);
+    exception_offset_ = member_offset(cpu, &cpu.exception_raised_);
+    exit_block_offset_ = member_offset(cpu, &cpu.jit_exit_block_);
+    exit_request_offset_ = member_offset(cpu, &cpu.exit_request_);
+    ras_offset_ = member_offset(cpu, &cpu.blocks_.ras_[0]);
+    ras_top_offset_ = member_offset(cpu, &cpu.blocks_.ras_top_);
+    tlb_load_offset_ = member_offset(cpu, &cpu.mmu_.tlb_[(size_t)rv_access::load]);
+    tlb_store_offset_ = member_offset(cpu, &cpu.mmu_.tlb_[(size_t)rv_access::store]);
+
+    const rv_block probe{};
+    block_native_offset_ = (int32_t)((const uint8_t *)&probe.native - (const uint8_t *)&probe);
+    block_return_pc_offset_ = (int32_t)((const uint8_t *)&probe.exit_pc[1] - (const uint8_t *)&probe);
+    block_return_offset_ = (int32_t)((const uint8_t *)&probe.exit[1] - (const uint8_t *)&probe);
+    block_exit_offset_ = (int32_t)((const uint8_t *)&probe.exit[0] - (const uint8_t *)&probe);
+
+#if defined(__x86_64__)
+    set_code_cache_size(RV_JIT_CODE_CACHE_SIZE);
+    if (code_ != nullptr && guest_base_ != nullptr)
+        install_fault_handler();
+#else
+    guest_base_ = nullptr;
+#endif
+}
+
+rv_jit::~rv_jit()
+{
+    drain(true);
+    if (code_ != nullptr)
+        munmap(code_, size_);
+}
+
+void rv_jit::set_code_cache_size(size_t size)
+{
+    if (size != 0)
+        size = (std::max(size, RV_JIT_CODE_CACHE_MIN) + RV_MEMORY_PAGE_MASK) & ~(size_t)RV_MEMORY_PAGE_MASK;
+    if (size == size_)
+        return;
+
+    if (code_ != nullptr) {
+        drain(true);
+        cpu_.blocks_.drop_native();
+        guard_table_.clear();
+        munmap(code_, size_);
+        code_ = nullptr;
+        size_ = 0;
+    }
+#if defined(__x86_64__)
+    if (size == 0)
+        return;
+    // committed as it fills up, machines running little code stay small
+    void *code = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (code != MAP_FAILED) {
+        code_ = (uint8_t *)code;
+        size_ = size;
+        flush();
+    }
+#endif
+}
+
+x64_mem rv_jit::reg(uint32_t r) const { return x64_mem{RV_JIT_CPU, regs_offset_ + (int32_t)(r * sizeof(rv_uint))}; }
+x64_mem rv_jit::pc() const { return x64_mem{RV_JIT_CPU, pc_offset_}; }
+x64_mem rv_jit::budget() const { return x64_mem{RV_JIT_CPU, budget_offset_}; }
+x64_mem rv_jit::exception_raised() const { return x64_mem{RV_JIT_CPU, exception_offset_}; }
+x64_mem rv_jit::exit_block() const { return x64_mem{RV_JIT_CPU, exit_block_offset_}; }
+x64_mem rv_jit::exit_request() const { return x64_mem{RV_JIT_CPU, exit_request_offset_}; }
+x64_mem rv_jit::ras_top() const { return x64_mem{RV_JIT_CPU, ras_top_offset_}; }
+
+static struct sigaction previous_segv;
+
+void rv_jit::install_fault_handler()
+{
+    static std::once_flag installed;
+    std::call_once(installed, []() {
+        struct sigaction action{};
+        action.sa_sigaction = &rv_jit::guard_fault;
+        action.sa_flags = SA_SIGINFO | SA_NODEFER;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGSEGV, &action, &previous_segv);
+    });
+}
+
+void rv_jit::guard_fault(int sig, siginfo_t *info, void *context)
+{
+#if defined(__x86_64__)
+    // a direct access from the native code this thread is running, retry it through the helper
+    auto uc = (ucontext_t *)context;
+    rv_jit *jit = t_entered;
+    if (jit != nullptr) {
+        const auto recover = jit->recovery((const uint8_t *)uc->uc_mcontext.gregs[REG_RIP], (const uint8_t *)info->si_addr);
+        if (recover != nullptr) {
+            uc->uc_mcontext.gregs[REG_RIP] = (greg_t)recover;
+            return;
+        }
+    }
+#endif
+    // a real crash, faults again with whatever handled it before
+    sigaction(sig, &previous_segv, nullptr);
+}
+
+const uint8_t *rv_jit::recovery(const uint8_t *at, const uint8_t *address)
+{
+    if (at < code_ || at >= code_ + size_)
+        return nullptr;
+    const auto offset = (uint32_t)(at - code_);
+    const auto site = std::lower_bound(guard_table_.begin(), guard_table_.end(), offset,
+                                       [](const guard_site& site, uint32_t at) { return site.at < at; });
+    if (site == guard_table_.end() || site->at != offset)
+        return nullptr;
+    // clean pages (rv_memory::set_baseline) fault once and turn writable, every store sweeping
+    // fresh pages after a reset would end up on the helper otherwise
+    const auto guest = (uintptr_t)address - (uintptr_t)guest_base_;
+    if (guest < RV_MEMORY_GUEST_SPACE && cpu_.memory_.is_clean_page((rv_uint)guest))
+        return code_ + site->recover;
+    // only this thread runs this code, it sees the jump once the handler returns
+    if (++site->faults == RV_JIT_GUARD_FAULTS)
+        x64_patch_jmp8(code_ + site->at, code_ + site->recover);
+    return code_ + site->recover;
+}
+
+void rv_jit::flush()
+{
+    // nothing may point into the code cache anymore, nor be written there
+    drain(true);
+    cpu_.blocks_.drop_native();
+    guard_table_.clear();
+    if (code_ == nullptr)
+        return;
+
+    x64_emitter e{code_, size_};
+    emit_entry(e);
+    used_ = (e.size() + 15) & ~15;
+}
+
+// never destroyed, the thread may still wait on it while the process exits
+struct rv_jit::compiler
+{
+    std::mutex lock;
+    // jobs were queued
+    std::condition_variable wake;
+    // the thread finished a job
+    std::condition_variable done;
+    // a block, or the trace it heads
+    struct job
+    {
+        rv_jit *jit;
+        rv_block *block;
+        trace_job *trace;
+    };
+    std::deque<job> jobs;
+    // jit whose block the thread is compiling
+    rv_jit *busy = nullptr;
+    // threads don't survive fork(), the child starts its own
+    bool running = false;
+};
+
+rv_jit::compiler& rv_jit::shared_compiler()
+{
+    static compiler *shared;
+    static std::once_flag created;
+    std::call_once(created, []() {
+        shared = new compiler;
+        // the thread must not be in the middle of a job while forking, the child gets fresh
+        // locks and condition variables (the ones it inherits may be held or waited on
+        // by a thread it doesn't have), the blocks still queued queue again
+        pthread_atfork(
+            []() {
+                std::unique_lock<std::mutex> lock{shared->lock};
+                shared->done.wait(lock, []() { return shared->busy == nullptr; });
+                lock.release();
+            },
+            []() { shared->lock.unlock(); },
+            []() {
+                for (const auto& job: shared->jobs) {
+                    if (job.trace != nullptr)
+                        job.trace->queued = false;
+                    else
+                        job.block->queued = false;
+                }
+                shared = new compiler;
+            });
+    });
+    return *shared;
+}
+
+void rv_jit::compile_loop()
+{
+    auto& c = shared_compiler();
+    std::unique_lock<std::mutex> lock{c.lock};
+    for (;;) {
+        c.wake.wait(lock, [&c]() { return !c.jobs.empty(); });
+        const auto job = c.jobs.front();
+        c.jobs.pop_front();
+        c.busy = job.jit;
+        lock.unlock();
+
+        auto code = std::make_unique<rv_jit_code>();
+        if (job.trace != nullptr)
+            job.jit->emit_trace(*job.trace, *code);
+        else
+            job.jit->emit(*job.block, *code);
+        // the hart may run the code as soon as it sees it, it was never executed before
+        // so there's no stale copy of it to serialize against
+        job.block->compiled.store(code.release(), std::memory_order_release);
+
+        lock.lock();
+        c.busy = nullptr;
+        c.done.notify_all();
+    }
+}
+
+void rv_jit::queue(rv_block& block)
+{
+    auto& c = shared_compiler();
+    std::lock_guard<std::mutex> lock{c.lock};
+    c.jobs.push_back({this, &block, nullptr});
+    block.queued = true;
+    if (!c.running) {
+        c.running = true;
+        std::thread(&rv_jit::compile_loop).detach();
+    }
+    c.wake.notify_one();
+}
+
+void rv_jit::queue(trace_job& trace)
+{
+    auto& c = shared_compiler();
+    std::lock_guard<std::mutex> lock{c.lock};
+    c.jobs.push_back({this, trace.blocks[0], &trace});
+    trace.queued = true;
+    if (!c.running) {
+        c.running = true;
+        std::thread(&rv_jit::compile_loop).detach();
+    }
+    c.wake.notify_one();
+}
+
+void rv_jit::drain(bool all)
+{
+    if (!compile_thread_)
+        return;
+    auto& c = shared_compiler();
+    auto dead = [](const trace_job& trace) {
+        return std::any_of(trace.blocks.begin(), trace.blocks.end(), [](const rv_block *block) { return block->dead; });
+    };
+    std::unique_lock<std::mutex> lock{c.lock};
+    auto last = std::remove_if(c.jobs.begin(), c.jobs.end(), [this, all, &dead](const compiler::job& job) {
+        if (job.jit != this)
+            return false;
+        if (job.trace != nullptr)
+            return all || dead(*job.trace);
+        if (!(all || job.block->dead))
+            return false;
+        job.block->queued = false;
+        return true;
+    });
+    c.jobs.erase(last, c.jobs.end());
+    c.done.wait(lock, [this, &c]() { return c.busy != this; });
+    lock.unlock();
+
+    // the thread is done with these, along with any code it finished for them
+    auto gone = std::remove_if(traces_.begin(), traces_.end(), [all, &dead](const std::unique_ptr<trace_job>& trace) {
+        if (!(all || dead(*trace)))
+            return false;
+        delete trace->blocks[0]->compiled.exchange(nullptr, std::memory_order_acquire);
+        return true;
+    });
+    traces_.erase(gone, traces_.end());
+}
+
+void rv_jit::set_compile_thread(bool enabled)
+{
+    // with a single CPU the thread only takes time slices away from the harts
+    enabled &= std::thread::hardware_concurrency() > 1;
+    if (enabled == compile_thread_)
+        return;
+    flush();
+    compile_thread_ = enabled;
+}
+
+bool rv_jit::compile(rv_block& block)
+{
+    if (code_ == nullptr)
+        return false;
+
+    if (compile_thread_) {
+        std::unique_ptr<rv_jit_code> code{block.compiled.load(std::memory_order_acquire)};
+        if (code == nullptr) {
+            if (!block.queued)
+                queue(block);
+            return false;
+        }
+        // the thread is done with the block
+        block.compiled.store(nullptr, std::memory_order_relaxed);
+        block.queued = false;
+        return install(block, *code);
+    }
+
+    rv_jit_code code;
+    emit(block, code);
+    if (code.code == nullptr) {
+        // out of space, throw away everything and start over
+        flush();
+        emit(block, code);
+    }
+    return install(block, code);
+}
+
+void rv_jit::emit(rv_block& block, rv_jit_code& code)
+{
+    x64_emitter e{code_ + used_, size_ - used_};
+    emit_block(e, block);
+    if (e.overflow())
+        return;
+
+    code.code = e.code();
+    code.direct = direct_;
+    code.exit = native_exit_;
+    code.ic = native_ic_;
+    code.ic_jump = native_ic_jump_;
+    for (const auto& site: guard_sites_)
+        code.guard_sites.emplace_back((uint32_t)used_ + site.first, (uint32_t)used_ + site.second);
+    used_ = (used_ + e.size() + 15) & ~15;
+}
+
+bool rv_jit::install(rv_block& block, const rv_jit_code& code)
+{
+    if (code.code == nullptr) {
+        // the code cache filled up, compiled again once it gets hot again
+        flush();
+        return false;
+    }
+
+    add_guard_sites(code.guard_sites);
+    block.native = code.code;
+    block.direct = code.direct;
+    block.native_exit = code.exit;
+    block.native_ic = code.ic;
+    block.native_ic_jump = code.ic_jump;
+
+    // exits go back to the dispatcher until chained to successors compiled already
+    for (size_t slot = 0; slot < block.exit.size(); ++slot) {
+        const rv_block *to = block.exit[slot];
+        if (block.native_exit[slot] != nullptr && to != nullptr && to->native != nullptr)
+            x64_patch_rel32(block.native_exit[slot], to->native);
+    }
+    if (block.native_ic != nullptr && block.ic != nullptr && block.ic->native != nullptr) {
+        x64_patch_imm32(block.native_ic, block.ic->pc);
+        x64_patch_rel32(block.native_ic_jump, block.ic->native);
+    }
+    cpu_.blocks_.link_native(block);
+    return true;
+}
+
+void rv_jit::add_guard_sites(const std::vector<std::pair<uint32_t, uint32_t>>& sites)
+{
+    // blocks are installed in any order, but each one's code is in one piece
+    if (sites.empty())
+        return;
+    const auto at = std::lower_bound(guard_table_.begin(), guard_table_.end(), sites[0].first,
+                                     [](const guard_site& site, uint32_t at) { return site.at < at; });
+    std::vector<guard_site> entries;
+    for (const auto& site: sites)
+        entries.push_back({site.first, site.second, 0});
+    guard_table_.insert(at, entries.begin(), entries.end());
+}
+
+void rv_jit::emit_entry(x64_emitter& e)
+{
+    static const x64_reg saved[] = { x64_reg::rbp, x64_reg::rbx, x64_reg::r12, x64_reg::r13, x64_reg::r14, x64_reg::r15 };
+
+    entry_ = (entry_fn)e.cur();
+    for (auto r: saved)
+        e.push(r);
+    // keep the stack 16 byte aligned for helper calls
+    e.alu64(x64_alu::sub, x64_reg::rsp, 8);
+    e.mov64(RV_JIT_CPU, x64_reg::rdi);
+    if (guest_base_ != nullptr)
+        e.mov64(RV_JIT_GUEST_BASE, (uint64_t)guest_base_);
+    e.jmp(x64_reg::rsi);
+
+    epilogue_ = e.cur();
+    e.alu64(x64_alu::add, x64_reg::rsp, 8);
+    for (int i = 5; i >= 0; --i)
+        e.pop(saved[i]);
+    e.ret();
+}
+
+// static exit, a jump to the exit to the dispatcher install() chains once the successor is compiled
+void rv_jit::emit_exit(x64_emitter& e, rv_block& block, rv_uint target)
+{
+    const size_t slot = target == block.exit_pc[0] ? 0 : 1;
+
+    if (rv_block_cache::can_link(block, target)) {
+        const auto at = e.jmp();
+        e.bind(at);
+        native_exit_[slot] = e.code() + at;
+    }
+
+    e.mov(pc(), target);
+    e.mov64(x64_reg::rax, (uint64_t)&block);
+    e.mov64(exit_block(), x64_reg::rax);
+    e.jmp(epilogue_);
+}
+
+// jalr, target in eax
+void rv_jit::emit_indirect_exit(x64_emitter& e, rv_block& block)
+{
+    // paged blocks always go back to the dispatcher to translate the target
+    if (block.paged) {
+        e.mov(pc(), x64_reg::rax);
+        e.mov64(x64_reg::rax, (uint64_t)&block);
+        e.mov64(exit_block(), x64_reg::rax);
+        e.jmp(epilogue_);
+        return;
+    }
+
+    // the inline cache misses until install() fills it in
+    const auto ic = e.cmp_imm32(x64_reg::rax, RV_BLOCK_NO_EXIT);
+    const auto miss = e.jcc(x64_cond::ne);
+    const auto jump = e.jmp();
+    native_ic_ = e.code() + ic;
+    native_ic_jump_ = e.code() + jump;
+
+    e.bind(miss);
+    e.bind(jump);
+    e.mov(pc(), x64_reg::rax);
+    e.mov64(x64_reg::rax, (uint64_t)&block);
+    e.mov64(exit_block(), x64_reg::rax);
+    e.jmp(epilogue_);
+}
+
+void rv_jit::emit_ras_push(x64_emitter& e, rv_block& block)
+{
+    e.mov(x64_reg::rcx, ras_top());
+    e.alu(x64_alu::add, x64_reg::rcx, 1);
+    e.alu(x64_alu::and_, x64_reg::rcx, RV_BLOCK_RAS_ENTRIES - 1);
+    e.mov(ras_top(), x64_reg::rcx);
+    e.mov64(x64_reg::rdx, (uint64_t)&block);
+    e.mov64(x64_mem{RV_JIT_CPU, ras_offset_, x64_reg::rcx, 3}, x64_reg::rdx);
+}
+
+// return through the caller's fall through link, target in eax
+// a caller that isn't linked or compiled yet exits as if the caller itself had jumped there
+void rv_jit::emit_ras_pop(x64_emitter& e)
+{
+    const auto rax = x64_reg::rax;
+    const auto rcx = x64_reg::rcx;
+    const auto rdx = x64_reg::rdx;
+
+    e.mov(rcx, ras_top());
+    e.mov64(rdx, x64_mem{RV_JIT_CPU, ras_offset_, rcx, 3});
+    e.alu(x64_alu::sub, rcx, 1);
+    e.alu(x64_alu::and_, rcx, RV_BLOCK_RAS_ENTRIES - 1);
+    e.mov(ras_top(), rcx);
+
+    e.test64(rdx, rdx);
+    const auto empty = e.jcc(x64_cond::e);
+    e.alu(x64_alu::cmp, rax, x64_mem{rdx, block_return_pc_offset_});
+    const auto mispredicted = e.jcc(x64_cond::ne);
+    e.mov64(rcx, x64_mem{rdx, block_return_offset_});
+    e.test64(rcx, rcx);
+    const auto unlinked = e.jcc(x64_cond::e);
+    e.mov64(rcx, x64_mem{rcx, block_native_offset_});
+    e.test64(rcx, rcx);
+    const auto interpreted = e.jcc(x64_cond::e);
+    e.jmp(rcx);
+
+    e.bind(unlinked);
+    e.bind(interpreted);
+    e.mov(pc(), rax);
+    e.mov64(exit_block(), rdx);
+    e.jmp(epilogue_);
+
+    e.bind(empty);
+    e.bind(mispredicted);
+}
+
+void rv_jit::emit_call(x64_emitter& e, const void *fn)
+{
+    e.mov64(x64_reg::rdi, RV_JIT_CPU);
+    e.mov64(x64_reg::rax, (uint64_t)fn);
+    e.call(x64_reg::rax);
+}
+
+void rv_jit::emit_block(x64_emitter& e, rv_block& block)
+{
+    const uint32_t n = block.len;
+    faults_.clear();
+    guard_sites_.clear();
+    native_exit_ = {};
+    native_ic_ = nullptr;
+    native_ic_jump_ = nullptr;
+    // translation of non paged blocks can't change without going through the dispatcher
+    direct_ = guest_base_ != nullptr && !block.paged;
+
+    e.cmp8(exit_request(), 0);
+    const auto exit_requested = e.jcc(x64_cond::ne);
+    e.alu64(x64_alu::sub, budget(), n);
+    const auto no_budget = e.jcc(x64_cond::l);
+
+    bool ended = false;
+    for (uint32_t i = 0; i < n && !ended; ++i)
+        ended = emit_insn(e, block, i);
+    if (!ended)
+        emit_exit(e, block, block.pc + n * sizeof(uint32_t));
+
+    // not enough budget left or the run has to end, maybe reached through a chained exit
+    e.bind(no_budget);
+    e.alu64(x64_alu::add, budget(), n);
+    e.bind(exit_requested);
+    e.mov(pc(), block.pc);
+    e.jmp(epilogue_);
+
+    // precise exceptions: pc_ points to the faulting instruction, only the ones before it retired
+    for (const auto& fault: faults_) {
+        e.bind(fault.at);
+        e.mov(pc(), fault.pc);
+        if (fault.replay != nullptr) {
+            e.mov64(x64_reg::rsi, (uint64_t)fault.replay);
+            emit_call(e, (const void *)fault.replay->handler);
+        }
+        e.alu64(x64_alu::add, budget(), n - fault.index);
+        e.jmp(epilogue_);
+    }
+}
+
+// anything without a native translation goes through its interpreter handler
+void rv_jit::emit_interpreted(x64_emitter& e, const rv_decoded_insn& insn, rv_uint pc_value, uint32_t index)
+{
+    const auto flags = rv_op_flags(insn.op);
+    e.mov(pc(), pc_value);
+    e.mov64(x64_reg::rsi, (uint64_t)&insn);
+    emit_call(e, (const void *)insn.handler);
+    if ((flags & RV_OPF_TRAP) != 0) {
+        e.cmp8(exception_raised(), 0);
+        faults_.push_back({e.jcc(x64_cond::ne), pc_value, index, nullptr});
+    }
+    // the handler already updated pc_
+    if ((flags & RV_OPF_END) != 0)
+        e.jmp(epilogue_);
+}
+
+void rv_jit::emit_div(x64_emitter& e, const rv_decoded_insn& insn)
+{
+    const bool is_signed = insn.op == rv_op::div || insn.op == rv_op::rem;
+    const bool is_rem = insn.op == rv_op::rem || insn.op == rv_op::remu;
+
+    e.mov(x64_reg::rax, reg(insn.rs1));
+    e.mov(x64_reg::rcx, reg(insn.rs2));
+    e.test(x64_reg::rcx, x64_reg::rcx);
+    const auto by_zero = e.jcc(x64_cond::e);
+
+    size_t overflow = 0;
+    if (is_signed) {
+        // INT_MIN / -1 would trap on x86, the quotient is INT_MIN and the remainder 0
+        e.alu(x64_alu::cmp, x64_reg::rcx, -1);
+        const auto no_overflow = e.jcc(x64_cond::ne);
+        e.alu(x64_alu::xor_, x64_reg::rdx, x64_reg::rdx);
+        e.alu(x64_alu::cmp, x64_reg::rax, INT32_MIN);
+        overflow = e.jcc(x64_cond::e);
+        e.bind(no_overflow);
+        e.cdq();
+        e.idiv(x64_reg::rcx);
+    }
+    else {
+        e.alu(x64_alu::xor_, x64_reg::rdx, x64_reg::rdx);
+        e.div(x64_reg::rcx);
+    }
+    const auto done = e.jmp();
+
+    // division by zero: quotient is all ones, remainder is the dividend
+    e.bind(by_zero);
+    if (is_rem)
+        e.mov(x64_reg::rdx, x64_reg::rax);
+    else
+        e.mov(x64_reg::rax, (uint32_t)-1);
+
+    e.bind(done);
+    if (is_signed)
+        e.bind(overflow);
+    e.mov(reg(insn.rd), is_rem ? x64_reg::rdx : x64_reg::rax);
+}
+
+// effective address in esi, the upper half of rsi cleared
+void rv_jit::emit_address(x64_emitter& e, const rv_decoded_insn& insn)
+{
+    e.mov(x64_reg::rsi, reg(insn.rs1));
+    if (insn.imm != 0)
+        e.alu(x64_alu::add, x64_reg::rsi, insn.imm);
+}
+
+// address in esi, the TLB entry for it in rcx, jumps to the returned offset on a miss
+size_t rv_jit::emit_tlb_lookup(x64_emitter& e, int32_t tlb_offset, uint32_t size)
+{
+    const auto rax = x64_reg::rax;
+    const auto rcx = x64_reg::rcx;
+    const auto rsi = x64_reg::rsi;
+
+    static_assert(sizeof(rv_tlb_entry) == 16, "tlb entries are indexed with a shift");
+    e.mov(rax, rsi);
+    e.shift(x64_shift::shr, rax, RV_MEMORY_PAGE_SHIFT);
+    e.alu(x64_alu::and_, rax, RV_TLB_ENTRIES - 1);
+    e.shift(x64_shift::shl, rax, 4);
+    e.mov64(rcx, x64_mem{RV_JIT_CPU, tlb_offset});
+    e.alu64(x64_alu::add, rcx, rax);
+
+    // misaligned addresses keep their low bits and miss
+    e.mov(rax, rsi);
+    e.alu(x64_alu::and_, rax, (int32_t)(~RV_MEMORY_PAGE_MASK | (size - 1)));
+    e.alu(x64_alu::cmp, rax, x64_mem{rcx, (int32_t)offsetof(rv_tlb_entry, tag)});
+    return e.jcc(x64_cond::ne);
+}
+
+// TLB hits (or direct accesses that don't fault) access host memory inline,
+// everything else goes through the helper
+void rv_jit::emit_load(x64_emitter& e, const rv_decoded_insn& insn, rv_uint pc_value, uint32_t index)
+{
+    static const void *const helpers[] = {
+        (const void *)&load<int8_t>, (const void *)&load<int16_t>, (const void *)&load<int32_t>,
+        (const void *)&load<uint8_t>, (const void *)&load<uint16_t>
+    };
+    static const uint32_t sizes[] = { 1, 2, 4, 1, 2 };
+    const auto rax = x64_reg::rax;
+    const auto rcx = x64_reg::rcx;
+    const size_t n = (size_t)insn.op - (size_t)rv_op::lb;
+
+    size_t miss = 0;
+    x64_mem host{RV_JIT_GUEST_BASE, 0, x64_reg::rsi, 0};
+    if (direct_) {
+        emit_address(e, insn);
+    }
+    else {
+        emit_address(e, insn);
+        miss = emit_tlb_lookup(e, tlb_load_offset_, sizes[n]);
+        e.mov64(rcx, x64_mem{rcx, (int32_t)offsetof(rv_tlb_entry, data)});
+        host.base = rcx;
+    }
+    const auto site = e.size();
+    switch (insn.op) {
+    case rv_op::lb: e.movsx8(rax, host); break;
+    case rv_op::lh: e.movsx16(rax, host); break;
+    case rv_op::lbu: e.movzx8(rax, host); break;
+    case rv_op::lhu: e.movzx16(rax, host); break;
+    default: e.mov(rax, host); break;
+    }
+    const auto done = e.jmp();
+
+    if (direct_)
+        guard_sites_.emplace_back((uint32_t)site, (uint32_t)e.size());
+    else
+        e.bind(miss);
+    emit_call(e, helpers[n]);
+    e.test64(rax, rax);
+    faults_.push_back({e.jcc(x64_cond::s), pc_value, index, nullptr});
+
+    e.bind(done);
+    if (insn.rd != 0)
+        e.mov(reg(insn.rd), rax);
+}
+
+void rv_jit::emit_store(x64_emitter& e, const rv_decoded_insn& insn, rv_uint pc_value, uint32_t index)
+{
+    static const void *const helpers[] = {
+        (const void *)&store<uint8_t>, (const void *)&store<uint16_t>, (const void *)&store<uint32_t>
+    };
+    static const uint32_t sizes[] = { 1, 2, 4 };
+    const auto rax = x64_reg::rax;
+    const auto rcx = x64_reg::rcx;
+    const auto rdx = x64_reg::rdx;
+    const size_t n = (size_t)insn.op - (size_t)rv_op::sb;
+
+    size_t miss = 0;
+    x64_mem host{RV_JIT_GUEST_BASE, 0, x64_reg::rsi, 0};
+    if (direct_) {
+        emit_address(e, insn);
+        e.mov(rdx, reg(insn.rs2));
+    }
+    else {
+        emit_address(e, insn);
+        miss = emit_tlb_lookup(e, tlb_store_offset_, sizes[n]);
+        e.mov(rdx, reg(insn.rs2));
+        e.mov64(rcx, x64_mem{rcx, (int32_t)offsetof(rv_tlb_entry, data)});
+        host.base = rcx;
+    }
+    const auto site = e.size();
+    switch (insn.op) {
+    case rv_op::sb: e.mov8(host, rdx); break;
+    case rv_op::sh: e.mov16(host, rdx); break;
+    default: e.mov(host, rdx); break;
+    }
+    const auto done = e.jmp();
+
+    // code pages and devices never hit (or fault in the guest window), the helper reports writes to code
+    if (direct_)
+        guard_sites_.emplace_back((uint32_t)site, (uint32_t)e.size());
+    else
+        e.bind(miss);
+    e.mov(rdx, reg(insn.rs2));
+    emit_call(e, helpers[n]);
+    e.test8(rax, rax);
+    faults_.push_back({e.jcc(x64_cond::e), pc_value, index, nullptr});
+
+    e.bind(done);
+}
+
+x64_cond rv_jit::branch_cond(rv_op op)
+{
+    switch (op) {
+    case rv_op::beq: return x64_cond::e;
+    case rv_op::bne: return x64_cond::ne;
+    case rv_op::blt: return x64_cond::l;
+    case rv_op::bge: return x64_cond::ge;
+    case rv_op::bltu: return x64_cond::b;
+    default: return x64_cond::ae;
+    }
+}
+
+// returns true if the instruction ends the block
+bool rv_jit::emit_insn(x64_emitter& e, rv_block& block, uint32_t index)
+{
+    const auto& insn = block.insns[index];
+    const rv_uint pc_value = block.pc + index * sizeof(uint32_t);
+    const auto rax = x64_reg::rax;
+    const auto rcx = x64_reg::rcx;
+    const rv_uint imm = (rv_uint)insn.imm;
+
+    switch (insn.op) {
+    case rv_op::nop:
+        return false;
+    case rv_op::lui:
+        e.mov(reg(insn.rd), imm);
+        return false;
+    case rv_op::auipc:
+        e.mov(reg(insn.rd), pc_value + imm);
+        return false;
+
+    case rv_op::jal:
+        if (((pc_value + imm) & 3) != 0)
+            break;
+        if (insn.rd != 0)
+            e.mov(reg(insn.rd), pc_value + 4);
+        if (block.is_call && !block.paged)
+            emit_ras_push(e, block);
+        emit_exit(e, block, pc_value + imm);
+        return true;
+    case rv_op::jalr:
+        e.mov(rax, reg(insn.rs1));
+        if (imm != 0)
+            e.alu(x64_alu::add, rax, insn.imm);
+        e.alu(x64_alu::and_, rax, -2);
+        e.mov(rcx, rax);
+        e.alu(x64_alu::and_, rcx, 3);
+        faults_.push_back({e.jcc(x64_cond::ne), pc_value, index, &insn});
+        if (insn.rd != 0)
+            e.mov(reg(insn.rd), pc_value + 4);
+        if (block.is_call && !block.paged)
+            emit_ras_push(e, block);
+        if (block.is_return && !block.paged)
+            emit_ras_pop(e);
+        emit_indirect_exit(e, block);
+        return true;
+    case rv_op::beq:
+    case rv_op::bne:
+    case rv_op::blt:
+    case rv_op::bge:
+    case rv_op::bltu:
+    case rv_op::bgeu: {
+        if (((pc_value + imm) & 3) != 0)
+            break;
+        e.mov(rax, reg(insn.rs1));
+        e.alu(x64_alu::cmp, rax, reg(insn.rs2));
+        const auto taken = e.jcc(branch_cond(insn.op));
+        emit_exit(e, block, pc_value + 4);
+        e.bind(taken);
+        emit_exit(e, block, pc_value + imm);
+        return true;
+    }
+
+    case rv_op::lb:
+    case rv_op::lh:
+    case rv_op::lw:
+    case rv_op::lbu:
+    case rv_op::lhu:
+        emit_load(e, insn, pc_value, index);
+        return false;
+    case rv_op::sb:
+    case rv_op::sh:
+    case rv_op::sw:
+        emit_store(e, insn, pc_value, index);
+        return false;
+
+    case rv_op::addi:
+    case rv_op::xori:
+    case rv_op::ori:
+    case rv_op::andi: {
+        static const x64_alu ops[] = { x64_alu::add, x64_alu::cmp, x64_alu::cmp, x64_alu::xor_, x64_alu::or_, x64_alu::and_ };
+        if (insn.rs1 == 0 && insn.op != rv_op::andi) {
+            e.mov(reg(insn.rd), imm);
+            return false;
+        }
+        e.mov(rax, reg(insn.rs1));
+        e.alu(ops[(size_t)insn.op - (size_t)rv_op::addi], rax, insn.imm);
+        e.mov(reg(insn.rd), rax);
+        return false;
+    }
+    case rv_op::slti:
+    case rv_op::sltiu:
+        e.mov(rcx, reg(insn.rs1));
+        e.alu(x64_alu::xor_, rax, rax);
+        e.alu(x64_alu::cmp, rcx, insn.imm);
+        e.setcc(insn.op == rv_op::slti ? x64_cond::l : x64_cond::b, rax);
+        e.mov(reg(insn.rd), rax);
+        return false;
+    case rv_op::slli:
+    case rv_op::srli:
+    case rv_op::srai: {
+        static const x64_shift ops[] = { x64_shift::shl, x64_shift::shr, x64_shift::sar };
+        e.mov(rax, reg(insn.rs1));
+        e.shift(ops[(size_t)insn.op - (size_t)rv_op::slli], rax, imm & 0x1F);
+        e.mov(reg(insn.rd), rax);
+        return false;
+    }
+
+    case rv_op::add:
+    case rv_op::sub:
+    case rv_op::xor_:
+    case rv_op::or_:
+    case rv_op::and_: {
+        const auto op = insn.op == rv_op::add ? x64_alu::add :
+                        insn.op == rv_op::sub ? x64_alu::sub :
+                        insn.op == rv_op::xor_ ? x64_alu::xor_ :
+                        insn.op == rv_op::or_ ? x64_alu::or_ : x64_alu::and_;
+        e.mov(rax, reg(insn.rs1));
+        e.alu(op, rax, reg(insn.rs2));
+        e.mov(reg(insn.rd), rax);
+        return false;
+    }
+    case rv_op::sll:
+    case rv_op::srl:
+    case rv_op::sra: {
+        // x86 masks the shift amount to 5 bits, just like riscv
+        const auto op = insn.op == rv_op::sll ? x64_shift::shl :
+                        insn.op == rv_op::srl ? x64_shift::shr : x64_shift::sar;
+        e.mov(rax, reg(insn.rs1));
+        e.mov(rcx, reg(insn.rs2));
+        e.shift_cl(op, rax);
+        e.mov(reg(insn.rd), rax);
+        return false;
+    }
+    case rv_op::slt:
+    case rv_op::sltu:
+        e.mov(rcx, reg(insn.rs1));
+        e.alu(x64_alu::xor_, rax, rax);
+        e.alu(x64_alu::cmp, rcx, reg(insn.rs2));
+        e.setcc(insn.op == rv_op::slt ? x64_cond::l : x64_cond::b, rax);
+        e.mov(reg(insn.rd), rax);
+        return false;
+
+    case rv_op::mul:
+        e.mov(rax, reg(insn.rs1));
+        e.imul(rax, reg(insn.rs2));
+        e.mov(reg(insn.rd), rax);
+        return false;
+    case rv_op::mulh:
+    case rv_op::mulhsu:
+    case rv_op::mulhu:
+        // 64bit product of the extended operands, the high half is the result
+        if (insn.op == rv_op::mulhu)
+            e.mov(rax, reg(insn.rs1));
+        else
+            e.movsxd(rax, reg(insn.rs1));
+        if (insn.op == rv_op::mulh)
+            e.movsxd(rcx, reg(insn.rs2));
+        else
+            e.mov(rcx, reg(insn.rs2));
+        e.imul64(rax, rcx);
+        e.shift64(x64_shift::shr, rax, 32);
+        e.mov(reg(insn.rd), rax);
+        return false;
+    case rv_op::div:
+    case rv_op::divu:
+    case rv_op::rem:
+    case rv_op::remu:
+        emit_div(e, insn);
+        return false;
+
+    default:
+        break;
+    }
+
+    emit_interpreted(e, insn, pc_value, index);
+    return (rv_op_flags(insn.op) & RV_OPF_END) != 0;
+}
\ No newline at end of file
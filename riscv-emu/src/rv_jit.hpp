@@ -0,0 +1,243 @@
+#pragma once
+#include <cstdint>
+#include <array>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <signal.h>
+#include "rv_global.hpp"
+#include "rv_insn.hpp"
+#include "rv_block_cache.hpp"
+#include "rv_x64_emitter.hpp"
+
+// blocks are compiled to native code once they have been executed this many times
+constexpr uint32_t RV_JIT_THRESHOLD = 32;
+// runs ending this many times at a native block make it the head of a trace
+constexpr uint32_t RV_JIT_TRACE_SAMPLES = 8;
+// default size of the code cache, filling it up throws away all native code
+constexpr size_t RV_JIT_CODE_CACHE_SIZE = 32 * 1024 * 1024;
+constexpr size_t RV_JIT_CODE_CACHE_MIN = 64 * 1024;
+// a direct access that faulted this many times always calls the helper from then on
+constexpr uint32_t RV_JIT_GUARD_FAULTS = 8;
+
+// cpu pointer, callee saved so it survives helper calls
+constexpr auto RV_JIT_CPU = x64_reg::rbx;
+// base of the guest window in guard page mode
+constexpr auto RV_JIT_GUEST_BASE = x64_reg::r12;
+
+class rv_cpu;
+class rv_trace_emitter;
+
+// native code of a block, as the compile thread hands it to the block's hart
+struct rv_jit_code
+{
+    // nullptr if the code cache is full
+    const uint8_t *code = nullptr;
+    bool direct = false;
+    // patch points, see rv_block
+    std::array<uint8_t*, 2> exit{};
+    uint8_t *ic = nullptr;
+    uint8_t *ic_jump = nullptr;
+    // its guard_table_ entries
+    std::vector<std::pair<uint32_t, uint32_t>> guard_sites;
+    // extent of a trace, see rv_block
+    rv_uint trace_begin = 0;
+    rv_uint trace_end = 0;
+};
+
+// x86-64 backend, translating hot blocks into native code
+// on other hosts (or if executable memory can't be mapped) compile() always fails
+// and everything keeps running in the interpreter
+//
+// native code keeps the cpu pointer in rbx and works directly on the guest registers in rv_cpu
+// every block checks cpu.exit_request_, then charges its length to cpu.jit_budget_ and exits to the dispatcher
+// with pc_ pointing to the next instruction, or to the faulting one with the exception raised
+// and the instructions that didn't retire refunded to the budget
+//
+// static exits are rel32 jumps patched by rv_block_cache to the successor's code once linked,
+// jalr goes through the return address stack and a patchable one entry inline cache,
+// every exit to the dispatcher leaves the block it came from in cpu.jit_exit_block_
+// loads and stores look up the mmu TLB inline and only call out on a miss
+//
+// with guard pages (rv_memory::guest_base()) blocks fetched without paging access the guest window
+// directly instead, r12 holds its base, and the dispatcher only enters them with bare data translation
+// a SIGSEGV on one of these accesses resumes at the helper call, as a TLB miss would, and accesses
+// that keep faulting (data next to code on a write protected page, devices) are patched into jumps to it
+//
+// with a compile thread (set_compile_thread) hot blocks are queued and keep running threaded while
+// a thread shared by every hart in the process compiles them into their hart's code cache, the
+// finished code is published through rv_block::compiled and installed by the hart the next time it
+// gets to the block, only the hart ever links, patches or flushes its code
+//
+// traces (rv_block_cache::record) are compiled as a unit, entered through the head block, on the compile
+// thread like blocks and installed by the hart at the start of its next run (install_traces):
+// the guest registers used the most live in host registers, constants are propagated along the path and
+// writes nothing reads are dropped, accesses of a block off the same base register share one TLB check
+// made when the block is entered, every way off the path writes the registers back first
+// whatever a trace can't handle falls back to the blocks' own code, from the start of the block
+class rv_jit
+{
+public:
+    rv_jit() = delete;
+    explicit rv_jit(rv_cpu& cpu);
+    ~rv_jit();
+
+    rv_jit(const rv_jit&) = delete;
+    rv_jit& operator=(const rv_jit&) = delete;
+
+    // compile block, on success block.native points to its code
+    // with a compile thread it queues the block and fails until the code is ready
+    bool compile(rv_block& block);
+    // compile a trace recorded by rv_block_cache, once done the head's native points to it
+    // with a compile thread it's queued and installed by install_traces()
+    void compile_trace(const std::vector<rv_block*>& blocks, bool loops);
+    // install the traces the compile thread is done with, on the hart outside native code
+    void install_traces();
+    // throw away all native code, nothing may be running it
+    void flush();
+    // compile on the shared compile thread (if the host has more than one CPU) or on the calling one,
+    // dropping queued blocks
+    void set_compile_thread(bool enabled);
+    // wait for the compile thread to be done with this hart's blocks that are about to be freed,
+    // the dead ones (rv_block::dead) or all of them
+    void drain(bool all);
+    // remap the code cache with size bytes (at least RV_JIT_CODE_CACHE_MIN), dropping all
+    // native code if the size changes, 0 unmaps it and compile() fails from then on
+    void set_code_cache_size(size_t size);
+
+    // run native code until it exits back to the dispatcher
+    void enter(const void *code)
+    {
+        t_entered = this;
+        entry_(&cpu_, code);
+        t_entered = nullptr;
+    }
+
+private:
+    friend class rv_trace_emitter;
+    using entry_fn = void (*)(rv_cpu *cpu, const void *code);
+
+    // a conditional jump out of the block at instruction index
+    // replay is re-executed by the interpreter first, to raise the exception
+    struct fault_site
+    {
+        size_t at;
+        rv_uint pc;
+        uint32_t index;
+        const rv_decoded_insn *replay;
+    };
+
+    void emit_entry(x64_emitter& e);
+    void emit_block(x64_emitter& e, rv_block& block);
+    bool emit_insn(x64_emitter& e, rv_block& block, uint32_t index);
+    void emit_exit(x64_emitter& e, rv_block& block, rv_uint target);
+    void emit_indirect_exit(x64_emitter& e, rv_block& block);
+    void emit_ras_push(x64_emitter& e, rv_block& block);
+    void emit_ras_pop(x64_emitter& e);
+    void emit_call(x64_emitter& e, const void *fn);
+    void emit_interpreted(x64_emitter& e, const rv_decoded_insn& insn, rv_uint pc, uint32_t index);
+    void emit_div(x64_emitter& e, const rv_decoded_insn& insn);
+    size_t emit_tlb_lookup(x64_emitter& e, int32_t tlb_offset, uint32_t size);
+    void emit_load(x64_emitter& e, const rv_decoded_insn& insn, rv_uint pc_value, uint32_t index);
+    void emit_store(x64_emitter& e, const rv_decoded_insn& insn, rv_uint pc_value, uint32_t index);
+    void emit_address(x64_emitter& e, const rv_decoded_insn& insn);
+    static x64_cond branch_cond(rv_op op);
+
+    // a direct access in the code cache
+    struct guard_site
+    {
+        uint32_t at;
+        uint32_t recover;
+        uint32_t faults;
+    };
+
+    // a trace waiting for the compile thread, its code is published through the head's rv_block::compiled
+    struct trace_job
+    {
+        std::vector<rv_block*> blocks;
+        // each block's own code, where the trace bails out to, taken on the hart
+        std::vector<const void*> entries;
+        bool loops;
+        // in the compile thread's queue or being compiled, cleared when a fork dropped the queue
+        bool queued = false;
+    };
+
+    // the compile thread and the blocks it's asked to compile
+    struct compiler;
+    static compiler& shared_compiler();
+    static void compile_loop();
+    void queue(rv_block& block);
+    void queue(trace_job& trace);
+    // emit block at the end of the code cache, on the compile thread or the hart
+    void emit(rv_block& block, rv_jit_code& code);
+    // make emitted code reachable, on the hart
+    bool install(rv_block& block, const rv_jit_code& code);
+    void add_guard_sites(const std::vector<std::pair<uint32_t, uint32_t>>& sites);
+    void emit_trace(const trace_job& trace, rv_jit_code& code);
+    void install_trace(rv_block& head, const rv_jit_code& code);
+
+    // guard page faults in native code
+    static void install_fault_handler();
+    static void guard_fault(int sig, siginfo_t *info, void *context);
+    const uint8_t *recovery(const uint8_t *at, const uint8_t *address);
+
+    x64_mem reg(uint32_t r) const;
+    x64_mem pc() const;
+    x64_mem budget() const;
+    x64_mem exception_raised() const;
+    x64_mem exit_block() const;
+    x64_mem exit_request() const;
+    x64_mem ras_top() const;
+
+    // native code helpers, return RV_JIT_FAULT / false with the exception already raised
+    template<typename T>
+    static uint64_t load(rv_cpu *cpu, rv_uint address);
+    template<typename T>
+    static bool store(rv_cpu *cpu, rv_uint address, rv_uint value);
+
+private:
+    rv_cpu& cpu_;
+
+    uint8_t *code_ = nullptr;
+    size_t size_ = 0;
+    size_t used_ = 0;
+    entry_fn entry_ = nullptr;
+    const uint8_t *epilogue_ = nullptr;
+
+    // offsets of the cpu state accessed by native code
+    int32_t regs_offset_;
+    int32_t pc_offset_;
+    int32_t budget_offset_;
+    int32_t exception_offset_;
+    int32_t exit_block_offset_;
+    int32_t exit_request_offset_;
+    int32_t ras_offset_;
+    int32_t ras_top_offset_;
+    // current load/store TLBs of the mmu
+    int32_t tlb_load_offset_;
+    int32_t tlb_store_offset_;
+    // rv_block fields read by the return address stack prediction and by traces
+    int32_t block_native_offset_;
+    int32_t block_return_pc_offset_;
+    int32_t block_return_offset_;
+    int32_t block_exit_offset_;
+
+    std::vector<fault_site> faults_;
+    // patch points of the block being emitted
+    std::array<uint8_t*, 2> native_exit_;
+    uint8_t *native_ic_;
+    uint8_t *native_ic_jump_;
+    bool compile_thread_ = false;
+    // traces queued, in the order they were recorded
+    std::vector<std::unique_ptr<trace_job>> traces_;
+
+    // guard page mode: base of the guest window, whether the block being emitted uses it
+    uint8_t *guest_base_;
+    bool direct_ = false;
+    // direct accesses of the block being emitted and of the whole code cache, as offsets of
+    // the access and of the code handling its fault, the latter sorted since code is only appended
+    std::vector<std::pair<uint32_t, uint32_t>> guard_sites_;
+    std::vector<guard_site> guard_table_;
+
+    static thread_local rv_jit *t_entered;
+};
\ No newline at end of file
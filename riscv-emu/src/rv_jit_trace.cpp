@@ -0,0 +1,1172 @@
+#include <cstddef>
+#include <algorithm>
+#include <iterator>
+#include <numeric>
+#include "rv_jit.hpp"
+#include "rv_cpu.hpp"
+#include "rv_insn_ops.hpp"
+#include "rv_x64_emitter.hpp"
+
+// budget left while a trace runs, stored back on the way out
+constexpr auto RV_TRACE_BUDGET = x64_reg::r15;
+// host address of the guest page the accesses of a block's group are on, minus its address
+constexpr auto RV_TRACE_GROUP = x64_reg::rdi;
+// the guest register isn't kept in a host register
+constexpr auto RV_TRACE_MEMORY = x64_reg::rsp;
+
+// guest registers get these in order of use, callee saved first, r12 unless it's the guest window base
+static const x64_reg trace_hosts[] = {
+    x64_reg::rbp, x64_reg::r13, x64_reg::r14, x64_reg::r12, x64_reg::r8, x64_reg::r9, x64_reg::r10, x64_reg::r11
+};
+
+static uint32_t bit(uint32_t r)
+{
+    return 1U << r;
+}
+
+static bool is_branch(rv_op op)
+{
+    return op >= rv_op::beq && op <= rv_op::bgeu;
+}
+
+static bool is_load(rv_op op)
+{
+    return op >= rv_op::lb && op <= rv_op::lhu;
+}
+
+static bool is_store(rv_op op)
+{
+    return op >= rv_op::sb && op <= rv_op::sw;
+}
+
+// everything else goes through its interpreter handler
+static bool is_native(rv_op op)
+{
+    return op >= rv_op::nop && op <= rv_op::remu && op != rv_op::jalr;
+}
+
+static uint32_t access_size(rv_op op)
+{
+    switch (op) {
+    case rv_op::lb: case rv_op::lbu: case rv_op::sb: return 1;
+    case rv_op::lh: case rv_op::lhu: case rv_op::sh: return 2;
+    default: return 4;
+    }
+}
+
+// the instruction may leave the trace, everything written before it has to be in place
+static bool leaves(rv_op op)
+{
+    return !is_native(op) || is_load(op) || is_store(op) || is_branch(op) || op == rv_op::jal;
+}
+
+// guest registers read and written, as masks
+static uint32_t reads(const rv_decoded_insn& insn)
+{
+    switch (insn.op) {
+    case rv_op::nop:
+    case rv_op::lui:
+    case rv_op::auipc:
+    case rv_op::jal:
+    case rv_op::fence:
+        return 0;
+    default:
+        if (is_load(insn.op) || (insn.op >= rv_op::addi && insn.op <= rv_op::srai) || insn.op == rv_op::lr_w)
+            return bit(insn.rs1);
+        return bit(insn.rs1) | bit(insn.rs2);
+    }
+}
+
+static uint32_t writes(const rv_decoded_insn& insn)
+{
+    const auto op = insn.op;
+    const bool rd = op == rv_op::lui || op == rv_op::auipc || op == rv_op::jal || is_load(op) ||
+                    (op >= rv_op::addi && op <= rv_op::remu) || (op >= rv_op::lr_w && op <= rv_op::amomaxu_w);
+    return rd ? bit(insn.rd) & ~1U : 0;
+}
+
+static bool branch_taken(rv_op op, rv_uint a, rv_uint b)
+{
+    switch (op) {
+    case rv_op::beq: return rv_cond_eq{}(a, b);
+    case rv_op::bne: return rv_cond_ne{}(a, b);
+    case rv_op::blt: return rv_cond_lt{}(a, b);
+    case rv_op::bge: return rv_cond_ge{}(a, b);
+    case rv_op::bltu: return rv_cond_ltu{}(a, b);
+    default: return rv_cond_geu{}(a, b);
+    }
+}
+
+// one trace, compiled in two passes over its instructions: the first finds what's known at compile time,
+// the writes nothing reads and the accesses sharing a TLB check, and picks the registers kept in host ones,
+// the second emits it, redoing the constant propagation as it goes
+class rv_trace_emitter
+{
+public:
+    // entries: where bailing out of each block goes
+    rv_trace_emitter(rv_jit& jit, const std::vector<rv_block*>& blocks, const std::vector<const void*>& entries, bool loops);
+
+    // emit at the start of e, which overflows if it doesn't fit
+    void emit(x64_emitter& e);
+
+    // physical extent of the blocks
+    rv_uint begin() const { return begin_; }
+    rv_uint end() const { return end_; }
+    // direct accesses, as offsets from the start of the trace (see rv_jit::guard_sites_)
+    const std::vector<std::pair<uint32_t, uint32_t>>& guard_sites() const { return guard_sites_; }
+
+private:
+    struct insn_info
+    {
+        const rv_decoded_insn *insn;
+        rv_uint pc;
+        uint32_t block;
+        // what it writes is written again before anything reads it or the trace may leave
+        bool dead = false;
+        // accessed through its block's group
+        bool grouped = false;
+        // div(u) followed by the rem(u) of the same operands, one division for both
+        bool fused = false;
+    };
+
+    // accesses of a block off the same base register (not written before them), all on one page
+    // and aligned if the base is aligned to align, checked once when the block is entered
+    struct access_group
+    {
+        uint32_t base = 0;
+        int32_t lo = 0;
+        int32_t hi = 0;
+        uint32_t align = 1;
+        bool loads = false;
+        bool stores = false;
+    };
+
+    // ways out of the trace, emitted after it
+    enum class stub_kind
+    {
+        // the instruction raised an exception
+        fault,
+        // a branch or jump off the recorded path, through exit slot of the block
+        exit,
+        // the block runs its own code instead, from its start
+        bail,
+        // the trace wrote to its own code, leave right after the instruction
+        stale
+    };
+
+    struct exit_stub
+    {
+        stub_kind kind;
+        // instructions of the trace retired by then
+        uint32_t retired;
+        rv_uint pc;
+        uint32_t block;
+        size_t slot;
+    };
+
+    void analyze();
+    void find_group(uint32_t b);
+    void allocate();
+
+    bool known(uint32_t r) const { return ((known_ >> r) & 1) != 0; }
+    bool fold(const insn_info& info, rv_uint& value) const;
+    void propagate(uint32_t index);
+
+    void emit_block(uint32_t b);
+    void emit_group(uint32_t b);
+    void emit_end(uint32_t b);
+    void emit_insn(uint32_t index);
+    void emit_div(uint32_t index);
+    void emit_load(uint32_t index);
+    void emit_store(uint32_t index);
+    void emit_interpreted(uint32_t index);
+    void emit_address(const rv_decoded_insn& insn);
+    void emit_helper(const void *fn);
+    void emit_stale_check(uint32_t index);
+    void emit_stub(const exit_stub& stub);
+    void writeback();
+
+    // guest register r into dst, or as the source operand of op
+    void read(x64_reg dst, uint32_t r);
+    void alu(x64_alu op, x64_reg dst, uint32_t r);
+    void imul(x64_reg dst, uint32_t r);
+    // where to compute the result of the instruction, other is an operand read after it's written
+    x64_reg result(const insn_info& info, uint32_t other) const;
+    void write(const insn_info& info, x64_reg src);
+    void write(const insn_info& info, rv_uint value);
+
+    size_t stub(stub_kind kind, uint32_t retired, rv_uint pc, uint32_t block, size_t slot = 0);
+    size_t bail(uint32_t b);
+    void jump(size_t stub, size_t at) { jumps_.emplace_back(at, stub); }
+
+    rv_jit& jit_;
+    const std::vector<rv_block*>& blocks_;
+    const std::vector<const void*>& entries_;
+    const bool loops_;
+    // same as rv_jit::direct_
+    bool direct_;
+    x64_emitter *e_ = nullptr;
+
+    std::vector<insn_info> insns_;
+    // first instruction of each block, then the number of instructions
+    std::vector<uint32_t> starts_;
+    // registers read at run time, the others are known
+    std::vector<uint32_t> runtime_reads_;
+    std::vector<access_group> groups_;
+    rv_uint begin_;
+    rv_uint end_;
+
+    // host register of each guest register, the ones written back on every way out,
+    // the caller saved ones helper calls preserve
+    std::array<x64_reg, 32> hosts_;
+    uint32_t written_ = 0;
+    std::vector<x64_reg> caller_saved_;
+    // guest registers whose value is known at the current instruction, x0 always is
+    uint32_t known_ = 1;
+    std::array<rv_uint, 32> values_{};
+    // the group of the block being emitted is in RV_TRACE_GROUP
+    bool group_live_ = false;
+
+    std::vector<exit_stub> stubs_;
+    // jumps to the stubs, offset and stub
+    std::vector<std::pair<size_t, size_t>> jumps_;
+    std::vector<size_t> bails_;
+    std::vector<std::pair<uint32_t, uint32_t>> guard_sites_;
+};
+
+rv_trace_emitter::rv_trace_emitter(rv_jit& jit, const std::vector<rv_block*>& blocks,
+                                   const std::vector<const void*>& entries, bool loops)
+    : jit_{jit}, blocks_{blocks}, entries_{entries}, loops_{loops}
+{
+    direct_ = jit.guest_base_ != nullptr && !blocks[0]->paged;
+    begin_ = blocks[0]->ppc;
+    end_ = begin_;
+    for (uint32_t b = 0; b < blocks.size(); ++b) {
+        const auto& block = *blocks[b];
+        starts_.push_back((uint32_t)insns_.size());
+        for (uint32_t i = 0; i < block.len; ++i)
+            insns_.push_back({&block.insns[i], block.pc + i * (rv_uint)sizeof(uint32_t), b});
+        begin_ = std::min(begin_, block.ppc);
+        end_ = std::max(end_, block.ppc + block.len * (rv_uint)sizeof(uint32_t));
+    }
+    starts_.push_back((uint32_t)insns_.size());
+    groups_.resize(blocks.size());
+    bails_.assign(blocks.size(), SIZE_MAX);
+    hosts_.fill(RV_TRACE_MEMORY);
+
+    analyze();
+    allocate();
+}
+
+void rv_trace_emitter::analyze()
+{
+    const auto n = (uint32_t)insns_.size();
+    runtime_reads_.resize(n);
+    known_ = 1;
+    for (uint32_t i = 0; i < n; ++i) {
+        auto& info = insns_[i];
+        const auto& insn = *info.insn;
+        if (i == starts_[info.block])
+            find_group(info.block);
+        runtime_reads_[i] = reads(insn) & ~known_;
+
+        // not the last one of the block, that one is emitted on its own
+        if ((insn.op == rv_op::div || insn.op == rv_op::divu) && i + 2 < starts_[info.block + 1]) {
+            const auto& next = *insns_[i + 1].insn;
+            info.fused = next.op == (insn.op == rv_op::div ? rv_op::rem : rv_op::remu) &&
+                         next.rs1 == insn.rs1 && next.rs2 == insn.rs2 && next.rd != insn.rd &&
+                         insn.rd != insn.rs1 && insn.rd != insn.rs2 && (runtime_reads_[i] != 0);
+        }
+        propagate(i);
+    }
+
+    for (uint32_t i = 0; i < n; ++i) {
+        auto& info = insns_[i];
+        const uint32_t w = writes(*info.insn);
+        if (w == 0 || !is_native(info.insn->op))
+            continue;
+        for (uint32_t j = i + 1; j < n && insns_[j].block == info.block; ++j) {
+            if ((runtime_reads_[j] & w) != 0 || leaves(insns_[j].insn->op))
+                break;
+            if ((writes(*insns_[j].insn) & w) != 0) {
+                info.dead = true;
+                break;
+            }
+        }
+    }
+}
+
+void rv_trace_emitter::find_group(uint32_t b)
+{
+    // guard page mode accesses the guest window without looking up the TLB anyway
+    if (direct_)
+        return;
+
+    // accesses whose address only depends on the register the block was entered with
+    const auto candidate = [this](const rv_decoded_insn& insn, uint32_t written) {
+        return (is_load(insn.op) || is_store(insn.op)) && insn.rs1 != 0 && (written & bit(insn.rs1)) == 0 &&
+               (insn.imm & (access_size(insn.op) - 1)) == 0;
+    };
+    std::array<uint32_t, 32> uses{};
+    uint32_t written = 0;
+    for (uint32_t i = starts_[b]; i < starts_[b + 1] && is_native(insns_[i].insn->op); ++i) {
+        if (candidate(*insns_[i].insn, written))
+            ++uses[insns_[i].insn->rs1];
+        written |= writes(*insns_[i].insn);
+    }
+    const auto base = (uint32_t)(std::max_element(uses.begin(), uses.end()) - uses.begin());
+    if (uses[base] < 2)
+        return;
+
+    access_group group;
+    group.base = base;
+    group.lo = INT32_MAX;
+    group.hi = INT32_MIN;
+    written = 0;
+    for (uint32_t i = starts_[b]; i < starts_[b + 1] && is_native(insns_[i].insn->op); ++i) {
+        const auto& insn = *insns_[i].insn;
+        if (candidate(insn, written) && insn.rs1 == base) {
+            const auto size = access_size(insn.op);
+            group.lo = std::min(group.lo, insn.imm);
+            group.hi = std::max(group.hi, insn.imm + (int32_t)size);
+            group.align = std::max(group.align, size);
+            group.loads |= is_load(insn.op);
+            group.stores |= is_store(insn.op);
+        }
+        written |= writes(insn);
+    }
+    if (group.hi - group.lo > (int32_t)RV_MEMORY_PAGE_SIZE)
+        return;
+    if (known(base)) {
+        const rv_uint address = values_[base];
+        if ((address & (group.align - 1)) != 0 ||
+            (((address + group.lo) ^ (address + group.hi - 1)) & ~RV_MEMORY_PAGE_MASK) != 0)
+            return;
+    }
+
+    written = 0;
+    for (uint32_t i = starts_[b]; i < starts_[b + 1] && is_native(insns_[i].insn->op); ++i) {
+        const auto& insn = *insns_[i].insn;
+        insns_[i].grouped = candidate(insn, written) && insn.rs1 == base;
+        written |= writes(insn);
+    }
+    groups_[b] = group;
+}
+
+void rv_trace_emitter::allocate()
+{
+    std::array<uint32_t, 32> uses{};
+    for (uint32_t i = 0; i < insns_.size(); ++i) {
+        const auto& info = insns_[i];
+        if (!is_native(info.insn->op))
+            continue;
+        for (uint32_t r = 1; r < 32; ++r)
+            uses[r] += (runtime_reads_[i] >> r) & 1;
+        if (!info.dead && writes(*info.insn) != 0)
+            ++uses[info.insn->rd];
+    }
+    for (const auto& group: groups_)
+        uses[group.base] += group.base != 0;
+
+    // loaded on the way in and stored on the way out, that has to pay off
+    std::array<uint32_t, 31> order;
+    std::iota(order.begin(), order.end(), 1);
+    std::stable_sort(order.begin(), order.end(), [&uses](uint32_t a, uint32_t b) { return uses[a] > uses[b]; });
+    size_t next = 0;
+    for (auto r: order) {
+        if (uses[r] < (loops_ ? 1U : 2U))
+            break;
+        if (next < std::size(trace_hosts) && trace_hosts[next] == RV_JIT_GUEST_BASE && jit_.guest_base_ != nullptr)
+            ++next;
+        if (next == std::size(trace_hosts))
+            break;
+        hosts_[r] = trace_hosts[next++];
+        if (hosts_[r] >= x64_reg::r8 && hosts_[r] <= x64_reg::r11)
+            caller_saved_.push_back(hosts_[r]);
+    }
+
+    for (const auto& info: insns_) {
+        if (is_native(info.insn->op) && !info.dead)
+            written_ |= writes(*info.insn) & ~bit(0);
+    }
+    for (uint32_t r = 0; r < 32; ++r) {
+        if (hosts_[r] == RV_TRACE_MEMORY)
+            written_ &= ~bit(r);
+    }
+}
+
+bool rv_trace_emitter::fold(const insn_info& info, rv_uint& value) const
+{
+    const auto& insn = *info.insn;
+    const rv_uint a = values_[insn.rs1];
+    const rv_uint b = values_[insn.rs2];
+    const auto imm = (rv_uint)insn.imm;
+    const bool imm_known = known(insn.rs1);
+    const bool op_known = imm_known && known(insn.rs2);
+
+    switch (insn.op) {
+    case rv_op::lui: value = imm; return true;
+    case rv_op::auipc: value = info.pc + imm; return true;
+    case rv_op::jal: value = info.pc + 4; return true;
+
+    case rv_op::addi: value = rv_alu_add{}(a, imm); return imm_known;
+    case rv_op::slti: value = rv_alu_slt{}(a, imm); return imm_known;
+    case rv_op::sltiu: value = rv_alu_sltu{}(a, imm); return imm_known;
+    case rv_op::xori: value = rv_alu_xor{}(a, imm); return imm_known;
+    case rv_op::ori: value = rv_alu_or{}(a, imm); return imm_known;
+    case rv_op::andi: value = rv_alu_and{}(a, imm); return imm_known;
+    case rv_op::slli: value = rv_alu_sll{}(a, imm); return imm_known;
+    case rv_op::srli: value = rv_alu_srl{}(a, imm); return imm_known;
+    case rv_op::srai: value = rv_alu_sra{}(a, imm); return imm_known;
+
+    case rv_op::add: value = rv_alu_add{}(a, b); return op_known;
+    case rv_op::sub: value = rv_alu_sub{}(a, b); return op_known;
+    case rv_op::sll: value = rv_alu_sll{}(a, b); return op_known;
+    case rv_op::slt: value = rv_alu_slt{}(a, b); return op_known;
+    case rv_op::sltu: value = rv_alu_sltu{}(a, b); return op_known;
+    case rv_op::xor_: value = rv_alu_xor{}(a, b); return op_known;
+    case rv_op::srl: value = rv_alu_srl{}(a, b); return op_known;
+    case rv_op::sra: value = rv_alu_sra{}(a, b); return op_known;
+    case rv_op::or_: value = rv_alu_or{}(a, b); return op_known;
+    case rv_op::and_: value = rv_alu_and{}(a, b); return op_known;
+    case rv_op::mul: value = rv_alu_mul{}(a, b); return op_known;
+    case rv_op::mulh: value = rv_alu_mulh{}(a, b); return op_known;
+    case rv_op::mulhsu: value = rv_alu_mulhsu{}(a, b); return op_known;
+    case rv_op::mulhu: value = rv_alu_mulhu{}(a, b); return op_known;
+    case rv_op::div: value = rv_alu_div{}(a, b); return op_known;
+    case rv_op::divu: value = rv_alu_divu{}(a, b); return op_known;
+    case rv_op::rem: value = rv_alu_rem{}(a, b); return op_known;
+    case rv_op::remu: value = rv_alu_remu{}(a, b); return op_known;
+    default: return false;
+    }
+}
+
+void rv_trace_emitter::propagate(uint32_t index)
+{
+    const auto& info = insns_[index];
+    const uint32_t w = writes(*info.insn);
+    rv_uint value;
+    if (w == 0)
+        return;
+    if (fold(info, value)) {
+        known_ |= w;
+        values_[info.insn->rd] = value;
+    }
+    else {
+        known_ &= ~w;
+    }
+}
+
+size_t rv_trace_emitter::stub(stub_kind kind, uint32_t retired, rv_uint pc, uint32_t block, size_t slot)
+{
+    stubs_.push_back({kind, retired, pc, block, slot});
+    return stubs_.size() - 1;
+}
+
+size_t rv_trace_emitter::bail(uint32_t b)
+{
+    if (bails_[b] == SIZE_MAX)
+        bails_[b] = stub(stub_kind::bail, starts_[b], blocks_[b]->pc, b);
+    return bails_[b];
+}
+
+void rv_trace_emitter::read(x64_reg dst, uint32_t r)
+{
+    if (known(r))
+        e_->mov(dst, values_[r]);
+    else if (hosts_[r] == RV_TRACE_MEMORY)
+        e_->mov(dst, jit_.reg(r));
+    else if (hosts_[r] != dst)
+        e_->mov(dst, hosts_[r]);
+}
+
+void rv_trace_emitter::alu(x64_alu op, x64_reg dst, uint32_t r)
+{
+    if (known(r))
+        e_->alu(op, dst, (int32_t)values_[r]);
+    else if (hosts_[r] == RV_TRACE_MEMORY)
+        e_->alu(op, dst, jit_.reg(r));
+    else
+        e_->alu(op, dst, hosts_[r]);
+}
+
+void rv_trace_emitter::imul(x64_reg dst, uint32_t r)
+{
+    if (known(r)) {
+        e_->mov(x64_reg::rcx, values_[r]);
+        e_->imul(dst, x64_reg::rcx);
+    }
+    else if (hosts_[r] == RV_TRACE_MEMORY) {
+        e_->imul(dst, jit_.reg(r));
+    }
+    else {
+        e_->imul(dst, hosts_[r]);
+    }
+}
+
+x64_reg rv_trace_emitter::result(const insn_info& info, uint32_t other) const
+{
+    const auto rd = info.insn->rd;
+    if (hosts_[rd] == RV_TRACE_MEMORY || (other == rd && !known(other)))
+        return x64_reg::rax;
+    return hosts_[rd];
+}
+
+void rv_trace_emitter::write(const insn_info& info, x64_reg src)
+{
+    const auto rd = info.insn->rd;
+    if (rd == 0 || info.dead)
+        return;
+    if (hosts_[rd] == RV_TRACE_MEMORY)
+        e_->mov(jit_.reg(rd), src);
+    else if (hosts_[rd] != src)
+        e_->mov(hosts_[rd], src);
+}
+
+void rv_trace_emitter::write(const insn_info& info, rv_uint value)
+{
+    const auto rd = info.insn->rd;
+    if (rd == 0 || info.dead)
+        return;
+    if (hosts_[rd] == RV_TRACE_MEMORY)
+        e_->mov(jit_.reg(rd), value);
+    else
+        e_->mov(hosts_[rd], value);
+}
+
+void rv_trace_emitter::writeback()
+{
+    for (uint32_t r = 1; r < 32; ++r) {
+        if ((written_ & bit(r)) != 0)
+            e_->mov(jit_.reg(r), hosts_[r]);
+    }
+}
+
+void rv_trace_emitter::emit(x64_emitter& e)
+{
+    e_ = &e;
+    e.mov64(RV_TRACE_BUDGET, jit_.budget());
+    for (uint32_t r = 1; r < 32; ++r) {
+        if (hosts_[r] != RV_TRACE_MEMORY)
+            e.mov(hosts_[r], jit_.reg(r));
+    }
+
+    // a loop charges every pass up front, like a block
+    const auto header = e.cur();
+    known_ = 1;
+    e.alu64(x64_alu::sub, RV_TRACE_BUDGET, (int32_t)insns_.size());
+    jump(bail(0), e.jcc(x64_cond::l));
+    for (uint32_t b = 0; b < blocks_.size(); ++b)
+        emit_block(b);
+    if (loops_)
+        e.jmp(header);
+
+    for (size_t i = 0; i < stubs_.size(); ++i) {
+        for (const auto& at: jumps_) {
+            if (at.second == i)
+                e.bind(at.first);
+        }
+        emit_stub(stubs_[i]);
+    }
+}
+
+void rv_trace_emitter::emit_block(uint32_t b)
+{
+    auto& e = *e_;
+    e.cmp8(jit_.exit_request(), 0);
+    jump(bail(b), e.jcc(x64_cond::ne));
+
+    group_live_ = false;
+    if (groups_[b].base != 0)
+        emit_group(b);
+    for (uint32_t i = starts_[b]; i + 1 < starts_[b + 1]; ++i) {
+        if (insns_[i].fused) {
+            emit_div(i);
+            propagate(i);
+            propagate(++i);
+            continue;
+        }
+        emit_insn(i);
+    }
+    emit_end(b);
+}
+
+// one TLB check for the group, the block runs its own code if it misses or the accesses
+// wouldn't be aligned or on one page
+void rv_trace_emitter::emit_group(uint32_t b)
+{
+    const auto& group = groups_[b];
+    const auto rax = x64_reg::rax;
+    const auto rcx = x64_reg::rcx;
+    const auto rdx = x64_reg::rdx;
+    auto& e = *e_;
+
+    if (known(group.base)) {
+        e.mov(rax, values_[group.base] + (rv_uint)group.lo);
+    }
+    else {
+        read(rdx, group.base);
+        if (group.align > 1) {
+            e.mov(rax, rdx);
+            e.alu(x64_alu::and_, rax, (int32_t)group.align - 1);
+            jump(bail(b), e.jcc(x64_cond::ne));
+        }
+        e.mov(rax, rdx);
+        e.alu(x64_alu::add, rax, group.lo);
+        e.mov(rcx, rdx);
+        e.alu(x64_alu::add, rcx, group.hi - 1);
+        e.alu(x64_alu::xor_, rcx, rax);
+        e.alu(x64_alu::and_, rcx, (int32_t)~RV_MEMORY_PAGE_MASK);
+        jump(bail(b), e.jcc(x64_cond::ne));
+    }
+
+    // entry offset in rdx, tag in eax
+    e.mov(rdx, rax);
+    e.shift(x64_shift::shr, rdx, RV_MEMORY_PAGE_SHIFT);
+    e.alu(x64_alu::and_, rdx, RV_TLB_ENTRIES - 1);
+    e.shift(x64_shift::shl, rdx, 4);
+    e.alu(x64_alu::and_, rax, (int32_t)~RV_MEMORY_PAGE_MASK);
+    for (int i = 0; i < 2; ++i) {
+        if (!(i == 0 ? group.loads : group.stores))
+            continue;
+        e.mov64(rcx, x64_mem{RV_JIT_CPU, i == 0 ? jit_.tlb_load_offset_ : jit_.tlb_store_offset_});
+        e.alu(x64_alu::cmp, rax, x64_mem{rcx, (int32_t)offsetof(rv_tlb_entry, tag), rdx, 0});
+        jump(bail(b), e.jcc(x64_cond::ne));
+    }
+    e.mov64(RV_TRACE_GROUP, x64_mem{rcx, (int32_t)offsetof(rv_tlb_entry, data), rdx, 0});
+    group_live_ = true;
+}
+
+// the block's last instruction, and on along the path or off it
+void rv_trace_emitter::emit_end(uint32_t b)
+{
+    auto& e = *e_;
+    auto& block = *blocks_[b];
+    const uint32_t index = starts_[b + 1] - 1;
+    const auto& info = insns_[index];
+    const auto& insn = *info.insn;
+    const rv_uint next = b + 1 < blocks_.size() ? blocks_[b + 1]->pc : loops_ ? blocks_[0]->pc : RV_BLOCK_NO_EXIT;
+    const uint32_t retired = starts_[b + 1];
+
+    if (insn.op == rv_op::jal) {
+        write(info, info.pc + 4);
+        propagate(index);
+        if (block.is_call && !block.paged)
+            jit_.emit_ras_push(e, block);
+        if (block.exit_pc[0] != next)
+            jump(stub(stub_kind::exit, retired, block.exit_pc[0], b, 0), e.jmp());
+        return;
+    }
+    if (!is_branch(insn.op)) {
+        emit_insn(index);
+        if (block.exit_pc[1] != next)
+            jump(stub(stub_kind::exit, retired, block.exit_pc[1], b, 1), e.jmp());
+        return;
+    }
+
+    const rv_uint taken = block.exit_pc[0];
+    const rv_uint fall = block.exit_pc[1];
+    if (taken == fall || (known(insn.rs1) && known(insn.rs2))) {
+        const size_t slot = taken == fall || branch_taken(insn.op, values_[insn.rs1], values_[insn.rs2]) ? 0 : 1;
+        if (block.exit_pc[slot] != next)
+            jump(stub(stub_kind::exit, retired, block.exit_pc[slot], b, slot), e.jmp());
+        return;
+    }
+
+    auto lhs = x64_reg::rax;
+    if (!known(insn.rs1) && hosts_[insn.rs1] != RV_TRACE_MEMORY)
+        lhs = hosts_[insn.rs1];
+    else
+        read(lhs, insn.rs1);
+    alu(x64_alu::cmp, lhs, insn.rs2);
+    const auto cc = rv_jit::branch_cond(insn.op);
+    if (next == taken) {
+        jump(stub(stub_kind::exit, retired, fall, b, 1), e.jcc((x64_cond)((uint8_t)cc ^ 1)));
+    }
+    else if (next == fall) {
+        jump(stub(stub_kind::exit, retired, taken, b, 0), e.jcc(cc));
+    }
+    else {
+        jump(stub(stub_kind::exit, retired, taken, b, 0), e.jcc(cc));
+        jump(stub(stub_kind::exit, retired, fall, b, 1), e.jmp());
+    }
+}
+
+void rv_trace_emitter::emit_insn(uint32_t index)
+{
+    const auto& info = insns_[index];
+    const auto& insn = *info.insn;
+    const auto rax = x64_reg::rax;
+    const auto rcx = x64_reg::rcx;
+    auto& e = *e_;
+
+    if (!is_native(insn.op)) {
+        emit_interpreted(index);
+        propagate(index);
+        return;
+    }
+    if (is_load(insn.op)) {
+        emit_load(index);
+        propagate(index);
+        return;
+    }
+    if (is_store(insn.op)) {
+        emit_store(index);
+        return;
+    }
+
+    rv_uint value;
+    if (fold(info, value)) {
+        write(info, value);
+        propagate(index);
+        return;
+    }
+    if (insn.rd == 0 || info.dead) {
+        propagate(index);
+        return;
+    }
+
+    switch (insn.op) {
+    case rv_op::addi:
+    case rv_op::xori:
+    case rv_op::ori:
+    case rv_op::andi: {
+        const auto op = insn.op == rv_op::addi ? x64_alu::add :
+                        insn.op == rv_op::xori ? x64_alu::xor_ :
+                        insn.op == rv_op::ori ? x64_alu::or_ : x64_alu::and_;
+        const auto dst = result(info, 0);
+        read(dst, insn.rs1);
+        if (insn.imm != 0 || insn.op == rv_op::andi)
+            e.alu(op, dst, insn.imm);
+        write(info, dst);
+        break;
+    }
+    case rv_op::slti:
+    case rv_op::sltiu:
+    case rv_op::slt:
+    case rv_op::sltu: {
+        auto lhs = rcx;
+        if (!known(insn.rs1) && hosts_[insn.rs1] != RV_TRACE_MEMORY)
+            lhs = hosts_[insn.rs1];
+        else
+            read(lhs, insn.rs1);
+        e.alu(x64_alu::xor_, rax, rax);
+        if (insn.op == rv_op::slti || insn.op == rv_op::sltiu)
+            e.alu(x64_alu::cmp, lhs, insn.imm);
+        else
+            alu(x64_alu::cmp, lhs, insn.rs2);
+        e.setcc(insn.op == rv_op::slti || insn.op == rv_op::slt ? x64_cond::l : x64_cond::b, rax);
+        write(info, rax);
+        break;
+    }
+    case rv_op::slli:
+    case rv_op::srli:
+    case rv_op::srai:
+    case rv_op::sll:
+    case rv_op::srl:
+    case rv_op::sra: {
+        const auto op = insn.op == rv_op::slli || insn.op == rv_op::sll ? x64_shift::shl :
+                        insn.op == rv_op::srli || insn.op == rv_op::srl ? x64_shift::shr : x64_shift::sar;
+        const bool by_imm = insn.op <= rv_op::srai || known(insn.rs2);
+        const uint32_t amount = (insn.op <= rv_op::srai ? (rv_uint)insn.imm : values_[insn.rs2]) & 0x1F;
+        // the amount is in cl before the result is written
+        if (!by_imm)
+            read(rcx, insn.rs2);
+        const auto dst = result(info, 0);
+        read(dst, insn.rs1);
+        if (!by_imm)
+            e.shift_cl(op, dst);
+        else if (amount != 0)
+            e.shift(op, dst, (uint8_t)amount);
+        write(info, dst);
+        break;
+    }
+    case rv_op::add:
+    case rv_op::sub:
+    case rv_op::xor_:
+    case rv_op::or_:
+    case rv_op::and_: {
+        const auto op = insn.op == rv_op::add ? x64_alu::add :
+                        insn.op == rv_op::sub ? x64_alu::sub :
+                        insn.op == rv_op::xor_ ? x64_alu::xor_ :
+                        insn.op == rv_op::or_ ? x64_alu::or_ : x64_alu::and_;
+        const auto dst = result(info, insn.rs2);
+        read(dst, insn.rs1);
+        alu(op, dst, insn.rs2);
+        write(info, dst);
+        break;
+    }
+    case rv_op::mul: {
+        const auto dst = result(info, insn.rs2);
+        read(dst, insn.rs1);
+        imul(dst, insn.rs2);
+        write(info, dst);
+        break;
+    }
+    case rv_op::mulh:
+    case rv_op::mulhsu:
+    case rv_op::mulhu:
+        read(rax, insn.rs1);
+        read(rcx, insn.rs2);
+        if (insn.op != rv_op::mulhu)
+            e.movsxd(rax, rax);
+        if (insn.op == rv_op::mulh)
+            e.movsxd(rcx, rcx);
+        e.imul64(rax, rcx);
+        e.shift64(x64_shift::shr, rax, 32);
+        write(info, rax);
+        break;
+    case rv_op::div:
+    case rv_op::divu:
+    case rv_op::rem:
+    case rv_op::remu:
+        emit_div(index);
+        break;
+    default:
+        break;
+    }
+    propagate(index);
+}
+
+// a fused div/rem writes both results
+void rv_trace_emitter::emit_div(uint32_t index)
+{
+    const auto& info = insns_[index];
+    const auto& insn = *info.insn;
+    const bool is_signed = insn.op == rv_op::div || insn.op == rv_op::rem;
+    const bool is_rem = insn.op == rv_op::rem || insn.op == rv_op::remu;
+    const auto rax = x64_reg::rax;
+    const auto rcx = x64_reg::rcx;
+    const auto rdx = x64_reg::rdx;
+    auto& e = *e_;
+
+    read(rax, insn.rs1);
+    read(rcx, insn.rs2);
+    const bool by_zero = !known(insn.rs2) || values_[insn.rs2] == 0;
+    const bool overflow = is_signed && (!known(insn.rs2) || values_[insn.rs2] == (rv_uint)-1);
+    size_t zero = 0;
+    if (by_zero) {
+        e.test(rcx, rcx);
+        zero = e.jcc(x64_cond::e);
+    }
+    size_t min = 0;
+    if (overflow) {
+        // INT_MIN / -1 would trap on x86, the quotient is INT_MIN and the remainder 0
+        e.alu(x64_alu::cmp, rcx, -1);
+        const auto no_overflow = e.jcc(x64_cond::ne);
+        e.alu(x64_alu::xor_, rdx, rdx);
+        e.alu(x64_alu::cmp, rax, INT32_MIN);
+        min = e.jcc(x64_cond::e);
+        e.bind(no_overflow);
+    }
+    if (is_signed) {
+        e.cdq();
+        e.idiv(rcx);
+    }
+    else {
+        e.alu(x64_alu::xor_, rdx, rdx);
+        e.div(rcx);
+    }
+    if (by_zero) {
+        // quotient all ones, remainder the dividend
+        const auto done = e.jmp();
+        e.bind(zero);
+        e.mov(rdx, rax);
+        e.mov(rax, (uint32_t)-1);
+        e.bind(done);
+    }
+    if (overflow)
+        e.bind(min);
+
+    if (info.fused) {
+        write(info, rax);
+        write(insns_[index + 1], rdx);
+    }
+    else {
+        write(info, is_rem ? rdx : rax);
+    }
+}
+
+// effective address in esi, the upper half of rsi cleared
+void rv_trace_emitter::emit_address(const rv_decoded_insn& insn)
+{
+    if (known(insn.rs1)) {
+        e_->mov(x64_reg::rsi, values_[insn.rs1] + (rv_uint)insn.imm);
+        return;
+    }
+    read(x64_reg::rsi, insn.rs1);
+    if (insn.imm != 0)
+        e_->alu(x64_alu::add, x64_reg::rsi, insn.imm);
+}
+
+void rv_trace_emitter::emit_load(uint32_t index)
+{
+    static const void *const helpers[] = {
+        (const void *)&rv_jit::load<int8_t>, (const void *)&rv_jit::load<int16_t>, (const void *)&rv_jit::load<int32_t>,
+        (const void *)&rv_jit::load<uint8_t>, (const void *)&rv_jit::load<uint16_t>
+    };
+    const auto& info = insns_[index];
+    const auto& insn = *info.insn;
+    const auto rax = x64_reg::rax;
+    const auto rcx = x64_reg::rcx;
+    const size_t n = (size_t)insn.op - (size_t)rv_op::lb;
+    auto& e = *e_;
+
+    emit_address(insn);
+    size_t miss = 0;
+    x64_mem host{RV_JIT_GUEST_BASE, 0, x64_reg::rsi, 0};
+    if (info.grouped) {
+        host.base = RV_TRACE_GROUP;
+    }
+    else if (!direct_) {
+        miss = jit_.emit_tlb_lookup(e, jit_.tlb_load_offset_, access_size(insn.op));
+        e.mov64(rcx, x64_mem{rcx, (int32_t)offsetof(rv_tlb_entry, data)});
+        host.base = rcx;
+    }
+    const auto site = e.size();
+    switch (insn.op) {
+    case rv_op::lb: e.movsx8(rax, host); break;
+    case rv_op::lh: e.movsx16(rax, host); break;
+    case rv_op::lbu: e.movzx8(rax, host); break;
+    case rv_op::lhu: e.movzx16(rax, host); break;
+    default: e.mov(rax, host); break;
+    }
+
+    if (!info.grouped) {
+        const auto done = e.jmp();
+        if (direct_)
+            guard_sites_.emplace_back((uint32_t)site, (uint32_t)e.size());
+        else
+            e.bind(miss);
+        emit_helper(helpers[n]);
+        e.test64(rax, rax);
+        jump(stub(stub_kind::fault, index, info.pc, info.block), e.jcc(x64_cond::s));
+        e.bind(done);
+    }
+    write(info, rax);
+}
+
+void rv_trace_emitter::emit_store(uint32_t index)
+{
+    static const void *const helpers[] = {
+        (const void *)&rv_jit::store<uint8_t>, (const void *)&rv_jit::store<uint16_t>,
+        (const void *)&rv_jit::store<uint32_t>
+    };
+    const auto& info = insns_[index];
+    const auto& insn = *info.insn;
+    const auto rax = x64_reg::rax;
+    const auto rcx = x64_reg::rcx;
+    const auto rdx = x64_reg::rdx;
+    const size_t n = (size_t)insn.op - (size_t)rv_op::sb;
+    auto& e = *e_;
+
+    emit_address(insn);
+    size_t miss = 0;
+    x64_mem host{RV_JIT_GUEST_BASE, 0, x64_reg::rsi, 0};
+    if (info.grouped) {
+        host.base = RV_TRACE_GROUP;
+    }
+    else if (!direct_) {
+        miss = jit_.emit_tlb_lookup(e, jit_.tlb_store_offset_, access_size(insn.op));
+        e.mov64(rcx, x64_mem{rcx, (int32_t)offsetof(rv_tlb_entry, data)});
+        host.base = rcx;
+    }
+    auto value = rdx;
+    if (!known(insn.rs2) && hosts_[insn.rs2] != RV_TRACE_MEMORY)
+        value = hosts_[insn.rs2];
+    else
+        read(rdx, insn.rs2);
+    const auto site = e.size();
+    switch (insn.op) {
+    case rv_op::sb: e.mov8(host, value); break;
+    case rv_op::sh: e.mov16(host, value); break;
+    default: e.mov(host, value); break;
+    }
+    if (info.grouped)
+        return;
+
+    // code pages and devices never hit (or fault in the guest window), the helper reports writes to code
+    const auto done = e.jmp();
+    if (direct_)
+        guard_sites_.emplace_back((uint32_t)site, (uint32_t)e.size());
+    else
+        e.bind(miss);
+    read(rdx, insn.rs2);
+    emit_helper(helpers[n]);
+    e.test8(rax, rax);
+    jump(stub(stub_kind::fault, index, info.pc, info.block), e.jcc(x64_cond::e));
+    emit_stale_check(index);
+    e.bind(done);
+}
+
+// the handler works on the registers in rv_cpu
+void rv_trace_emitter::emit_interpreted(uint32_t index)
+{
+    const auto& info = insns_[index];
+    const auto& insn = *info.insn;
+    auto& e = *e_;
+
+    writeback();
+    e.mov(jit_.pc(), info.pc);
+    e.mov64(x64_reg::rsi, (uint64_t)&insn);
+    emit_helper((const void *)insn.handler);
+    if ((rv_op_flags(insn.op) & RV_OPF_TRAP) != 0) {
+        e.cmp8(jit_.exception_raised(), 0);
+        jump(stub(stub_kind::fault, index, info.pc, info.block), e.jcc(x64_cond::ne));
+    }
+    if (writes(insn) != 0 && hosts_[insn.rd] != RV_TRACE_MEMORY)
+        e.mov(hosts_[insn.rd], jit_.reg(insn.rd));
+    emit_stale_check(index);
+}
+
+// the call preserves the caller saved host registers in use, on a 16 byte aligned stack
+void rv_trace_emitter::emit_helper(const void *fn)
+{
+    auto& e = *e_;
+    auto saved = caller_saved_;
+    if (group_live_)
+        saved.push_back(RV_TRACE_GROUP);
+    for (auto r: saved)
+        e.push(r);
+    if (saved.size() % 2 != 0)
+        e.alu64(x64_alu::sub, x64_reg::rsp, 8);
+    jit_.emit_call(e, fn);
+    if (saved.size() % 2 != 0)
+        e.alu64(x64_alu::add, x64_reg::rsp, 8);
+    for (auto r = saved.rbegin(); r != saved.rend(); ++r)
+        e.pop(*r);
+}
+
+// a write to the trace's own code kills its head, nothing after the instruction may run
+void rv_trace_emitter::emit_stale_check(uint32_t index)
+{
+    const auto& info = insns_[index];
+    auto& e = *e_;
+    e.mov64(x64_reg::rax, (uint64_t)&blocks_[0]->dead);
+    e.cmp8(x64_mem{x64_reg::rax, 0}, 0);
+    jump(stub(stub_kind::stale, index + 1, info.pc + 4, info.block), e.jcc(x64_cond::ne));
+}
+
+void rv_trace_emitter::emit_stub(const exit_stub& stub)
+{
+    const auto rcx = x64_reg::rcx;
+    const auto rdx = x64_reg::rdx;
+    auto& e = *e_;
+
+    writeback();
+    const auto refund = (uint32_t)insns_.size() - stub.retired;
+    if (refund != 0)
+        e.alu64(x64_alu::add, RV_TRACE_BUDGET, (int32_t)refund);
+    e.mov64(jit_.budget(), RV_TRACE_BUDGET);
+
+    switch (stub.kind) {
+    case stub_kind::fault:
+    case stub_kind::stale:
+        e.mov(jit_.pc(), stub.pc);
+        e.jmp(jit_.epilogue_);
+        break;
+    case stub_kind::bail:
+        e.jmp((const uint8_t *)entries_[stub.block]);
+        break;
+    case stub_kind::exit: {
+        // chained like a linked static exit, through whatever code the successor has by then
+        auto& block = *blocks_[stub.block];
+        e.mov64(rdx, (uint64_t)&block);
+        if (rv_block_cache::can_link(block, stub.pc)) {
+            e.mov64(rcx, x64_mem{rdx, jit_.block_exit_offset_ + (int32_t)(stub.slot * sizeof(rv_block*))});
+            e.test64(rcx, rcx);
+            const auto unlinked = e.jcc(x64_cond::e);
+            e.mov64(rcx, x64_mem{rcx, jit_.block_native_offset_});
+            e.test64(rcx, rcx);
+            const auto interpreted = e.jcc(x64_cond::e);
+            e.jmp(rcx);
+            e.bind(unlinked);
+            e.bind(interpreted);
+        }
+        e.mov(jit_.pc(), stub.pc);
+        e.mov64(jit_.exit_block(), rdx);
+        e.jmp(jit_.epilogue_);
+        break;
+    }
+    }
+}
+
+void rv_jit::compile_trace(const std::vector<rv_block*>& blocks, bool loops)
+{
+    for (auto block: blocks)
+        block->traced = true;
+    if (code_ == nullptr)
+        return;
+    for (auto block: blocks) {
+        if (block->dead || block->native == nullptr)
+            return;
+    }
+
+    auto trace = std::make_unique<trace_job>();
+    trace->blocks = blocks;
+    for (auto block: blocks)
+        trace->entries.push_back(block->native_block != nullptr ? block->native_block : block->native);
+    trace->loops = loops;
+    // the blocks keep running as they are until the trace is installed
+    if (compile_thread_) {
+        queue(*trace);
+        traces_.push_back(std::move(trace));
+        return;
+    }
+    rv_jit_code code;
+    emit_trace(*trace, code);
+    install_trace(*blocks[0], code);
+}
+
+void rv_jit::install_traces()
+{
+    for (size_t i = 0; i < traces_.size(); ) {
+        auto& trace = *traces_[i];
+        auto& head = *trace.blocks[0];
+        std::unique_ptr<rv_jit_code> code{head.compiled.exchange(nullptr, std::memory_order_acquire)};
+        if (code == nullptr) {
+            // dropped by a fork, the child's compile thread gets it again
+            if (!trace.queued)
+                queue(trace);
+            ++i;
+            continue;
+        }
+        // invalidated blocks are still there until drained, only their trace goes
+        const bool dead = std::any_of(trace.blocks.begin(), trace.blocks.end(), [](const rv_block *block) { return block->dead; });
+        traces_.erase(traces_.begin() + i);
+        // a flush empties traces_
+        if (!dead)
+            install_trace(head, *code);
+    }
+}
+
+void rv_jit::emit_trace(const trace_job& job, rv_jit_code& code)
+{
+    rv_trace_emitter trace{*this, job.blocks, job.entries, job.loops};
+    x64_emitter e{code_ + used_, size_ - used_};
+    trace.emit(e);
+    if (e.overflow())
+        return;
+
+    code.code = e.code();
+    for (const auto& site: trace.guard_sites())
+        code.guard_sites.emplace_back((uint32_t)used_ + site.first, (uint32_t)used_ + site.second);
+    code.trace_begin = trace.begin();
+    code.trace_end = trace.end();
+    used_ = (used_ + e.size() + 15) & ~15;
+}
+
+void rv_jit::install_trace(rv_block& head, const rv_jit_code& code)
+{
+    if (code.code == nullptr) {
+        // out of space, blocks are compiled (and traced) again from scratch
+        flush();
+        return;
+    }
+    add_guard_sites(code.guard_sites);
+    head.native_block = head.native;
+    head.native = code.code;
+    head.trace_begin = code.trace_begin;
+    head.trace_end = code.trace_end;
+    cpu_.blocks_.link_native(head);
+}
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <cstring>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "rv_machine.hpp"
@@ -8,98 +9,635 @@
 #include <limits>
 #include <thread>
 #include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <functional>
 
-rv_machine::rv_machine()
-    : memory_{16_MiB}, cpu_{memory_}
+rv_machine::hart::hart(rv_memory& memory, rv_event_queue& events, rv_uint hartid)
+    : cpu{memory, events, hartid}, wake_fd{-1}
 {
+}
+
+rv_machine::hart::~hart()
+{
+    if (wake_fd >= 0)
+        close(wake_fd);
+}
+
+rv_machine::rv_machine(size_t hart_count, size_t ram_size, bool guard_pages)
+    : memory_{ram_size, guard_pages}, io_fd_{-1}, console_in_{STDIN_FILENO}, console_out_{STDOUT_FILENO}
+{
+    using namespace std::placeholders;
+
+    for (size_t i = 0; i < std::max<size_t>(hart_count, 1); ++i) {
+        harts_.push_back(std::make_unique<hart>(memory_, events_, (rv_uint)i));
+        clint_.attach_hart(std::bind(&rv_machine::update_mip, this, std::ref(*harts_.back()), _1, _2));
+    }
+
+    memory_.attach(&clint_);
     memory_.attach(&uart0_);
     plic_.attach(&uart0_, 1);
+    uart0_.set_host_notify(std::bind(&rv_machine::notify_io, this));
+    memory_.attach(&control_);
+    control_.set_exit(std::bind(&rv_machine::guest_exit, this, _1));
+    control_.set_fork_point(std::bind(&rv_machine::fork_point, this));
+    budget_event_ = events_.add(std::bind(&rv_machine::halt, this, rv_stop_reason::budget));
+
+    // external interrupts only go to the first hart
+    plic_.connect_irq(std::bind(&rv_machine::update_mip, this, std::ref(*harts_[0]), _1, _2), 11);
+    clint_.reset();
+    for (auto& h: harts_)
+        h->cpu.reset();
+}
+
+rv_machine::~rv_machine()
+{
+    if (io_fd_ >= 0)
+        close(io_fd_);
+}
+
+void rv_machine::open_wake_fds()
+{
+    if (io_fd_ < 0 && (io_fd_ = eventfd(0, EFD_NONBLOCK)) < 0)
+        throw std::runtime_error("eventfd failed");
+    for (auto& h: harts_) {
+        if (h->wake_fd < 0 && (h->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+            throw std::runtime_error("eventfd failed");
+    }
+}
 
-    plic_.connect_irq(std::bind(&rv_cpu::update_mip, &cpu_, std::placeholders::_1, std::placeholders::_2), 11);
-    cpu_.reset();
+void rv_machine::update_mip(hart& h, uint32_t irq_num, bool state)
+{
+    h.cpu.update_mip(irq_num, state);
+    // sleeping is set before the hart checks its pending interrupts a last time, no wake up gets lost
+    if (state && h.sleeping.load())
+        wake(h);
+}
+
+void rv_machine::wake(hart& h)
+{
+    if (h.wake_fd < 0)
+        return;
+    const uint64_t one = 1;
+    (void)!write(h.wake_fd, &one, sizeof(one));
+}
+
+void rv_machine::wait_for_interrupt(hart& h)
+{
+    // nobody else advances virtual time, the last hart to stop moves it to the next deadline
+    if (idle_harts_.fetch_add(1) + 1 == harts_.size() && events_.skip_to_next()) {
+        idle_harts_.fetch_sub(1);
+        return;
+    }
+
+    h.sleeping.store(true);
+    const bool devices = &h == harts_[0].get() && device_pending_.load() != 0;
+    if (h.cpu.idle() && !devices && running_.load()) {
+        pollfd fd{ h.wake_fd, POLLIN, 0 };
+        poll(&fd, 1, -1);
+
+        uint64_t count;
+        (void)!read(h.wake_fd, &count, sizeof(count));
+    }
+    h.sleeping.store(false);
+    idle_harts_.fetch_sub(1);
 }
 
 void rv_machine::loadBinary(const std::string& filename)
 {
-    struct stat st;
-    if (stat(filename.c_str(), &st) < 0)
-        throw std::runtime_error("stat failed");
+    if (rv_elf::is_elf(filename)) {
+        image_ = std::make_unique<rv_elf>(filename);
+        if (!image_->load(memory_))
+            throw std::runtime_error("ELF segments don't fit in RAM");
+        for (auto& h: harts_)
+            h->cpu.set_pc(image_->entry());
+        return;
+    }
 
-    FILE *f = fopen(filename.c_str(), "r");
-    if (f == nullptr)
+    const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
         throw std::runtime_error("file not found");
-    
-    std::vector<uint8_t> buf(st.st_size);
-    fread(buf.data(), sizeof(uint8_t), st.st_size, f);
-    fclose(f);
-
-    memory_.load(0x1000, buf.data(), buf.size());
-}
-
-void rv_machine::process_devices()
-{
-    fd_set rfds;
-    struct timeval tv;
-    std::array<uint8_t, 32> buf;
-
-    // update uart0, used as "terminal" here
-    if (uart0_.can_write()) {
-        FD_ZERO(&rfds);
-        FD_SET(STDIN_FILENO, &rfds);
-        tv.tv_sec = 0;
-        tv.tv_usec = 0;
-        int res = select(STDIN_FILENO + 1, &rfds, nullptr, nullptr, &tv);
-        if (res > 0 && FD_ISSET(STDIN_FILENO, &rfds)) {
-            size_t l = std::min(uart0_.write_len(), buf.size());
-            ssize_t bytes_read = read(STDIN_FILENO, buf.data(), l);
+    struct stat st;
+    const bool loaded = fstat(fd, &st) == 0 && memory_.load_file(0x1000, fd, 0, st.st_size);
+    close(fd);
+    if (!loaded)
+        throw std::runtime_error("binary doesn't fit in RAM");
+    image_.reset();
+}
+
+void rv_machine::set_tiers(const rv_tier_config& tiers)
+{
+    for (auto& h: harts_)
+        h->cpu.set_tiers(tiers);
+}
+
+void rv_machine::set_budget(uint64_t instructions)
+{
+    events_.schedule(budget_event_, instructions != 0 ? events_.now() + instructions : RV_EVENT_NEVER);
+}
+
+void rv_machine::halt(rv_stop_reason reason)
+{
+    auto none = rv_stop_reason::none;
+    stop_reason_.compare_exchange_strong(none, reason);
+    running_ = false;
+    for (auto& h: harts_) {
+        h->cpu.request_exit();
+        wake(*h);
+    }
+    {
+        std::lock_guard<std::mutex> lock{stop_lock_};
+    }
+    stopped_.notify_all();
+}
+
+void rv_machine::guest_exit(uint32_t code)
+{
+    exit_code_ = code;
+    halt(rv_stop_reason::exited);
+}
+
+void rv_machine::fork_point()
+{
+    // like everything stopping a hart, this takes effect at the end of its block,
+    // the jobs resume from there
+    if (!forked_)
+        halt(rv_stop_reason::fork_point);
+}
+
+static void write_all(int fd, const uint8_t *data, size_t len)
+{
+    while (len != 0) {
+        const ssize_t written = write(fd, data, len);
+        if (written > 0) {
+            data += written;
+            len -= written;
+        }
+        else if (errno == EAGAIN) {
+            // the output may have been made non-blocking by someone else
+            pollfd fd_out{ fd, POLLOUT, 0 };
+            poll(&fd_out, 1, -1);
+        }
+        else if (errno != EINTR) {
+            return;
+        }
+    }
+}
+
+bool rv_machine::fork_server(const std::function<bool(rv_job&)>& next_job,
+                             const std::function<void(const rv_job&, const rv_job_result&)>& done)
+{
+    if (memory_.guest_base() != nullptr)
+        throw std::runtime_error("guard page RAM can't be forked");
+
+    run();
+    if (stop_reason_ != rv_stop_reason::fork_point)
+        return false;
+
+    // what the job reports back, anything else is lost with its address space
+    struct report
+    {
+        rv_stop_reason reason;
+        uint32_t exit_code;
+        uint64_t instructions;
+        rv_chain_stats chain;
+    };
+    auto shared = (report *)mmap(nullptr, sizeof(report), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        throw std::runtime_error("mmap failed");
+
+    rv_job job;
+    while (next_job(job)) {
+        // the job's console output, written by the job before it exits
+        const int out_fd = memfd_create("rv-output", MFD_CLOEXEC);
+        *shared = { rv_stop_reason::crashed, 0, 0, {} };
+        const pid_t pid = out_fd >= 0 ? fork() : -1;
+        if (pid == 0) {
+            // only this thread made it into the child, run() starts the others again
+            forked_ = true;
+            rv_job_result result;
+            run_job(job, result);
+            write_all(out_fd, (const uint8_t *)result.output.data(), result.output.size());
+            *shared = { result.reason, result.exit_code, result.instructions, result.chain };
+            _exit(0);
+        }
+
+        int status = 0;
+        if (pid > 0) {
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+                ;
+        }
+        rv_job_result result;
+        struct stat st;
+        if (pid > 0 && fstat(out_fd, &st) == 0) {
+            result.output.resize(st.st_size);
+            result.output.resize(std::max<ssize_t>(pread(out_fd, &result.output[0], st.st_size, 0), 0));
+        }
+        if (out_fd >= 0)
+            close(out_fd);
+        if (pid < 0) {
+            munmap(shared, sizeof(report));
+            throw std::runtime_error("can't fork a job");
+        }
+
+        const bool reported = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        result.reason = reported ? shared->reason : rv_stop_reason::crashed;
+        result.exit_code = reported ? shared->exit_code : 0;
+        result.instructions = reported ? shared->instructions : 0;
+        result.chain = reported ? shared->chain : rv_chain_stats{};
+        done(job, result);
+    }
+    munmap(shared, sizeof(report));
+    return true;
+}
+
+void rv_machine::run_job(const rv_job& job, rv_job_result& result)
+{
+    job_console_ = true;
+    job_input_ = job.input;
+    job_input_done_ = 0;
+    job_output_.clear();
+    // uart0 may have been enabled before, hart 0 raises its interrupt for the input first thing
+    move_job_console();
+    device_pending_.fetch_or(RV_DEVICE_UART0);
+
+    set_budget(job.budget);
+    const auto start = events_.now();
+    const auto chain = chain_stats();
+    run();
+    job_console_ = false;
+    result.reason = stop_reason_;
+    result.exit_code = result.reason == rv_stop_reason::exited ? exit_code_ : 0;
+    result.instructions = events_.now() - start;
+    result.chain = chain_stats();
+    result.chain -= chain;
+    result.output = std::move(job_output_);
+}
+
+rv_chain_stats rv_machine::chain_stats() const
+{
+    rv_chain_stats total;
+    for (auto& h: harts_)
+        total += h->cpu.chain_stats();
+    return total;
+}
+
+void rv_machine::save_state(rv_snapshot_writer& state)
+{
+    for (auto& h: harts_)
+        h->cpu.save(state);
+    events_.save(state);
+    for (auto device: devices())
+        device->save(state);
+}
+
+bool rv_machine::restore_state(rv_snapshot_reader& state)
+{
+    // harts first, devices then drive their interrupt lines again with the state they had
+    bool restored = true;
+    for (auto& h: harts_)
+        restored = restored && h->cpu.restore(state);
+    restored = restored && events_.restore(state);
+    for (auto device: devices())
+        restored = restored && device->restore(state);
+    device_pending_ = 0;
+    exit_code_ = 0;
+    return restored;
+}
+
+void rv_machine::set_baseline()
+{
+    rv_snapshot_writer state;
+    save_state(state);
+    baseline_ = state.data();
+    memory_.set_baseline();
+}
+
+size_t rv_machine::reset_to_baseline()
+{
+    if (baseline_.empty())
+        throw std::runtime_error("no baseline set");
+
+    rv_snapshot_reader state{baseline_.data(), baseline_.size()};
+    if (!restore_state(state))
+        throw std::runtime_error("baseline doesn't match the machine");
+    return memory_.reset_to_baseline();
+}
+
+void rv_machine::snapshot(const std::string& path)
+{
+    rv_snapshot_writer state;
+    save_state(state);
+
+    rv_snapshot_header header{};
+    memcpy(header.magic, RV_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = RV_SNAPSHOT_VERSION;
+    header.harts = harts_.size();
+    header.ram_size = memory_.ram_size();
+    header.state_size = state.data().size();
+    // page aligned so RAM can be mapped from the file
+    header.ram_offset = (sizeof(header) + header.state_size + RV_MEMORY_PAGE_MASK) & ~(uint64_t)RV_MEMORY_PAGE_MASK;
+
+    // written next to the old one and renamed over it, a failed snapshot doesn't destroy it
+    const auto tmp_path = path + ".tmp";
+    const int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw std::runtime_error("can't create snapshot file");
+
+    auto write_at = [fd](const void *data, size_t len, off_t offset) {
+        for (size_t done = 0; done < len; ) {
+            const ssize_t n = pwrite(fd, (const uint8_t *)data + done, len - done, offset + done);
+            if (n <= 0)
+                return false;
+            done += n;
+        }
+        return true;
+    };
+    const bool written = write_at(&header, sizeof(header), 0) &&
+                         write_at(state.data().data(), header.state_size, sizeof(header)) &&
+                         memory_.save_file(RV_MEMORY_RAM_BEGIN, fd, header.ram_offset, header.ram_size) &&
+                         ftruncate(fd, header.ram_offset + header.ram_size) == 0;
+    if (close(fd) != 0 || !written || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        throw std::runtime_error("can't write snapshot file");
+    }
+}
+
+void rv_machine::restore(const std::string& path)
+{
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("snapshot file not found");
+
+    rv_snapshot_header header;
+    struct stat st;
+    const bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) && fstat(fd, &st) == 0 &&
+                       memcmp(header.magic, RV_SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 &&
+                       header.version == RV_SNAPSHOT_VERSION &&
+                       header.state_size <= header.ram_offset &&
+                       (header.ram_offset & RV_MEMORY_PAGE_MASK) == 0 &&
+                       header.ram_offset + header.ram_size <= (uint64_t)st.st_size;
+    if (!valid) {
+        close(fd);
+        throw std::runtime_error("not a snapshot file");
+    }
+    if (header.harts != harts_.size() || header.ram_size != memory_.ram_size()) {
+        close(fd);
+        throw std::runtime_error("snapshot taken with a different number of harts or RAM size");
+    }
+
+    std::vector<uint8_t> data(header.state_size);
+    if (pread(fd, data.data(), data.size(), sizeof(header)) != (ssize_t)data.size()) {
+        close(fd);
+        throw std::runtime_error("can't read snapshot file");
+    }
+
+    rv_snapshot_reader state{data.data(), data.size()};
+    bool restored = restore_state(state);
+
+    // every hart drops its code, the code pages don't need to be watched any more
+    // and mapping the new RAM doesn't have to invalidate anything
+    for (auto& h: harts_)
+        h->cpu.flush_code();
+    memory_.clear_code_pages();
+    restored = restored && memory_.load_file(RV_MEMORY_RAM_BEGIN, fd, header.ram_offset, header.ram_size);
+    close(fd);
+    if (!restored)
+        throw std::runtime_error("snapshot doesn't match the machine");
+}
+
+void rv_machine::notify_io()
+{
+    if (job_console_) {
+        move_job_console();
+        return;
+    }
+
+    // the fifo update must be visible before looking at the flag, the I/O thread
+    // sets it before checking the fifos a last time
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (io_sleeping_.load(std::memory_order_relaxed)) {
+        const uint64_t one = 1;
+        (void)!write(io_fd_, &one, sizeof(one));
+    }
+}
+
+void rv_machine::move_job_console()
+{
+    std::array<uint8_t, 256> buf;
+    size_t len;
+    while ((len = uart0_.host_read(buf.data(), buf.size())) != 0)
+        job_output_.append((const char *)buf.data(), len);
+    job_input_done_ += uart0_.host_write((const uint8_t *)job_input_.data() + job_input_done_,
+                                         job_input_.size() - job_input_done_);
+}
+
+void rv_machine::io_loop()
+{
+    // input is only read once poll says it's readable, the descriptor stays blocking,
+    // it may well be shared with other machines or processes
+    // regular files (and /dev/null) always poll readable, until read returns 0 at their end
+    bool stdin_open = console_in_ >= 0;
+    bool stdin_ready = false;
+
+    std::array<uint8_t, 256> buf;
+    while (running_.load(std::memory_order_relaxed)) {
+        bool moved = false;
+
+        size_t len;
+        while ((len = uart0_.host_read(buf.data(), buf.size())) != 0) {
+            write_all(console_out_, buf.data(), len);
+            moved = true;
+        }
+
+        len = std::min(uart0_.host_write_len(), buf.size());
+        if (stdin_open && stdin_ready && len != 0) {
+            const ssize_t bytes_read = read(console_in_, buf.data(), len);
+            stdin_ready = false;
             if (bytes_read > 0) {
-                uart0_.write_data(buf.data(), bytes_read);
+                uart0_.host_write(buf.data(), bytes_read);
+                moved = true;
+            }
+            else if (bytes_read == 0 || (errno != EINTR && errno != EAGAIN)) {
+                // nothing more to come
+                stdin_open = false;
             }
         }
+
+        if (moved) {
+            // fifo levels changed, hart 0 updates the interrupts at its next block boundary
+            auto& h = *harts_[0];
+            device_pending_.fetch_or(RV_DEVICE_UART0);
+            h.cpu.request_exit();
+            if (h.sleeping.load())
+                wake(h);
+            continue;
+        }
+
+        io_sleeping_.store(true);
+        // input is only waited for while uart0 has room for it
+        const bool want_input = stdin_open && uart0_.host_write_len() != 0;
+        if (!(want_input && stdin_ready) && !uart0_.host_can_read() && running_.load()) {
+            pollfd fds[2] = { { io_fd_, POLLIN, 0 }, { console_in_, POLLIN, 0 } };
+            if (poll(fds, want_input ? 2 : 1, -1) > 0) {
+                if ((fds[0].revents & POLLIN) != 0) {
+                    uint64_t count;
+                    (void)!read(io_fd_, &count, sizeof(count));
+                }
+                // a hang up or error is seen by the read
+                if (want_input && fds[1].revents != 0)
+                    stdin_ready = true;
+            }
+        }
+        io_sleeping_.store(false);
+    }
+
+    // whatever the guest wrote before stopping
+    size_t len;
+    while ((len = uart0_.host_read(buf.data(), buf.size())) != 0)
+        write_all(console_out_, buf.data(), len);
+}
+
+void rv_machine::poll_console()
+{
+    std::array<uint8_t, 256> buf;
+    bool moved = false;
+
+    size_t len;
+    while ((len = uart0_.host_read(buf.data(), buf.size())) != 0) {
+        write_all(console_out_, buf.data(), len);
+        moved = true;
     }
-    if (uart0_.can_read()) {
-        size_t l = uart0_.read_len();
-        if (l > 0) {
-            l = std::min(l, buf.size());
-            uart0_.read_data(buf.data(), l);
-            fwrite(buf.data(), sizeof(uint8_t), l, stdout);
-            fflush(stdout);
+
+    len = std::min(uart0_.host_write_len(), buf.size());
+    pollfd fd{ console_in_, POLLIN, 0 };
+    if (input_open_ && len != 0 && poll(&fd, 1, 0) > 0) {
+        const ssize_t bytes_read = read(console_in_, buf.data(), len);
+        if (bytes_read > 0) {
+            uart0_.host_write(buf.data(), bytes_read);
+            moved = true;
+        }
+        else if (bytes_read == 0 || (errno != EINTR && errno != EAGAIN)) {
+            input_open_ = false;
         }
     }
+
+    if (moved)
+        device_pending_.fetch_or(RV_DEVICE_UART0);
+}
+
+void rv_machine::service_devices()
+{
+    const auto pending = device_pending_.exchange(0);
+    std::lock_guard<std::mutex> lock{memory_.device_lock()};
+    if ((pending & RV_DEVICE_UART0) != 0)
+        uart0_.update();
+}
+
+void rv_machine::run_hart(hart& h)
+{
+    // devices are serviced by hart 0, the one their interrupts go to
+    const bool devices = &h == harts_[0].get();
+    while (running_.load(std::memory_order_relaxed)) {
+        if (devices && device_pending_.load(std::memory_order_relaxed) != 0)
+            service_devices();
+        if (h.cpu.idle())
+            wait_for_interrupt(h);
+        else
+            h.cpu.run(RV_HART_SLICE);
+    }
 }
 
-#define TIMEIT
 void rv_machine::run()
 {
     using namespace std::chrono_literals;
 
-    fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
+    open_wake_fds();
+    stop_reason_ = rv_stop_reason::none;
+    exit_code_ = 0;
+    running_ = true;
+    // the console of a job is moved by the harts themselves
+    std::thread io_thread;
+    if (!job_console_)
+        io_thread = std::thread(&rv_machine::io_loop, this);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < harts_.size(); ++i)
+        threads.emplace_back(&rv_machine::run_hart, this, std::ref(*harts_[i]));
 
-#ifdef TIMEIT
-    std::thread([this](){
-        uint64_t prev_cycle = cpu_.cycle_count();
+    auto report_ips = [this]() {
+        auto cycles = [this]() {
+            uint64_t total = 0;
+            for (auto& h: harts_)
+                total += h->cpu.cycle_count();
+            return total;
+        };
+        uint64_t prev_cycle = cycles();
 
-        for (;;) {
-            std::this_thread::sleep_for(1s);
-            uint64_t cur_cycle = cpu_.cycle_count();
+        std::unique_lock<std::mutex> lock{stop_lock_};
+        while (!stopped_.wait_for(lock, 1s, [this]() { return !running_.load(); })) {
+            uint64_t cur_cycle = cycles();
             uint64_t delta = cur_cycle - prev_cycle;
             prev_cycle = cur_cycle;
             fprintf(stderr, "IPS: %lld\n", delta/1000);
         }
-    }).detach();
+    };
+    // joined before returning, the machine may be destroyed as soon as run() stops
+    std::thread ips_thread;
+    if (ips_report_)
+        ips_thread = std::thread(report_ips);
 
-    for (;;) {
-        process_devices();
-        cpu_.run(5000);
-    }
-#elif defined(PROFILE)
-    for (int i = 0; i < 2000; ++i) {
-        cpu_.run(500000);
+    run_hart(*harts_[0]);
+
+    halt(rv_stop_reason::stopped);
+    for (auto& thread: threads)
+        thread.join();
+
+    if (io_thread.joinable()) {
+        const uint64_t one = 1;
+        (void)!write(io_fd_, &one, sizeof(one));
+        io_thread.join();
     }
-#else
+    if (ips_thread.joinable())
+        ips_thread.join();
+}
 
-    for (int i = 0; i < 200; ++i) {
-        cpu_.run(10);
+rv_stop_reason rv_machine::step(uint64_t budget)
+{
+    stop_reason_ = rv_stop_reason::none;
+    exit_code_ = 0;
+    running_ = true;
+    const auto end = events_.now() + budget;
+    while (running_.load(std::memory_order_relaxed)) {
+        poll_console();
+        if (device_pending_.load(std::memory_order_relaxed) != 0)
+            service_devices();
+
+        // the harts take turns across steps too, a budget smaller than a slice is shared
+        bool busy = false;
+        for (size_t i = 0; i < harts_.size(); ++i) {
+            const auto now = events_.now();
+            if (now >= end || !running_.load(std::memory_order_relaxed))
+                break;
+            auto& h = *harts_[step_hart_];
+            step_hart_ = (step_hart_ + 1) % harts_.size();
+            if (!h.cpu.idle()) {
+                h.cpu.run(std::min<uint64_t>(RV_HART_SLICE, end - now));
+                busy = true;
+            }
+        }
+        const auto now = events_.now();
+        if (now >= end)
+            break;
+        // every hart waits for an interrupt, virtual time moves on to the next deadline
+        // or the end of the budget, whatever comes first
+        if (!busy)
+            events_.advance(std::min(events_.next_deadline(), end) - now);
     }
-#endif
+    running_ = false;
+    poll_console();
+    return stop_reason_;
 }
\ No newline at end of file
@@ -1,31 +1,218 @@
 #pragma once
 #include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <array>
 #include "rv_memory.hpp"
 #include "rv_cpu.hpp"
+#include "rv_elf.hpp"
+#include "devices/rv_clint.hpp"
 #include "devices/rv_plic.hpp"
 #include "devices/rv_uart.hpp"
+#include "devices/rv_control.hpp"
+
+// devices with work left by the I/O thread
+constexpr uint32_t RV_DEVICE_UART0 = 1;
+
+// instructions a hart runs before looking at the machine (stopping, device work) again
+constexpr size_t RV_HART_SLICE = 5000;
+
+// why the last run() returned
+enum class rv_stop_reason
+{
+    none,
+    stopped,        // stop() was called
+    exited,         // the guest wrote its exit code to the control device
+    budget,         // the instruction budget ran out
+    fork_point,     // the guest reached the fork server marker
+    crashed         // a job died without reporting or couldn't be started
+};
+
+// a run of the machine forked by the fork server
+struct rv_job
+{
+    // console input, fed to uart0
+    std::string input;
+    // instructions the job may retire, 0 for no limit
+    uint64_t budget = 0;
+};
+
+struct rv_job_result
+{
+    rv_stop_reason reason = rv_stop_reason::none;
+    // 0 unless reason is rv_stop_reason::exited
+    uint32_t exit_code = 0;
+    uint64_t instructions = 0;
+    // console output
+    std::string output;
+    // block chaining of every hart during the run
+    rv_chain_stats chain;
+};
 
 class rv_machine
 {
 public:
-    rv_machine();
+    // harts share the memory and the devices, hart 0 runs on the calling thread
+    // the others on threads of their own
+    // guard_pages: see rv_memory, native code then accesses RAM without TLB lookups
+    explicit rv_machine(size_t hart_count = 1, size_t ram_size = 16_MiB, bool guard_pages = false);
+    ~rv_machine();
 
+    // ELF executables are loaded at their physical addresses and start at their entry point,
+    // anything else is a flat binary loaded at 0x1000
     void loadBinary(const std::string& filename);
     void run();
+    // run() without any threads, for multiplexing many machines on a few host threads:
+    // runs the harts in turns on the calling thread for at most budget instructions of
+    // virtual time and returns, the next call carries on from there
+    // the console is polled without blocking in between, returns rv_stop_reason::none when
+    // the budget ran out (waiting for input uses it up too)
+    rv_stop_reason step(uint64_t budget);
+    // can be called from any thread, run() returns once every hart finished its current slice
+    void stop() { halt(rv_stop_reason::stopped); }
+    rv_stop_reason stop_reason() const { return stop_reason_.load(); }
+    // set along with rv_stop_reason::exited, 0 otherwise
+    uint32_t exit_code() const { return exit_code_; }
+    // stop after instructions more of virtual time, 0 for no limit
+    void set_budget(uint64_t instructions);
+
+    // uart0 reads from in_fd (nothing if negative) and writes to out_fd, stdin and stdout by default
+    // the descriptors are left as they are, blocking or not
+    void set_console(int in_fd, int out_fd) { console_in_ = in_fd; console_out_ = out_fd; input_open_ = in_fd >= 0; }
+    // print the instructions per second to stderr while running, on by default
+    void set_ips_report(bool report) { ips_report_ = report; }
+    // how code is promoted from the interpreter to native code on every hart, with the machine stopped
+    void set_tiers(const rv_tier_config& tiers);
+
+    // run() with the job's budget, uart0 is given the job's input and its output is collected
+    // in result by the hart accessing uart0 instead of the I/O thread, as the guest gets to
+    // them, so the result only depends on the job and not on how the host schedules threads
+    void run_job(const rv_job& job, rv_job_result& result);
+
+    // runs until the guest writes the control device's fork register, then runs every job
+    // next_job hands out in a forked copy of the machine, one after the other, and gives
+    // their results to done, each copy sharing the booted RAM copy-on-write with this one
+    // returns false if the guest stopped before reaching that point
+    // guard page RAM is a shared mapping, forking it would share it with the jobs, throws
+    // std::runtime_error for that and if the host can't fork
+    bool fork_server(const std::function<bool(rv_job&)>& next_job,
+                     const std::function<void(const rv_job&, const rv_job_result&)>& done);
+
+    // the whole machine state (harts, devices, virtual time and RAM) to/from a file, with the
+    // machine stopped, both throw std::runtime_error on failure
+    // restore only reads the state up front, RAM is mapped copy-on-write from the file
+    // (unless RAM can't be remapped, see rv_memory::load_file) and its pages are read when
+    // first touched, so the file must stay unchanged for as long as the machine runs
+    // a failed restore leaves the machine half restored
+    void snapshot(const std::string& path);
+    void restore(const std::string& path);
+
+    // the same without a file, for running many short tests on one machine: set_baseline()
+    // keeps the machine state and a copy of RAM, reset_to_baseline() brings them back, copying
+    // only the RAM pages written since (see rv_memory::set_baseline), and returns their number
+    // decoded and translated code survives the reset, only code on the restored pages is dropped
+    // with the machine stopped, reset_to_baseline() throws std::runtime_error if there's no baseline
+    void set_baseline();
+    size_t reset_to_baseline();
 
     rv_memory& memory() { return memory_; }
+    // block chaining counters of every hart summed up, since the machine was created
+    // exact with the machine stopped, a rough snapshot while it runs
+    rv_chain_stats chain_stats() const;
+    // last ELF image loaded, for its symbols, nullptr for flat binaries
+    const rv_elf *image() const { return image_.get(); }
 
 private:
-    void process_devices();
+    // a hart and the host side of its thread
+    struct hart
+    {
+        hart(rv_memory& memory, rv_event_queue& events, rv_uint hartid);
+        ~hart();
+
+        rv_cpu cpu;
+        // eventfd waking the thread up while it sleeps in wait_for_interrupt, -1 until run()
+        int wake_fd;
+        std::atomic<bool> sleeping{false};
+    };
+
+    // host I/O thread, moves bytes between the console and uart0 and sleeps in poll otherwise
+    // it never touches the device registers, hart 0 updates them when it sees device_pending_
+    void io_loop();
+    void notify_io();
+    // moves the output of a run_job() out of uart0 and its input in as far as there's room
+    void move_job_console();
+    void service_devices();
+    // the I/O thread's work done by step() on its own thread, without blocking on input
+    void poll_console();
+    // the eventfds the threads of run() sleep on, opened by the first run()
+    void open_wake_fds();
+
+    void save_state(rv_snapshot_writer& state);
+    bool restore_state(rv_snapshot_reader& state);
+
+    // run() returns, the first reason given is kept
+    void halt(rv_stop_reason reason);
+    void guest_exit(uint32_t code);
+    void fork_point();
+
+    std::array<rv_device*, 3> devices() { return { &clint_, &plic_, &uart0_ }; }
+
+    void run_hart(hart& h);
+    void update_mip(hart& h, uint32_t irq_num, bool state);
+    void wake(hart& h);
+    // the hart is stopped in wfi, skip virtual time ahead if every hart is,
+    // otherwise block until an interrupt (or device work for hart 0) wakes it up
+    void wait_for_interrupt(hart& h);
 
 private:
     rv_memory memory_;
-    rv_cpu cpu_;
-    /* rv_clint clint_ */
+    std::unique_ptr<rv_elf> image_;
+    rv_event_queue events_;
+    std::vector<std::unique_ptr<hart>> harts_;
+    std::atomic<bool> running_{false};
+    std::atomic<size_t> idle_harts_{0};
+
+    // RV_DEVICE_* bits
+    std::atomic<uint32_t> device_pending_{0};
+    // eventfd waking the I/O thread up, -1 until run()
+    int io_fd_;
+    std::atomic<bool> io_sleeping_{false};
+    int console_in_;
+    int console_out_;
+    // console input hasn't reached its end yet, for step()
+    bool input_open_ = true;
+    // console of run_job(), input not given to uart0 yet and output so far
+    bool job_console_ = false;
+    std::string job_input_;
+    size_t job_input_done_ = 0;
+    std::string job_output_;
+    // hart step() runs next
+    size_t step_hart_ = 0;
+    bool ips_report_ = true;
+
+    std::atomic<rv_stop_reason> stop_reason_{rv_stop_reason::none};
+    // signalled by halt(), for whoever waits on the machine with a timeout
+    std::mutex stop_lock_;
+    std::condition_variable stopped_;
+    uint32_t exit_code_ = 0;
+    // event stopping the machine when the budget ran out
+    size_t budget_event_;
+    // jobs of a fork server don't fork again
+    bool forked_ = false;
+    // state kept by set_baseline()
+    std::vector<uint8_t> baseline_;
+
+    rv_clint clint_{"clint", 0xC0000000, 0xC000FFFF, events_};
 
     // I believe the PLIC address space needs some serious tuning....
     rv_plic plic_{"plic", 0xC1000000, 0xC1200000};
 
     rv_uart uart0_{"uart0", 0xC2000000, 0xC2000FFF};
+
+    rv_control control_{"control", 0xC3000000, 0xC3000FFF};
 /*    rv_uart uart1_{"uart1", 0x83000000, 0x83000FFF};*/
 };
\ No newline at end of file
@@ -1,21 +1,174 @@
+#include <algorithm>
 #include <cstring>
+#include <cstdlib>
 #include <cassert>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "rv_exceptions.hpp"
 #include "rv_memory.hpp"
 
-rv_memory::rv_memory(rv_uint ram_size)
+thread_local rv_uint rv_memory::m_faultAddress;
+thread_local rv_exception rv_memory::m_lastException;
+
+rv_memory::rv_memory(size_t ram_size, bool guard_pages)
+    : m_guestBase{nullptr}, m_baseline{nullptr}
 {
-    m_ram = new uint8_t[ram_size];
+    m_emptyTable.fill(0);
+    m_pageMap.fill(m_emptyTable.data());
+
+    // RAM must be page aligned, page map entries keep flags in the low bits
+    ram_size = std::min<size_t>(ram_size, RV_MEMORY_RAM_END - RV_MEMORY_RAM_BEGIN);
+    ram_size = (ram_size + RV_MEMORY_PAGE_MASK) & ~(size_t)RV_MEMORY_PAGE_MASK;
+
+    m_codeWordsSize = (ram_size / sizeof(uint32_t) / 64 * sizeof(uint64_t) + RV_MEMORY_PAGE_MASK) & ~(size_t)RV_MEMORY_PAGE_MASK;
+    void *words = mmap(nullptr, m_codeWordsSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (words == MAP_FAILED)
+        throw std::bad_alloc();
+    m_codeWords = (uint64_t *)words;
+
+    try {
+        if (guard_pages)
+            map_guarded_ram(ram_size);
+        else
+            map_ram(ram_size);
+    }
+    catch (...) {
+        munmap(m_codeWords, m_codeWordsSize);
+        throw;
+    }
+
     m_ramBegin = RV_MEMORY_RAM_BEGIN;
-    m_ramEnd = ram_size;
-    m_devices.fill(nullptr);
+    m_ramEnd = RV_MEMORY_RAM_BEGIN + ram_size;
+    map_host(m_ramBegin, m_ram, ram_size, RV_PAGE_R | RV_PAGE_W | RV_PAGE_X);
 }
 
 rv_memory::~rv_memory()
 {
+    if (m_guestBase != nullptr) {
+        munmap(m_guestBase, RV_MEMORY_GUEST_SPACE);
+    }
     if (m_ram != nullptr) {
-        delete [] m_ram;
+        munmap(m_ram, m_ramMapped);
+    }
+    if (m_baseline != nullptr) {
+        munmap(m_baseline, ram_size());
+    }
+    if (m_codeWords != nullptr) {
+        munmap(m_codeWords, m_codeWordsSize);
+    }
+}
+
+void rv_memory::map_ram(size_t ram_size)
+{
+    // small RAM is committed a small page at a time, a huge page would commit most of it at once
+    if (ram_size < RV_MEMORY_HUGE_PAGE_MIN_RAM) {
+        m_ramMapped = ram_size;
+        void *ram = mmap(nullptr, m_ramMapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ram == MAP_FAILED)
+            throw std::bad_alloc();
+        madvise(ram, m_ramMapped, MADV_NOHUGEPAGE);
+        m_hugePages = false;
+        m_ram = (uint8_t *)ram;
+        return;
+    }
+
+    // explicit huge pages if the pool has enough of them, they are reserved up front
+    // so running out can't end in a SIGBUS later
+    const size_t huge_size = (ram_size + RV_MEMORY_HUGE_PAGE_SIZE - 1) & ~(RV_MEMORY_HUGE_PAGE_SIZE - 1);
+    void *ram = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    m_hugePages = ram != MAP_FAILED;
+    m_ramMapped = huge_size;
+
+    if (!m_hugePages) {
+        // otherwise reserve address space only, aligned so transparent huge pages can back it
+        m_ramMapped = huge_size + RV_MEMORY_HUGE_PAGE_SIZE;
+        ram = mmap(nullptr, m_ramMapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ram == MAP_FAILED)
+            throw std::bad_alloc();
+
+        const auto begin = (uintptr_t)ram;
+        const auto aligned = (begin + RV_MEMORY_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(RV_MEMORY_HUGE_PAGE_SIZE - 1);
+        if (aligned != begin)
+            munmap(ram, aligned - begin);
+        const auto tail = aligned + huge_size;
+        if (tail != begin + m_ramMapped)
+            munmap((void *)tail, begin + m_ramMapped - tail);
+        ram = (void *)aligned;
+        m_ramMapped = huge_size;
+        madvise(ram, m_ramMapped, MADV_HUGEPAGE);
+    }
+    m_ram = (uint8_t *)ram;
+}
+
+void rv_memory::map_guarded_ram(size_t ram_size)
+{
+    // RAM lives in a memory file mapped twice, once at its guest address in a window covering
+    // the whole physical address space where everything else is inaccessible, and once read/write
+    // for the page map, the slow paths and the host
+    // no hugetlbfs here, code pages are write protected in the window one small page at a time
+    const int fd = memfd_create("rv-ram", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, ram_size) != 0) {
+        if (fd >= 0)
+            close(fd);
+        throw std::bad_alloc();
+    }
+
+    m_hugePages = false;
+    m_ramMapped = ram_size;
+    void *ram = mmap(nullptr, ram_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    void *window = mmap(nullptr, RV_MEMORY_GUEST_SPACE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ram != MAP_FAILED && window != MAP_FAILED) {
+        if (mmap((uint8_t *)window + RV_MEMORY_RAM_BEGIN, ram_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED | MAP_NORESERVE, fd, 0) == MAP_FAILED) {
+            munmap(window, RV_MEMORY_GUEST_SPACE);
+            window = MAP_FAILED;
+        }
+    }
+    close(fd);
+    if (ram == MAP_FAILED || window == MAP_FAILED) {
+        if (ram != MAP_FAILED)
+            munmap(ram, ram_size);
+        if (window != MAP_FAILED)
+            munmap(window, RV_MEMORY_GUEST_SPACE);
+        throw std::bad_alloc();
+    }
+
+    if (ram_size >= RV_MEMORY_HUGE_PAGE_MIN_RAM)
+        madvise(ram, ram_size, MADV_HUGEPAGE);
+    m_ram = (uint8_t *)ram;
+    m_guestBase = (uint8_t *)window;
+}
+
+uintptr_t& rv_memory::page_entry_ref(rv_uint address)
+{
+    auto& table = m_pageMap[address >> (RV_MEMORY_PAGE_SHIFT + RV_MEMORY_MAP_SHIFT)];
+    if (table == m_emptyTable.data()) {
+        m_pageTables.push_back(std::make_unique<std::array<uintptr_t, RV_MEMORY_MAP_ENTRIES>>());
+        m_pageTables.back()->fill(0);
+        table = m_pageTables.back()->data();
+    }
+    return table[(address >> RV_MEMORY_PAGE_SHIFT) & (RV_MEMORY_MAP_ENTRIES - 1)];
+}
+
+uint8_t *rv_memory::ram_pointer(rv_uint address) const
+{
+    const auto entry = page_entry(address);
+    if (entry == 0 || (entry & RV_PAGE_MMIO) != 0)
+        return nullptr;
+    return host_address(entry, address);
+}
+
+bool rv_memory::map_host(rv_uint address, uint8_t *host, size_t len, uintptr_t perms)
+{
+    if ((address & RV_MEMORY_PAGE_MASK) != 0 || ((uintptr_t)host & RV_MEMORY_PAGE_MASK) != 0)
+        return false;
+
+    for (size_t offset = 0; offset < len; offset += RV_MEMORY_PAGE_SIZE) {
+        const rv_uint page = address + offset;
+        page_entry_ref(page) = ((uintptr_t)(host + offset) - page) | (perms & (RV_PAGE_R | RV_PAGE_W | RV_PAGE_X));
     }
+    return true;
 }
 
 void rv_memory::load(rv_uint address, const uint8_t *data, size_t len)
@@ -23,7 +176,236 @@ void rv_memory::load(rv_uint address, const uint8_t *data, size_t len)
     if (data == nullptr || len == 0)
         return;
 
-    memcpy(m_ram + address, data, len);
+    for (size_t done = 0; done < len; ) {
+        const rv_uint addr = address + done;
+        const size_t chunk = std::min<size_t>(len - done, RV_MEMORY_PAGE_SIZE - (addr & RV_MEMORY_PAGE_MASK));
+        auto host = ram_pointer(addr);
+        if (host != nullptr)
+            memcpy(host, data + done, chunk);
+        done += chunk;
+    }
+    host_written(address, len);
+}
+
+uint8_t *rv_memory::ram_range(rv_uint address, size_t len) const
+{
+    if (address < m_ramBegin || address > m_ramEnd || len > (size_t)(m_ramEnd - address))
+        return nullptr;
+    return m_ram + (address - m_ramBegin);
+}
+
+bool rv_memory::any_code_page(rv_uint address, size_t len) const
+{
+    for (rv_ulong page = address & ~RV_MEMORY_PAGE_MASK; page < (rv_ulong)address + len; page += RV_MEMORY_PAGE_SIZE) {
+        if ((page_entry((rv_uint)page) & RV_PAGE_CODE) != 0)
+            return true;
+    }
+    return false;
+}
+
+bool rv_memory::load_file(rv_uint address, int fd, off_t offset, size_t len)
+{
+    auto host = ram_range(address, len);
+    if (host == nullptr)
+        return false;
+
+    // whole pages in the middle are mapped if the file offset has the same alignment
+    size_t head = len;
+    size_t mapped = 0;
+    if (ram_remappable() && (address & RV_MEMORY_PAGE_MASK) == (offset & RV_MEMORY_PAGE_MASK)) {
+        head = std::min<size_t>(len, (RV_MEMORY_PAGE_SIZE - (address & RV_MEMORY_PAGE_MASK)) & RV_MEMORY_PAGE_MASK);
+        mapped = (len - head) & ~(size_t)RV_MEMORY_PAGE_MASK;
+        if (mapped != 0 && mmap(host + head, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                                fd, offset + head) == MAP_FAILED)
+            return false;
+    }
+
+    // partial pages at both ends (or everything) are read
+    const std::pair<size_t, size_t> parts[] = { { 0, head }, { head + mapped, len - head - mapped } };
+    for (const auto& part: parts) {
+        for (size_t done = 0; done < part.second; ) {
+            const ssize_t n = pread(fd, host + part.first + done, part.second - done, offset + part.first + done);
+            if (n <= 0)
+                return false;
+            done += n;
+        }
+    }
+
+    host_written(address, len);
+    return true;
+}
+
+static bool all_zero(const uint8_t *data, size_t len)
+{
+    const auto words = (const uint64_t *)data;
+    for (size_t i = 0; i < len / sizeof(uint64_t); ++i) {
+        if (words[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+bool rv_memory::save_file(rv_uint address, int fd, off_t offset, size_t len) const
+{
+    auto host = ram_range(address, len);
+    if (host == nullptr)
+        return false;
+
+    // runs of non-zero pages, each written at once
+    size_t done = 0;
+    while (done < len) {
+        const size_t page = std::min<size_t>(len - done, RV_MEMORY_PAGE_SIZE - ((address + done) & RV_MEMORY_PAGE_MASK));
+        if (all_zero(host + done, page)) {
+            done += page;
+            continue;
+        }
+        size_t end = done + page;
+        while (end < len) {
+            const size_t next = std::min<size_t>(len - end, RV_MEMORY_PAGE_SIZE);
+            if (all_zero(host + end, next))
+                break;
+            end += next;
+        }
+        while (done < end) {
+            const ssize_t n = pwrite(fd, host + done, end - done, offset + done);
+            if (n <= 0)
+                return false;
+            done += n;
+        }
+    }
+    return true;
+}
+
+bool rv_memory::clear(rv_uint address, size_t len)
+{
+    auto host = ram_range(address, len);
+    if (host == nullptr)
+        return false;
+    if (len == 0)
+        return true;
+
+    size_t head = len;
+    size_t mapped = 0;
+    if (ram_remappable()) {
+        head = std::min<size_t>(len, (RV_MEMORY_PAGE_SIZE - (address & RV_MEMORY_PAGE_MASK)) & RV_MEMORY_PAGE_MASK);
+        mapped = (len - head) & ~(size_t)RV_MEMORY_PAGE_MASK;
+        if (mapped != 0 && mmap(host + head, mapped, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED)
+            return false;
+    }
+    memset(host, 0, head);
+    memset(host + head + mapped, 0, len - head - mapped);
+
+    host_written(address, len);
+    return true;
+}
+
+void rv_memory::code_written(rv_uint address, size_t len)
+{
+    // nothing decoded from here, data sharing a page with code
+    if (!any_code_word(address, len))
+        return;
+    for (auto& handler: m_codeWriteHandlers)
+        handler(address, len);
+}
+
+void rv_memory::host_written(rv_uint address, size_t len)
+{
+    if (m_baseline != nullptr)
+        mark_dirty(address, len);
+    if (any_code_page(address, len))
+        code_written(address, len);
+}
+
+void rv_memory::protect_window(rv_uint address, bool writable)
+{
+    if (m_guestBase != nullptr)
+        mprotect(m_guestBase + (address & ~RV_MEMORY_PAGE_MASK), RV_MEMORY_PAGE_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ);
+}
+
+void rv_memory::mark_dirty(rv_uint address, size_t len)
+{
+    for (rv_ulong page = address & ~RV_MEMORY_PAGE_MASK; page < (rv_ulong)address + len; page += RV_MEMORY_PAGE_SIZE) {
+        if ((page_entry((rv_uint)page) & RV_PAGE_CLEAN) == 0)
+            continue;
+        // another hart may be turning the page into code, CODE is checked again under the lock
+        std::lock_guard<std::mutex> lock{m_pageLock};
+        const auto entry = page_entry((rv_uint)page);
+        if ((entry & RV_PAGE_CLEAN) == 0)
+            continue;
+        // harts may dirty pages sharing a word at the same time
+        const size_t index = (page - m_ramBegin) >> RV_MEMORY_PAGE_SHIFT;
+        m_dirty[index / 64].fetch_or(1ULL << (index % 64), std::memory_order_relaxed);
+        const bool code = (entry & RV_PAGE_CODE) != 0;
+        page_entry_ref((rv_uint)page) = (entry & ~RV_PAGE_CLEAN) | (code ? 0 : RV_PAGE_W);
+        if (!code)
+            protect_window((rv_uint)page, true);
+    }
+}
+
+void rv_memory::set_baseline()
+{
+    const size_t size = ram_size();
+    const size_t pages = size >> RV_MEMORY_PAGE_SHIFT;
+    if (m_baseline == nullptr) {
+        void *baseline = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (baseline == MAP_FAILED)
+            throw std::bad_alloc();
+        m_baseline = (uint8_t *)baseline;
+        m_dirty = std::make_unique<std::atomic<uint64_t>[]>((pages + 63) / 64);
+    }
+    else {
+        madvise(m_baseline, size, MADV_DONTNEED);
+    }
+
+    // zero pages stay uncommitted in the baseline too
+    for (size_t offset = 0; offset < size; offset += RV_MEMORY_PAGE_SIZE) {
+        if (!all_zero(m_ram + offset, RV_MEMORY_PAGE_SIZE))
+            memcpy(m_baseline + offset, m_ram + offset, RV_MEMORY_PAGE_SIZE);
+    }
+
+    for (size_t i = 0; i < (pages + 63) / 64; ++i)
+        m_dirty[i].store(0, std::memory_order_relaxed);
+    for (rv_ulong page = m_ramBegin; page < m_ramEnd; page += RV_MEMORY_PAGE_SIZE) {
+        const auto entry = page_entry((rv_uint)page);
+        if ((entry & (RV_PAGE_W | RV_PAGE_CODE)) != 0)
+            page_entry_ref((rv_uint)page) = (entry & ~RV_PAGE_W) | RV_PAGE_CLEAN;
+    }
+    if (m_guestBase != nullptr)
+        mprotect(m_guestBase + m_ramBegin, size, PROT_READ);
+    for (auto& handler: m_codePageHandlers)
+        handler(m_ramBegin);
+}
+
+size_t rv_memory::reset_to_baseline()
+{
+    if (m_baseline == nullptr)
+        return 0;
+
+    size_t count = 0;
+    const size_t pages = ram_size() >> RV_MEMORY_PAGE_SHIFT;
+    for (size_t i = 0; i < (pages + 63) / 64; ++i) {
+        auto bits = m_dirty[i].exchange(0, std::memory_order_relaxed);
+        while (bits != 0) {
+            const size_t offset = (i * 64 + __builtin_ctzll(bits)) << RV_MEMORY_PAGE_SHIFT;
+            const rv_uint page = m_ramBegin + offset;
+            bits &= bits - 1;
+
+            memcpy(m_ram + offset, m_baseline + offset, RV_MEMORY_PAGE_SIZE);
+            auto& entry = page_entry_ref(page);
+            entry = (entry & ~RV_PAGE_W) | RV_PAGE_CLEAN;
+            if ((entry & RV_PAGE_CODE) != 0)
+                code_written(page, RV_MEMORY_PAGE_SIZE);
+            else
+                protect_window(page, false);
+            ++count;
+        }
+    }
+    if (count != 0) {
+        for (auto& handler: m_codePageHandlers)
+            handler(m_ramBegin);
+    }
+    return count;
 }
 
 void rv_memory::dump(rv_uint address, uint8_t *outm, size_t len) const
@@ -31,16 +413,101 @@ void rv_memory::dump(rv_uint address, uint8_t *outm, size_t len) const
     if (outm == nullptr || len == 0)
         return;
 
-    memcpy(outm, m_ram, len);
+    for (size_t done = 0; done < len; ) {
+        const rv_uint addr = address + done;
+        const size_t chunk = std::min<size_t>(len - done, RV_MEMORY_PAGE_SIZE - (addr & RV_MEMORY_PAGE_MASK));
+        auto host = ram_pointer(addr);
+        if (host != nullptr)
+            memcpy(outm + done, host, chunk);
+        else
+            memset(outm + done, 0, chunk);
+        done += chunk;
+    }
+}
+
+bool rv_memory::mark_code_page(rv_uint address)
+{
+    const auto entry = page_entry(address);
+    if ((entry & (RV_PAGE_X | RV_PAGE_MMIO)) != RV_PAGE_X)
+        return false;
+
+    // read only pages can't be modified, nothing to watch
+    if ((entry & RV_PAGE_CODE) == 0 && (entry & (RV_PAGE_W | RV_PAGE_CLEAN)) != 0) {
+        {
+            // mark_dirty may be giving W back to the page on another hart
+            std::lock_guard<std::mutex> lock{m_pageLock};
+            const auto current = page_entry(address);
+            if ((current & RV_PAGE_CODE) != 0)
+                return true;
+            page_entry_ref(address) = (current & ~RV_PAGE_W) | RV_PAGE_CODE;
+            protect_window(address, false);
+        }
+        for (auto& handler: m_codePageHandlers)
+            handler(address & ~RV_MEMORY_PAGE_MASK);
+    }
+    return true;
+}
+
+void rv_memory::mark_code_words(rv_uint address, size_t len)
+{
+    const rv_ulong end = std::min<rv_ulong>((rv_ulong)address + len, m_ramEnd);
+    for (rv_ulong addr = std::max<rv_ulong>(address & ~3U, m_ramBegin); addr < end; addr += sizeof(uint32_t)) {
+        const rv_uint index = (addr - m_ramBegin) >> 2;
+        const uint64_t bit = 1ULL << (index % 64);
+        // seen set before the word is read, a store after that reports it
+        if ((__atomic_load_n(&m_codeWords[index / 64], __ATOMIC_RELAXED) & bit) == 0)
+            __atomic_fetch_or(&m_codeWords[index / 64], bit, __ATOMIC_SEQ_CST);
+    }
+}
+
+bool rv_memory::any_code_word(rv_uint address, size_t len) const
+{
+    // the write must be visible before the bits are read, the decoder does it the other way round
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const rv_ulong end = std::min<rv_ulong>((rv_ulong)address + len, m_ramEnd);
+    for (rv_ulong addr = std::max<rv_ulong>(address & ~3U, m_ramBegin); addr < end; ) {
+        const rv_uint index = (addr - m_ramBegin) >> 2;
+        // whole bitmap words at a time for page sized writes
+        const size_t bits = std::min<rv_ulong>(64 - index % 64, (end - addr + 3) / 4);
+        const uint64_t mask = (bits == 64 ? ~0ULL : (1ULL << bits) - 1) << (index % 64);
+        if ((__atomic_load_n(&m_codeWords[index / 64], __ATOMIC_RELAXED) & mask) != 0)
+            return true;
+        addr += bits * sizeof(uint32_t);
+    }
+    return false;
+}
+
+void rv_memory::clear_code_pages()
+{
+    madvise(m_codeWords, m_codeWordsSize, MADV_DONTNEED);
+    for (rv_ulong page = m_ramBegin; page < m_ramEnd; page += RV_MEMORY_PAGE_SIZE) {
+        const auto entry = page_entry((rv_uint)page);
+        if ((entry & RV_PAGE_CODE) == 0)
+            continue;
+        // clean pages stay protected until their first store
+        const bool clean = (entry & RV_PAGE_CLEAN) != 0;
+        page_entry_ref((rv_uint)page) = (entry & ~RV_PAGE_CODE) | (clean ? 0 : RV_PAGE_W);
+        if (!clean)
+            protect_window((rv_uint)page, true);
+    }
 }
 
 bool rv_memory::attach(rv_device *device)
 {
-    if (device->base_address() < RV_MEMORY_RAM_END)
+    const rv_uint first = device->base_address() & ~RV_MEMORY_PAGE_MASK;
+    const rv_uint last = device->top_address() & ~RV_MEMORY_PAGE_MASK;
+    if (last < first)
         return false;
 
-    auto dev_id = (device->base_address() >> 24) & 0x0F;
-    m_devices[dev_id] = device;
+    for (rv_ulong page = first; page <= last; page += RV_MEMORY_PAGE_SIZE) {
+        if (page_entry(page) != 0)
+            return false;
+    }
+
+    const uintptr_t index = m_devices.size();
+    m_devices.push_back(device);
+    for (rv_ulong page = first; page <= last; page += RV_MEMORY_PAGE_SIZE)
+        page_entry_ref(page) = (index << RV_MEMORY_PAGE_SHIFT) | RV_PAGE_MMIO | RV_PAGE_R | RV_PAGE_W;
     return true;
 }
 /*
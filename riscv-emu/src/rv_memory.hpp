@@ -2,7 +2,13 @@
 #include <cstdint>
 #include <cstring>
 #include <array>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <atomic>
 #include <type_traits>
+#include <sys/types.h>
 #include "rv_global.hpp"
 #include "rv_exceptions.hpp"
 #include "rv_device.hpp"
@@ -10,29 +16,145 @@
 constexpr rv_uint RV_MEMORY_RAM_BEGIN = 0x00000000;
 constexpr rv_uint RV_MEMORY_RAM_END = 0xC0000000;
 
+constexpr rv_uint RV_MEMORY_PAGE_SHIFT = 12;
+constexpr rv_uint RV_MEMORY_PAGE_SIZE = 1U << RV_MEMORY_PAGE_SHIFT;
+constexpr rv_uint RV_MEMORY_PAGE_MASK = RV_MEMORY_PAGE_SIZE - 1;
+
+// RAM is reserved in host huge pages when possible
+constexpr size_t RV_MEMORY_HUGE_PAGE_SIZE = 2_MiB;
+// unless it's smaller than this
+constexpr size_t RV_MEMORY_HUGE_PAGE_MIN_RAM = 8_MiB;
+
+// guard page mode window, the 4 GiB physical space plus a page for accesses crossing its end
+constexpr size_t RV_MEMORY_GUEST_SPACE = 4_GiB + RV_MEMORY_PAGE_SIZE;
+
+// two level page map, 10 bits per level
+constexpr rv_uint RV_MEMORY_MAP_SHIFT = 10;
+constexpr size_t RV_MEMORY_MAP_ENTRIES = 1U << RV_MEMORY_MAP_SHIFT;
+
+// page map entries hold the host address of the page minus its guest address
+// (or the device index for mmio pages) with these flags in the low bits
+constexpr uintptr_t RV_PAGE_R = 1;
+constexpr uintptr_t RV_PAGE_W = 2;
+constexpr uintptr_t RV_PAGE_X = 4;
+constexpr uintptr_t RV_PAGE_MMIO = 8;
+// RAM page holding decoded instructions, W is cleared so stores leave the fast path
+// and get reported to the code write handler
+constexpr uintptr_t RV_PAGE_CODE = 16;
+// RAM page not written since the baseline, W is cleared so the first store leaves the fast path
+// and marks it dirty
+constexpr uintptr_t RV_PAGE_CLEAN = 32;
+constexpr uintptr_t RV_PAGE_FLAGS = RV_MEMORY_PAGE_MASK;
+
 class rv_memory
 {
 public:
     rv_memory() = delete;
-    rv_memory(rv_uint ram_size);
+    // RAM is only reserved, host pages are committed when first touched
+    // ram_size is limited to the space below RV_MEMORY_RAM_END
+    // with guard_pages RAM is also mapped at its physical address in a window where
+    // every other page (devices, holes, code pages for writes) faults, see guest_base()
+    rv_memory(size_t ram_size, bool guard_pages = false);
     ~rv_memory();
 
+    rv_memory(const rv_memory&) = delete;
+    rv_memory& operator=(const rv_memory&) = delete;
+
+    size_t ram_size() const { return m_ramEnd - m_ramBegin; }
+    // backed by explicit (hugetlbfs) huge pages rather than transparent ones
+    bool huge_pages() const { return m_hugePages; }
+    // guard page mode, guest physical address x is at guest_base() + x, nullptr otherwise
+    // accesses there only succeed for RAM, anything else raises SIGSEGV and must be retried
+    // through read()/write(), which take care of devices and access faults
+    uint8_t *guest_base() const { return m_guestBase; }
+
     void load(rv_uint address, const uint8_t *data, size_t len);
+    // len bytes of fd at offset into RAM at address, the pages fully covered are mapped
+    // copy-on-write from the file when RAM allows it (no hugetlbfs or guard pages), the rest is read
+    // false if the range isn't all RAM or the file can't be read
+    bool load_file(rv_uint address, int fd, off_t offset, size_t len);
+    // len bytes of RAM at address into fd at offset, all zero pages are skipped and left
+    // to read back as holes, so fd should be empty there
+    // false if the range isn't all RAM or the file can't be written
+    bool save_file(rv_uint address, int fd, off_t offset, size_t len) const;
+    // zero len bytes of RAM at address, whole pages are replaced by fresh ones committed when touched
+    bool clear(rv_uint address, size_t len);
     void dump(rv_uint address, uint8_t *outm, size_t len) const;
 
+    // device pages cover [base_address, top_address], fails if they overlap something already mapped
     bool attach(rv_device *device);
 
     // why would you do that!!!??? :D
 //    void detach(const std::string& deviceName);
 //    void detach(rv_uint address);
 
+    // map len bytes of page aligned host memory at address, with RV_PAGE_R/W/X permissions
+    bool map_host(rv_uint address, uint8_t *host, size_t len, uintptr_t perms);
+
+    // fault of the last failed access made by the calling thread
     rv_uint faultAddress() const { return m_faultAddress; }
     rv_exception lastException() const { return m_lastException; }
 
+    // held while a device is accessed, by the harts and by whoever feeds the devices from the host
+    std::mutex& device_lock() { return m_deviceLock; }
+
+    // RAM pages holding decoded instructions, writes to them are reported to the code write handlers
+    // returns false if the page is not executable RAM
+    bool mark_code_page(rv_uint address);
+    // every code page turns back into plain RAM without telling the handlers, for when
+    // all of RAM is replaced and every hart drops its code anyway
+    void clear_code_pages();
+    // words of code pages some hart decoded or translated, only writes to them are reported,
+    // the other words of a code page can be written (data next to code) at little cost
+    // a word is marked before it's read for decoding, anything decoded from an unmarked word
+    // may be stale, callers can mark words of any address, only RAM is tracked
+    void mark_code_words(rv_uint address, size_t len);
+    bool is_code_word(rv_uint address) const
+    {
+        const rv_uint index = (address - m_ramBegin) >> 2;
+        return address >= m_ramBegin && address < m_ramEnd &&
+               (__atomic_load_n(&m_codeWords[index / 64], __ATOMIC_ACQUIRE) & (1ULL << (index % 64))) != 0;
+    }
+
+    // dirty page tracking, set_baseline() copies RAM aside and makes every writable page clean,
+    // reset_to_baseline() copies the baseline back into the pages written since and makes them
+    // clean again, returning their number, the harts must be stopped for both
+    // stores and host writes (load, load_file, clear) are all tracked, pages are only ever
+    // write protected for their first store, like code pages
+    void set_baseline();
+    size_t reset_to_baseline();
+    // a page only write protected until its first store, which makes it writable again
+    bool is_clean_page(rv_uint address) const
+    {
+        return (page_entry(address) & (RV_PAGE_CLEAN | RV_PAGE_CODE | RV_PAGE_MMIO)) == RV_PAGE_CLEAN;
+    }
+    // every hart registers its handlers, they are called on the thread making the change
+    void add_code_write_handler(std::function<void(rv_uint,size_t)> handler) { m_codeWriteHandlers.push_back(std::move(handler)); }
+    // called when a RAM page loses W (turning into a code page or clean), cached host pointers to it must go
+    void add_code_page_handler(std::function<void(rv_uint)> handler) { m_codePageHandlers.push_back(std::move(handler)); }
+
+    // host address of the RAM page holding address if it has all of perms (RV_PAGE_R/W/X), nullptr otherwise
+    uint8_t *host_page(rv_uint address, uintptr_t perms) const
+    {
+        const auto entry = page_entry(address);
+        if ((entry & (perms | RV_PAGE_MMIO)) != perms)
+            return nullptr;
+        return host_address(entry, address & ~RV_MEMORY_PAGE_MASK);
+    }
+    // the same for a store about to be made, a clean page turns dirty first
+    uint8_t *store_page(rv_uint address)
+    {
+        if ((page_entry(address) & (RV_PAGE_CLEAN | RV_PAGE_CODE | RV_PAGE_MMIO)) == RV_PAGE_CLEAN)
+            mark_dirty(address, 1);
+        return host_page(address, RV_PAGE_W);
+    }
+
     bool prefetch_code(rv_uint address, uint32_t *insns, size_t count)
     {
-        if (likely(address <= (m_ramEnd - sizeof(uint32_t)*count) && (rv_int)address > 0)) {
-            memcpy(insns, m_ram + address, sizeof(uint32_t)*count);
+        const auto entry = page_entry(address);
+        const size_t len = sizeof(uint32_t)*count;
+        if (likely((entry & (RV_PAGE_X | RV_PAGE_MMIO)) == RV_PAGE_X && (address & RV_MEMORY_PAGE_MASK) + len <= RV_MEMORY_PAGE_SIZE)) {
+            memcpy(insns, host_address(entry, address), len);
             return true;
         }
         m_faultAddress = address;
@@ -42,65 +164,167 @@ public:
 
     template<typename T> bool read(rv_uint address, T& value) const
     {
-        if (address <= (m_ramEnd - sizeof(T))) {
-            value = *(T *)(m_ram + address);
+        const auto entry = page_entry(address);
+        if (likely((entry & (RV_PAGE_R | RV_PAGE_MMIO)) == RV_PAGE_R && !crosses_page<T>(address))) {
+            value = *(const T *)host_address(entry, address);
             return true;
         }
-        else if (address >= RV_MEMORY_RAM_END) {
-            auto device = m_devices[getDeviceId(address)];
-            if (device != nullptr) {
-                if constexpr(sizeof(T) == 1) {
-                    return device->read_u8(address & 0xFFFFFF, (uint8_t&)value);
-                }
-                if constexpr(sizeof(T) == 2) {
-                    return device->read_u16(address & 0xFFFFFF, (uint16_t&)value);
-                }
-                if constexpr(sizeof(T) == 4) {
-                    return device->read_u32(address & 0xFFFFFF, (uint32_t&)value);
-                }
+        return read_slow(address, value);
+    }
+
+    template<typename T> bool write(rv_uint address, T value)
+    {
+        const auto entry = page_entry(address);
+        if (likely((entry & (RV_PAGE_W | RV_PAGE_MMIO)) == RV_PAGE_W && !crosses_page<T>(address))) {
+            *(T *)host_address(entry, address) = value;
+            return true;
+        }
+        return write_slow(address, value);
+    }
+
+private:
+    uintptr_t page_entry(rv_uint address) const
+    {
+        return m_pageMap[address >> (RV_MEMORY_PAGE_SHIFT + RV_MEMORY_MAP_SHIFT)]
+                        [(address >> RV_MEMORY_PAGE_SHIFT) & (RV_MEMORY_MAP_ENTRIES - 1)];
+    }
+
+    // host pointer for [address, address + len) if it's all RAM
+    uint8_t *ram_range(rv_uint address, size_t len) const;
+    bool ram_remappable() const { return m_guestBase == nullptr && !m_hugePages; }
+    bool any_code_page(rv_uint address, size_t len) const;
+    bool any_code_word(rv_uint address, size_t len) const;
+
+    void map_ram(size_t ram_size);
+    void map_guarded_ram(size_t ram_size);
+    uintptr_t& page_entry_ref(rv_uint address);
+    void code_written(rv_uint address, size_t len);
+    // clean pages in the range turn dirty and get W back unless they hold code
+    void mark_dirty(rv_uint address, size_t len);
+    // RAM changed by the host, for the code write handlers and dirty tracking
+    void host_written(rv_uint address, size_t len);
+    // the guest window page at address is read only, with guard pages
+    void protect_window(rv_uint address, bool writable);
+
+    static uint8_t *host_address(uintptr_t entry, rv_uint address)
+    {
+        return (uint8_t *)((entry & ~RV_PAGE_FLAGS) + address);
+    }
+
+    template<typename T> static bool crosses_page(rv_uint address)
+    {
+        return (address & RV_MEMORY_PAGE_MASK) > RV_MEMORY_PAGE_SIZE - sizeof(T);
+    }
+
+    rv_device *page_device(uintptr_t entry) const { return m_devices[entry >> RV_MEMORY_PAGE_SHIFT]; }
+
+    // host pointer for RAM at address, nullptr for devices and unmapped memory
+    uint8_t *ram_pointer(rv_uint address) const;
+
+    template<typename T> bool read_slow(rv_uint address, T& value) const
+    {
+        const auto entry = page_entry(address);
+        if ((entry & (RV_PAGE_R | RV_PAGE_MMIO)) == (RV_PAGE_R | RV_PAGE_MMIO)) {
+            auto device = page_device(entry);
+            const auto offset = address - device->base_address();
+            std::lock_guard<std::mutex> lock{m_deviceLock};
+            if constexpr(sizeof(T) == 1) {
+                return device->read_u8(offset, (uint8_t&)value);
+            }
+            if constexpr(sizeof(T) == 2) {
+                return device->read_u16(offset, (uint16_t&)value);
+            }
+            if constexpr(sizeof(T) == 4) {
+                return device->read_u32(offset, (uint32_t&)value);
             }
         }
+        else if ((entry & RV_PAGE_R) != 0 && (page_entry(address + sizeof(T) - 1) & (RV_PAGE_R | RV_PAGE_MMIO)) == RV_PAGE_R) {
+            // misaligned, crossing into the next page
+            uint8_t bytes[sizeof(T)];
+            for (size_t i = 0; i < sizeof(T); ++i)
+                bytes[i] = *host_address(page_entry(address + i), address + i);
+            memcpy(&value, bytes, sizeof(T));
+            return true;
+        }
         m_faultAddress = address;
         m_lastException = rv_exception::load_access_fault;
         return false;
     }
 
-    template<typename T> bool write(rv_uint address, T value)
+    template<typename T> bool write_slow(rv_uint address, T value)
     {
-        if (address <= (m_ramEnd - sizeof(T))) {
-            *(T *)(m_ram + address) = value;
-            return true;
+        const auto entry = page_entry(address);
+        if ((entry & (RV_PAGE_W | RV_PAGE_MMIO)) == (RV_PAGE_W | RV_PAGE_MMIO)) {
+            auto device = page_device(entry);
+            const auto offset = address - device->base_address();
+            std::lock_guard<std::mutex> lock{m_deviceLock};
+            if constexpr(sizeof(T) == 1) {
+                return device->write_u8(offset, value);
+            }
+            if constexpr(sizeof(T) == 2) {
+                return device->write_u16(offset, value);
+            }
+            if constexpr(sizeof(T) == 4) {
+                return device->write_u32(offset, value);
+            }
         }
-        else if (address >= RV_MEMORY_RAM_END) {
-            auto device = m_devices[getDeviceId(address)];
-            if (device != nullptr) {
-                if constexpr(sizeof(T) == 1) {
-                    return device->write_u8(address & 0xFFFFFF, value);
-                }
-                if constexpr(sizeof(T) == 2) {
-                    return device->write_u16(address & 0xFFFFFF, value);
-                }
-                if constexpr(sizeof(T) == 4) {
-                    return device->write_u32(address & 0xFFFFFF, value);
-                }
+        else if (is_ram_writable(entry) && is_ram_writable(page_entry(address + sizeof(T) - 1))) {
+            // code pages and misaligned writes crossing into the next page
+            if (!crosses_page<T>(address)) {
+                *(T *)host_address(entry, address) = value;
+            }
+            else {
+                for (size_t i = 0; i < sizeof(T); ++i)
+                    *host_address(page_entry(address + i), address + i) = (uint8_t)(value >> (i * 8));
             }
+            const auto flags = entry | page_entry(address + sizeof(T) - 1);
+            if ((flags & RV_PAGE_CLEAN) != 0)
+                mark_dirty(address, sizeof(T));
+            if ((flags & RV_PAGE_CODE) != 0)
+                code_written(address, sizeof(T));
+            return true;
         }
         m_faultAddress = address;
         m_lastException = rv_exception::store_access_fault;
         return false;
     }
 
-private:
-    size_t getDeviceId(rv_uint address) const { return (address >> 24) & 0xF; }
+    static bool is_ram_writable(uintptr_t entry)
+    {
+        return (entry & RV_PAGE_MMIO) == 0 && (entry & (RV_PAGE_W | RV_PAGE_CODE | RV_PAGE_CLEAN)) != 0;
+    }
 
 private:
     uint8_t *m_ram;
+    uint8_t *m_guestBase;
+    // RAM as of set_baseline(), nullptr before, and a bit per RAM page written since
+    uint8_t *m_baseline;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_dirty;
+    // a bit per RAM word, see mark_code_words(), committed where there's code
+    uint64_t *m_codeWords;
+    size_t m_codeWordsSize;
+    size_t m_ramMapped;
+    bool m_hugePages;
     rv_uint m_ramBegin;
     rv_uint m_ramEnd;
 
-    // up to 16 devices supported for now
-    std::array<rv_device*, 16> m_devices;
+    // first level of the page map, unused ranges point to m_emptyTable
+    std::array<uintptr_t*, RV_MEMORY_MAP_ENTRIES> m_pageMap;
+    std::vector<std::unique_ptr<std::array<uintptr_t, RV_MEMORY_MAP_ENTRIES>>> m_pageTables;
+    std::array<uintptr_t, RV_MEMORY_MAP_ENTRIES> m_emptyTable;
+
+    // mmio pages index this
+    std::vector<rv_device*> m_devices;
+
+    mutable std::mutex m_deviceLock;
+    // held by the harts changing page map entries at run time (mark_dirty, mark_code_page),
+    // the entry and the guest window protection change together
+    std::mutex m_pageLock;
+
+    std::vector<std::function<void(rv_uint,size_t)>> m_codeWriteHandlers;
+    std::vector<std::function<void(rv_uint)>> m_codePageHandlers;
 
-    mutable rv_uint m_faultAddress;
-    mutable rv_exception m_lastException;
+    // every hart reports its own faults
+    static thread_local rv_uint m_faultAddress;
+    static thread_local rv_exception m_lastException;
 };
\ No newline at end of file
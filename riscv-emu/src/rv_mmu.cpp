@@ -0,0 +1,195 @@
+#include "rv_mmu.hpp"
+
+rv_mmu::rv_mmu(rv_memory& memory)
+    : memory_{memory}
+{
+    reset();
+}
+
+void rv_mmu::reset()
+{
+    satp_ = 0;
+    fetch_priv_ = RV_PRIV_M;
+    data_priv_ = RV_PRIV_M;
+    sum_ = false;
+    mxr_ = false;
+    for (uint32_t ctx = 0; ctx < RV_MMU_CONTEXTS; ++ctx)
+        flush_context(ctx);
+    update_context();
+}
+
+uint32_t rv_mmu::context(uint32_t priv) const
+{
+    if ((satp_ & RV_SATP_MODE) == 0 || priv == RV_PRIV_M)
+        return RV_MMU_BARE;
+    return priv == RV_PRIV_S ? RV_MMU_SUPERVISOR : RV_MMU_USER;
+}
+
+void rv_mmu::update_context()
+{
+    ctx_ = { context(fetch_priv_), context(data_priv_), context(data_priv_) };
+    for (size_t access = 0; access < tlb_.size(); ++access)
+        tlb_[access] = tlbs_[ctx_[access]][access].data();
+}
+
+void rv_mmu::flush_context(uint32_t ctx)
+{
+    for (auto& tlb: tlbs_[ctx]) {
+        for (auto& entry: tlb) {
+            entry.tag = RV_TLB_INVALID;
+            entry.vpage = RV_TLB_INVALID;
+        }
+    }
+}
+
+void rv_mmu::set_satp(rv_uint satp)
+{
+    satp_ = satp;
+    flush();
+    update_context();
+}
+
+void rv_mmu::set_context(uint32_t fetch_priv, uint32_t data_priv, bool sum, bool mxr)
+{
+    // permissions of the cached translations depend on these
+    if (sum != sum_ || mxr != mxr_) {
+        sum_ = sum;
+        mxr_ = mxr;
+        flush();
+    }
+    fetch_priv_ = fetch_priv;
+    data_priv_ = data_priv;
+    update_context();
+}
+
+void rv_mmu::flush()
+{
+    // the bare context only changes when RAM pages change permissions
+    flush_context(RV_MMU_SUPERVISOR);
+    flush_context(RV_MMU_USER);
+}
+
+void rv_mmu::flush(rv_uint address)
+{
+    const rv_uint vpage = address & ~RV_MEMORY_PAGE_MASK;
+    for (auto ctx: { RV_MMU_SUPERVISOR, RV_MMU_USER }) {
+        for (auto& tlb: tlbs_[ctx]) {
+            auto& entry = tlb[tlb_index(address)];
+            if (entry.vpage == vpage) {
+                entry.tag = RV_TLB_INVALID;
+                entry.vpage = RV_TLB_INVALID;
+            }
+        }
+    }
+}
+
+void rv_mmu::protect_page(rv_uint address)
+{
+    // rare (once per page turning into code), not worth looking for the entries mapping it
+    for (auto& tlbs: tlbs_) {
+        for (auto& entry: tlbs[(size_t)rv_access::store]) {
+            entry.tag = RV_TLB_INVALID;
+            entry.vpage = RV_TLB_INVALID;
+        }
+    }
+}
+
+bool rv_mmu::raise(rv_exception code, rv_uint address)
+{
+    fault_ = code;
+    fault_address_ = address;
+    return false;
+}
+
+bool rv_mmu::refill(rv_uint address, rv_access access)
+{
+    const auto ctx = ctx_[(size_t)access];
+    const rv_uint vpage = address & ~RV_MEMORY_PAGE_MASK;
+    rv_uint ppage = vpage;
+    if (ctx != RV_MMU_BARE && !walk(address, access, ctx, ppage))
+        return false;
+
+    // fetches only need the physical address, the decode cache reads from it
+    // a store follows a store refill, clean pages turn dirty (and writable) right away
+    auto& entry = tlb_entry(access, address);
+    uint8_t *host = nullptr;
+    if (access == rv_access::store)
+        host = memory_.store_page(ppage);
+    else if (access == rv_access::load)
+        host = memory_.host_page(ppage, RV_PAGE_R);
+    entry.vpage = vpage;
+    if (host != nullptr) {
+        entry.tag = vpage;
+        entry.data = (uintptr_t)host - vpage;
+    }
+    else {
+        entry.tag = RV_TLB_INVALID;
+        entry.data = ppage;
+    }
+    return true;
+}
+
+bool rv_mmu::walk(rv_uint address, rv_access access, uint32_t ctx, rv_uint& ppage)
+{
+    static const rv_exception page_faults[] = {
+        rv_exception::instruction_page_fault, rv_exception::load_page_fault, rv_exception::store_page_fault
+    };
+    static const rv_exception access_faults[] = {
+        rv_exception::instruction_access_fault, rv_exception::load_access_fault, rv_exception::store_access_fault
+    };
+
+    const auto page_fault = page_faults[(size_t)access];
+    const auto access_fault = access_faults[(size_t)access];
+
+    // physical addresses are 34 bits, we only have the lower 4 GiB
+    rv_ulong table = (rv_ulong)(satp_ & RV_SATP_PPN) << RV_MEMORY_PAGE_SHIFT;
+    for (int level = 1; level >= 0; --level) {
+        if (table >> 32 != 0)
+            return raise(access_fault, address);
+
+        const rv_uint pte_address = (rv_uint)table + ((address >> (RV_MEMORY_PAGE_SHIFT + level * 10)) & 0x3FF) * 4;
+        rv_uint pte;
+        if (!memory_.read(pte_address, pte))
+            return raise(access_fault, address);
+
+        if ((pte & RV_PTE_V) == 0 || (pte & (RV_PTE_R | RV_PTE_W)) == RV_PTE_W)
+            return raise(page_fault, address);
+
+        // pointer to the next level
+        if ((pte & (RV_PTE_R | RV_PTE_X)) == 0) {
+            table = (rv_ulong)(pte >> 10) << RV_MEMORY_PAGE_SHIFT;
+            continue;
+        }
+
+        // leaf, supervisor mode may touch user pages with SUM but never execute them
+        if (ctx == RV_MMU_USER ? (pte & RV_PTE_U) == 0 :
+                (pte & RV_PTE_U) != 0 && (access == rv_access::fetch || !sum_))
+            return raise(page_fault, address);
+
+        bool allowed;
+        switch (access) {
+        case rv_access::fetch: allowed = (pte & RV_PTE_X) != 0; break;
+        case rv_access::load: allowed = (pte & RV_PTE_R) != 0 || (mxr_ && (pte & RV_PTE_X) != 0); break;
+        default: allowed = (pte & RV_PTE_W) != 0; break;
+        }
+        if (!allowed)
+            return raise(page_fault, address);
+
+        // misaligned megapage
+        if (level == 1 && ((pte >> 10) & 0x3FF) != 0)
+            return raise(page_fault, address);
+
+        const rv_uint needed = RV_PTE_A | (access == rv_access::store ? RV_PTE_D : 0);
+        if ((pte & needed) != needed && !memory_.write(pte_address, pte | needed))
+            return raise(access_fault, address);
+
+        const rv_ulong paddr = level == 1 ?
+                ((rv_ulong)(pte >> 20) << 22) | (address & 0x3FF000) :
+                (rv_ulong)(pte >> 10) << RV_MEMORY_PAGE_SHIFT;
+        if (paddr >> 32 != 0)
+            return raise(access_fault, address);
+        ppage = (rv_uint)paddr;
+        return true;
+    }
+    return raise(page_fault, address);
+}
\ No newline at end of file
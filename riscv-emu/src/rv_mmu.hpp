@@ -0,0 +1,238 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <array>
+#include "rv_global.hpp"
+#include "rv_exceptions.hpp"
+#include "rv_memory.hpp"
+
+constexpr size_t RV_TLB_ENTRIES = 256;
+// never matches a tag, tags are page aligned with at most the alignment bits of an access set
+constexpr rv_uint RV_TLB_INVALID = RV_MEMORY_PAGE_MASK;
+
+// satp (Sv32)
+constexpr rv_uint RV_SATP_MODE = 0x80000000;
+constexpr rv_uint RV_SATP_ASID = 0x7FC00000;
+constexpr rv_uint RV_SATP_PPN = 0x003FFFFF;
+
+// page table entries
+constexpr rv_uint RV_PTE_V = 1 << 0;
+constexpr rv_uint RV_PTE_R = 1 << 1;
+constexpr rv_uint RV_PTE_W = 1 << 2;
+constexpr rv_uint RV_PTE_X = 1 << 3;
+constexpr rv_uint RV_PTE_U = 1 << 4;
+constexpr rv_uint RV_PTE_G = 1 << 5;
+constexpr rv_uint RV_PTE_A = 1 << 6;
+constexpr rv_uint RV_PTE_D = 1 << 7;
+
+// translation contexts, each one with its own set of TLBs so privilege changes don't flush anything
+// bare is used by machine mode and whenever satp.MODE is Bare
+constexpr uint32_t RV_MMU_BARE = 0;
+constexpr uint32_t RV_MMU_SUPERVISOR = 1;
+constexpr uint32_t RV_MMU_USER = 2;
+constexpr uint32_t RV_MMU_CONTEXTS = 3;
+
+enum class rv_access: uint32_t
+{
+    fetch = 0,
+    load = 1,
+    store = 2
+};
+
+// a translated virtual page
+// tag is set (to vpage) only if the page is RAM that can be accessed directly, then data is
+// the host address of the page minus vpage, otherwise data is the physical page
+struct rv_tlb_entry
+{
+    rv_uint tag;
+    rv_uint vpage;
+    uintptr_t data;
+};
+
+// Sv32 address translation, backed by direct mapped TLBs with separate entries for fetches, loads and stores
+// a load or store hitting the TLB costs a compare and an add, the page table is only walked on misses
+// the TLBs are flushed by sfence.vma and satp writes, accessed and dirty bits are set by the walk
+class rv_mmu
+{
+public:
+    rv_mmu() = delete;
+    explicit rv_mmu(rv_memory& memory);
+
+    rv_mmu(const rv_mmu&) = delete;
+    rv_mmu& operator=(const rv_mmu&) = delete;
+
+    void reset();
+
+    rv_uint satp() const { return satp_; }
+    void set_satp(rv_uint satp);
+
+    // privilege of fetches and of loads/stores (they differ with mstatus.MPRV) and mstatus.SUM/MXR
+    void set_context(uint32_t fetch_priv, uint32_t data_priv, bool sum, bool mxr);
+
+    // sfence.vma, the whole address space or only the page holding address
+    void flush();
+    void flush(rv_uint address);
+
+    // a RAM page turned read only, no store entry may point to it anymore
+    void protect_page(rv_uint address);
+
+    // translations of instruction fetches are identity mapped unless this is set
+    bool paged_fetch() const { return ctx_[(size_t)rv_access::fetch] != RV_MMU_BARE; }
+    // loads and stores are identity mapped
+    bool bare_data() const { return ctx_[(size_t)rv_access::load] == RV_MMU_BARE; }
+
+    rv_exception fault() const { return fault_; }
+    rv_uint fault_address() const { return fault_address_; }
+
+    // physical address of an instruction, the caller reads it from memory
+    bool translate_fetch(rv_uint address, rv_uint& paddr)
+    {
+        if (!paged_fetch()) {
+            paddr = address;
+            return true;
+        }
+        const auto& entry = tlb_entry(rv_access::fetch, address);
+        if (likely(entry.vpage == (address & ~RV_MEMORY_PAGE_MASK) || refill(address, rv_access::fetch))) {
+            paddr = (rv_uint)entry.data | (address & RV_MEMORY_PAGE_MASK);
+            return true;
+        }
+        return false;
+    }
+
+    template<typename T> bool read(rv_uint address, T& value)
+    {
+        const auto& entry = tlb_entry(rv_access::load, address);
+        if (likely(entry.tag == fast_tag<T>(address))) {
+            value = *(const T *)(entry.data + address);
+            return true;
+        }
+        return read_slow(address, value);
+    }
+
+    template<typename T> bool write(rv_uint address, T value)
+    {
+        const auto& entry = tlb_entry(rv_access::store, address);
+        if (likely(entry.tag == fast_tag<T>(address))) {
+            *(T *)(entry.data + address) = value;
+            return true;
+        }
+        return write_slow(address, value);
+    }
+
+    // host pointer for an atomic read-modify-write of the word at address, translated as a store
+    // host is nullptr if the page can't be accessed directly (code pages, devices)
+    bool atomic_address(rv_uint address, rv_uint*& host)
+    {
+        // slow entries are looked up again, the page may have become writable since
+        const auto& entry = tlb_entry(rv_access::store, address);
+        if (entry.tag != (address & ~RV_MEMORY_PAGE_MASK) && !refill(address, rv_access::store))
+            return false;
+        host = entry.tag == entry.vpage ? (rv_uint *)(entry.data + address) : nullptr;
+        return true;
+    }
+
+private:
+    friend class rv_jit;
+
+    static size_t tlb_index(rv_uint address) { return (address >> RV_MEMORY_PAGE_SHIFT) & (RV_TLB_ENTRIES - 1); }
+
+    // misaligned accesses keep their low bits and never match, they go through the slow path
+    template<typename T> static rv_uint fast_tag(rv_uint address)
+    {
+        return address & (~RV_MEMORY_PAGE_MASK | (sizeof(T) - 1));
+    }
+
+    template<typename T> static bool crosses_page(rv_uint address)
+    {
+        return (address & RV_MEMORY_PAGE_MASK) > RV_MEMORY_PAGE_SIZE - sizeof(T);
+    }
+
+    rv_tlb_entry& tlb_entry(rv_access access, rv_uint address)
+    {
+        return tlb_[(size_t)access][tlb_index(address)];
+    }
+
+    uint32_t context(uint32_t priv) const;
+    void update_context();
+    void flush_context(uint32_t ctx);
+
+    // translate address and fill its TLB entry, false with fault_ set on failure
+    bool refill(rv_uint address, rv_access access);
+    bool walk(rv_uint address, rv_access access, uint32_t ctx, rv_uint& ppage);
+    bool raise(rv_exception code, rv_uint address);
+
+    template<typename T> bool read_slow(rv_uint address, T& value)
+    {
+        if (crosses_page<T>(address)) {
+            // both pages are translated on their own
+            uint8_t bytes[sizeof(T)];
+            for (size_t i = 0; i < sizeof(T); ++i) {
+                if (!read(address + i, bytes[i]))
+                    return false;
+            }
+            memcpy(&value, bytes, sizeof(T));
+            return true;
+        }
+
+        const auto& entry = tlb_entry(rv_access::load, address);
+        if (entry.vpage != (address & ~RV_MEMORY_PAGE_MASK) && !refill(address, rv_access::load))
+            return false;
+        if (entry.tag == entry.vpage) {
+            value = *(const T *)(entry.data + address);
+            return true;
+        }
+        if (!memory_.read((rv_uint)entry.data | (address & RV_MEMORY_PAGE_MASK), value))
+            return raise(memory_.lastException(), address);
+        return true;
+    }
+
+    template<typename T> bool write_slow(rv_uint address, T value)
+    {
+        if (crosses_page<T>(address)) {
+            // check both pages before writing anything
+            if (!writable(address) || !writable(address + sizeof(T) - 1))
+                return false;
+            for (size_t i = 0; i < sizeof(T); ++i) {
+                if (!write(address + i, (uint8_t)(value >> (i * 8))))
+                    return false;
+            }
+            return true;
+        }
+
+        const auto& entry = tlb_entry(rv_access::store, address);
+        if (entry.vpage != (address & ~RV_MEMORY_PAGE_MASK) && !refill(address, rv_access::store))
+            return false;
+        if (entry.tag == entry.vpage) {
+            *(T *)(entry.data + address) = value;
+            return true;
+        }
+        // code pages and devices
+        if (!memory_.write((rv_uint)entry.data | (address & RV_MEMORY_PAGE_MASK), value))
+            return raise(memory_.lastException(), address);
+        return true;
+    }
+
+    bool writable(rv_uint address)
+    {
+        return tlb_entry(rv_access::store, address).vpage == (address & ~RV_MEMORY_PAGE_MASK) ||
+               refill(address, rv_access::store);
+    }
+
+private:
+    rv_memory& memory_;
+
+    // current tables for fetches, loads and stores
+    std::array<rv_tlb_entry*, 3> tlb_;
+    std::array<uint32_t, 3> ctx_;
+    // indexed by context, then by rv_access
+    std::array<std::array<std::array<rv_tlb_entry, RV_TLB_ENTRIES>, 3>, RV_MMU_CONTEXTS> tlbs_;
+
+    rv_uint satp_ = 0;
+    uint32_t fetch_priv_ = 3;
+    uint32_t data_priv_ = 3;
+    bool sum_ = false;
+    bool mxr_ = false;
+
+    rv_exception fault_ = rv_exception::load_access_fault;
+    rv_uint fault_address_ = 0;
+};
\ No newline at end of file
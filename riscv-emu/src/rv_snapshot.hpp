@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <type_traits>
+#include "rv_global.hpp"
+
+// snapshot file layout: rv_snapshot_header, the state of the harts, the event queue and the
+// devices as written by their save(), then the RAM image at ram_offset (page aligned, sparse)
+constexpr char RV_SNAPSHOT_MAGIC[8] = { 'R', 'V', 'S', 'N', 'A', 'P', 0, 0 };
+constexpr uint32_t RV_SNAPSHOT_VERSION = 1;
+
+struct rv_snapshot_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t harts;
+    uint64_t ram_size;
+    uint64_t state_size;
+    uint64_t ram_offset;
+};
+
+// host endian, snapshots are restored on the machine that took them
+class rv_snapshot_writer
+{
+public:
+    template<typename T> void put(const T& value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values are saved");
+        put_bytes(&value, sizeof(T));
+    }
+
+    void put_bytes(const void *data, size_t len)
+    {
+        const auto bytes = (const uint8_t *)data;
+        data_.insert(data_.end(), bytes, bytes + len);
+    }
+
+    const std::vector<uint8_t>& data() const { return data_; }
+
+private:
+    std::vector<uint8_t> data_;
+};
+
+// every get fails once the data ran out, callers only check the last one
+class rv_snapshot_reader
+{
+public:
+    rv_snapshot_reader(const uint8_t *data, size_t len) : data_{data}, len_{len} {}
+
+    template<typename T> bool get(T& value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "only plain values are restored");
+        return get_bytes(&value, sizeof(T));
+    }
+
+    bool get_bytes(void *data, size_t len)
+    {
+        if (failed_ || len > len_ - pos_) {
+            failed_ = true;
+            memset(data, 0, len);
+            return false;
+        }
+        memcpy(data, data_ + pos_, len);
+        pos_ += len;
+        return true;
+    }
+
+    bool ok() const { return !failed_; }
+
+private:
+    const uint8_t *data_;
+    size_t len_;
+    size_t pos_ = 0;
+    bool failed_ = false;
+};
\ No newline at end of file
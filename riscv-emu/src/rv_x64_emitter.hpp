@@ -0,0 +1,276 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+enum class x64_reg: uint8_t
+{
+    rax = 0, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+    r8, r9, r10, r11, r12, r13, r14, r15
+};
+
+enum class x64_cond: uint8_t
+{
+    o = 0x0, no = 0x1, b = 0x2, ae = 0x3, e = 0x4, ne = 0x5, be = 0x6, a = 0x7,
+    s = 0x8, ns = 0x9, l = 0xC, ge = 0xD, le = 0xE, g = 0xF
+};
+
+// opcode extensions of the 0x81/0x83 group, also used to pick the r/m forms
+enum class x64_alu: uint8_t
+{
+    add = 0, or_ = 1, and_ = 4, sub = 5, xor_ = 6, cmp = 7
+};
+
+enum class x64_shift: uint8_t
+{
+    shl = 4, shr = 5, sar = 7
+};
+
+// memory operand [base + index * (1 << scale) + disp], rsp as index means no index
+struct x64_mem
+{
+    x64_reg base;
+    int32_t disp;
+    x64_reg index = x64_reg::rsp;
+    uint8_t scale = 0;
+};
+
+// retarget an emitted rel32 jump, at points to the rel32 itself
+inline void x64_patch_rel32(uint8_t *at, const void *target)
+{
+    const int32_t rel = (int32_t)((const uint8_t *)target - (at + 4));
+    memcpy(at, &rel, sizeof(rel));
+}
+
+inline void x64_patch_imm32(uint8_t *at, uint32_t value)
+{
+    memcpy(at, &value, sizeof(value));
+}
+
+// overwrite the instruction at at with a short jump, in a single store
+// target must be within a rel8 of at + 2, and the instruction at least 2 bytes long
+inline void x64_patch_jmp8(uint8_t *at, const void *target)
+{
+    const uint16_t jmp = (uint16_t)(0xeb | (uint8_t)((const uint8_t *)target - (at + 2)) << 8);
+    __atomic_store_n((uint16_t *)at, jmp, __ATOMIC_RELAXED);
+}
+
+// minimal x86-64 encoder, writing into a caller provided buffer
+// running out of space sets overflow() and stops emitting, callers check it once at the end
+class x64_emitter
+{
+public:
+    x64_emitter(uint8_t *buf, size_t capacity)
+        : buf_{buf}, capacity_{capacity}
+    {
+
+    }
+
+    uint8_t *code() const { return buf_; }
+    size_t size() const { return size_; }
+    bool overflow() const { return overflow_; }
+    uint8_t *cur() const { return buf_ + size_; }
+
+    void byte(uint8_t b)
+    {
+        if (size_ < capacity_)
+            buf_[size_++] = b;
+        else
+            overflow_ = true;
+    }
+
+    void dword(uint32_t v)
+    {
+        for (int i = 0; i < 4; ++i)
+            byte((v >> (i * 8)) & 0xFF);
+    }
+
+    void qword(uint64_t v)
+    {
+        dword((uint32_t)v);
+        dword((uint32_t)(v >> 32));
+    }
+
+    // 32bit operations
+    void mov(x64_reg dst, x64_mem src) { op_rm(0x8B, dst, src); }
+    void mov(x64_mem dst, x64_reg src) { op_rm(0x89, src, dst); }
+    void mov(x64_reg dst, x64_reg src) { op_rr(0x8B, dst, src); }
+    void mov(x64_reg dst, uint32_t imm) { rex(false, 0, 0, reg(dst)); byte(0xB8 + (reg(dst) & 7)); dword(imm); }
+    void mov(x64_mem dst, uint32_t imm) { op_rm(0xC7, 0, dst); dword(imm); }
+    void movzx8(x64_reg dst, x64_reg src) { op_rr(0x0F, 0xB6, dst, src, false); }
+    void movzx8(x64_reg dst, x64_mem src) { op_rm(0x0F, 0xB6, dst, src, false); }
+    void movsx8(x64_reg dst, x64_mem src) { op_rm(0x0F, 0xBE, dst, src, false); }
+    void movzx16(x64_reg dst, x64_mem src) { op_rm(0x0F, 0xB7, dst, src, false); }
+    void movsx16(x64_reg dst, x64_mem src) { op_rm(0x0F, 0xBF, dst, src, false); }
+    // narrow stores of the low byte/word of src
+    void mov8(x64_mem dst, x64_reg src) { rex(false, reg(src), reg(dst.index), reg(dst.base), reg(src) >= 4); byte(0x88); modrm_mem(reg(src), dst); }
+    void mov16(x64_mem dst, x64_reg src) { byte(0x66); op_rm(0x89, src, dst); }
+
+    void alu(x64_alu op, x64_reg dst, x64_mem src) { op_rm(alu_opcode(op), dst, src); }
+    void alu(x64_alu op, x64_reg dst, x64_reg src) { op_rr(alu_opcode(op), dst, src); }
+    void alu(x64_alu op, x64_reg dst, int32_t imm)
+    {
+        if (imm >= -128 && imm <= 127) {
+            op_rr(0x83, (uint8_t)op, dst);
+            byte((uint8_t)imm);
+        }
+        else {
+            op_rr(0x81, (uint8_t)op, dst);
+            dword((uint32_t)imm);
+        }
+    }
+
+    // cmp with a 32bit immediate meant to be patched later, returns the offset of the immediate
+    size_t cmp_imm32(x64_reg dst, uint32_t imm)
+    {
+        op_rr(0x81, (uint8_t)x64_alu::cmp, dst);
+        const size_t at = size_;
+        dword(imm);
+        return at;
+    }
+
+    void shift(x64_shift op, x64_reg dst, uint8_t imm) { op_rr(0xC1, (uint8_t)op, dst); byte(imm); }
+    void shift_cl(x64_shift op, x64_reg dst) { op_rr(0xD3, (uint8_t)op, dst); }
+
+    void imul(x64_reg dst, x64_mem src) { op_rm(0x0F, 0xAF, dst, src, false); }
+    void imul(x64_reg dst, x64_reg src) { op_rr(0x0F, 0xAF, dst, src, false); }
+    void cdq() { byte(0x99); }
+    void idiv(x64_reg src) { op_rr(0xF7, 7, src); }
+    void div(x64_reg src) { op_rr(0xF7, 6, src); }
+    void test(x64_reg a, x64_reg b) { op_rr(0x85, b, a); }
+    void test8(x64_reg a, x64_reg b) { op_rr(0x84, b, a); }
+    void setcc(x64_cond cc, x64_reg dst) { op_rr(0x0F, 0x90 + (uint8_t)cc, 0, dst, false); }
+
+    // 64bit operations
+    void mov64(x64_reg dst, uint64_t imm) { rex(true, 0, 0, reg(dst)); byte(0xB8 + (reg(dst) & 7)); qword(imm); }
+    void mov64(x64_reg dst, x64_reg src) { op_rr(0x8B, dst, src, true); }
+    void mov64(x64_reg dst, x64_mem src) { op_rm(0x8B, dst, src, true); }
+    void mov64(x64_mem dst, x64_reg src) { op_rm(0x89, src, dst, true); }
+    void movsxd(x64_reg dst, x64_mem src) { op_rm(0x63, dst, src, true); }
+    void movsxd(x64_reg dst, x64_reg src) { op_rr(0x63, dst, src, true); }
+    void imul64(x64_reg dst, x64_reg src) { op_rr(0x0F, 0xAF, dst, src, true); }
+    void shift64(x64_shift op, x64_reg dst, uint8_t imm) { op_rr(0xC1, (uint8_t)op, dst, true); byte(imm); }
+    void test64(x64_reg a, x64_reg b) { op_rr(0x85, b, a, true); }
+    void alu64(x64_alu op, x64_reg dst, x64_reg src) { op_rr(alu_opcode(op), dst, src, true); }
+    void alu64(x64_alu op, x64_reg dst, int32_t imm)
+    {
+        if (imm >= -128 && imm <= 127) {
+            op_rr(0x83, (uint8_t)op, dst, true);
+            byte((uint8_t)imm);
+        }
+        else {
+            op_rr(0x81, (uint8_t)op, dst, true);
+            dword((uint32_t)imm);
+        }
+    }
+    void alu64(x64_alu op, x64_mem dst, int32_t imm)
+    {
+        if (imm >= -128 && imm <= 127) {
+            op_rm(0x83, (uint8_t)op, dst, true);
+            byte((uint8_t)imm);
+        }
+        else {
+            op_rm(0x81, (uint8_t)op, dst, true);
+            dword((uint32_t)imm);
+        }
+    }
+    void cmp8(x64_mem dst, uint8_t imm) { op_rm(0x80, 7, dst); byte(imm); }
+
+    void push(x64_reg r) { rex(false, 0, 0, reg(r)); byte(0x50 + (reg(r) & 7)); }
+    void pop(x64_reg r) { rex(false, 0, 0, reg(r)); byte(0x58 + (reg(r) & 7)); }
+    void call(x64_reg r) { op_rr(0xFF, 2, r); }
+    void jmp(x64_reg r) { op_rr(0xFF, 4, r); }
+    void ret() { byte(0xC3); }
+
+    // relative jumps, the returned offset is where the rel32 lives
+    size_t jmp(const uint8_t *target = nullptr) { byte(0xE9); return rel32(target); }
+    size_t jcc(x64_cond cc, const uint8_t *target = nullptr) { byte(0x0F); byte(0x80 + (uint8_t)cc); return rel32(target); }
+
+    // point a previously emitted rel32 at target
+    void patch(size_t at, const uint8_t *target)
+    {
+        if (!overflow_)
+            x64_patch_rel32(buf_ + at, target);
+    }
+
+    // point a previously emitted rel32 at the current position
+    void bind(size_t at) { patch(at, cur()); }
+
+private:
+    static uint8_t reg(x64_reg r) { return (uint8_t)r; }
+    static uint8_t reg(uint8_t r) { return r; }
+
+    static uint8_t alu_opcode(x64_alu op) { return ((uint8_t)op << 3) | 0x03; }
+
+    void rex(bool w, uint8_t r, uint8_t x, uint8_t b, bool force = false)
+    {
+        const uint8_t v = 0x40 | (w ? 8 : 0) | ((r >> 3) & 1) << 2 | ((x >> 3) & 1) << 1 | ((b >> 3) & 1);
+        if (v != 0x40 || force)
+            byte(v);
+    }
+
+    void modrm_mem(uint8_t r, x64_mem m)
+    {
+        const uint8_t base = reg(m.base) & 7;
+        const bool indexed = m.index != x64_reg::rsp;
+        const bool disp8 = m.disp >= -128 && m.disp <= 127;
+        byte((disp8 ? 0x40 : 0x80) | ((r & 7) << 3) | (indexed ? 4 : base));
+        if (indexed)
+            byte((m.scale << 6) | ((reg(m.index) & 7) << 3) | base);
+        else if (base == 4)  // rsp/r12 need a SIB byte
+            byte(0x24);
+        if (disp8)
+            byte((uint8_t)m.disp);
+        else
+            dword((uint32_t)m.disp);
+    }
+
+    template<typename R>
+    void op_rm(uint8_t opcode, R r, x64_mem m, bool w = false)
+    {
+        rex(w, reg(r), reg(m.index), reg(m.base));
+        byte(opcode);
+        modrm_mem(reg(r), m);
+    }
+
+    template<typename R>
+    void op_rm(uint8_t opcode1, uint8_t opcode2, R r, x64_mem m, bool w)
+    {
+        rex(w, reg(r), reg(m.index), reg(m.base));
+        byte(opcode1);
+        byte(opcode2);
+        modrm_mem(reg(r), m);
+    }
+
+    template<typename R>
+    void op_rr(uint8_t opcode, R r, x64_reg rm, bool w = false)
+    {
+        rex(w, reg(r), 0, reg(rm));
+        byte(opcode);
+        byte(0xC0 | ((reg(r) & 7) << 3) | (reg(rm) & 7));
+    }
+
+    template<typename R>
+    void op_rr(uint8_t opcode1, uint8_t opcode2, R r, x64_reg rm, bool w)
+    {
+        rex(w, reg(r), 0, reg(rm));
+        byte(opcode1);
+        byte(opcode2);
+        byte(0xC0 | ((reg(r) & 7) << 3) | (reg(rm) & 7));
+    }
+
+    size_t rel32(const uint8_t *target)
+    {
+        const size_t at = size_;
+        dword(0);
+        if (target != nullptr)
+            patch(at, target);
+        return at;
+    }
+
+private:
+    uint8_t *buf_;
+    size_t capacity_;
+    size_t size_ = 0;
+    bool overflow_ = false;
+};
\ No newline at end of file